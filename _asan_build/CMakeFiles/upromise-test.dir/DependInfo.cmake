@@ -0,0 +1,26 @@
+
+# Consider dependencies only in project.
+set(CMAKE_DEPENDS_IN_PROJECT_ONLY OFF)
+
+# The set of languages for which implicit dependencies are needed:
+set(CMAKE_DEPENDS_LANGUAGES
+  )
+
+# The set of dependency files which are needed:
+set(CMAKE_DEPENDS_DEPENDENCY_FILES
+  "/root/repo/test/adoption-test.cpp" "CMakeFiles/upromise-test.dir/test/adoption-test.cpp.o" "gcc" "CMakeFiles/upromise-test.dir/test/adoption-test.cpp.o.d"
+  "/root/repo/test/async-test.cpp" "CMakeFiles/upromise-test.dir/test/async-test.cpp.o" "gcc" "CMakeFiles/upromise-test.dir/test/async-test.cpp.o.d"
+  "/root/repo/test/combinator-test.cpp" "CMakeFiles/upromise-test.dir/test/combinator-test.cpp.o" "gcc" "CMakeFiles/upromise-test.dir/test/combinator-test.cpp.o.d"
+  "/root/repo/test/dispatcher-test.cpp" "CMakeFiles/upromise-test.dir/test/dispatcher-test.cpp.o" "gcc" "CMakeFiles/upromise-test.dir/test/dispatcher-test.cpp.o.d"
+  "/root/repo/test/executor-test.cpp" "CMakeFiles/upromise-test.dir/test/executor-test.cpp.o" "gcc" "CMakeFiles/upromise-test.dir/test/executor-test.cpp.o.d"
+  "/root/repo/test/io-test.cpp" "CMakeFiles/upromise-test.dir/test/io-test.cpp.o" "gcc" "CMakeFiles/upromise-test.dir/test/io-test.cpp.o.d"
+  "/root/repo/test/test.cpp" "CMakeFiles/upromise-test.dir/test/test.cpp.o" "gcc" "CMakeFiles/upromise-test.dir/test/test.cpp.o.d"
+  )
+
+# Targets to which this target links.
+set(CMAKE_TARGET_LINKED_INFO_FILES
+  "/root/repo/_asan_build/CMakeFiles/upromise.dir/DependInfo.cmake"
+  )
+
+# Fortran module output directory.
+set(CMAKE_Fortran_TARGET_MODULE_DIR "")
@@ -0,0 +1,5 @@
+if(EXISTS "/root/repo/_asan_build/upromise-test_tests-55419e4.cmake")
+  include("/root/repo/_asan_build/upromise-test_tests-55419e4.cmake")
+else()
+  add_test(upromise-test_NOT_BUILT-55419e4 upromise-test_NOT_BUILT-55419e4)
+endif()
@@ -0,0 +1,69 @@
+add_test( [==[2.1.2.1: When fulfilled, a promise: must not transition to any other state.]==] /root/repo/_asan_build/upromise-test [==[2.1.2.1: When fulfilled\, a promise: must not transition to any other state.]==]  )
+set_tests_properties( [==[2.1.2.1: When fulfilled, a promise: must not transition to any other state.]==] PROPERTIES WORKING_DIRECTORY /root/repo/_asan_build)
+add_test( [==[2.1.3.1: When rejected, a promise: must not transition to any other state.]==] /root/repo/_asan_build/upromise-test [==[2.1.3.1: When rejected\, a promise: must not transition to any other state.]==]  )
+set_tests_properties( [==[2.1.3.1: When rejected, a promise: must not transition to any other state.]==] PROPERTIES WORKING_DIRECTORY /root/repo/_asan_build)
+add_test( [==[2.2.1: Both `onFulfilled` and `onRejected` are optional arguments.]==] /root/repo/_asan_build/upromise-test [==[2.2.1: Both `onFulfilled` and `onRejected` are optional arguments.]==]  )
+set_tests_properties( [==[2.2.1: Both `onFulfilled` and `onRejected` are optional arguments.]==] PROPERTIES WORKING_DIRECTORY /root/repo/_asan_build)
+add_test( [==[2.2.2: If `onFulfilled` is a function,]==] /root/repo/_asan_build/upromise-test [==[2.2.2: If `onFulfilled` is a function\,]==]  )
+set_tests_properties( [==[2.2.2: If `onFulfilled` is a function,]==] PROPERTIES WORKING_DIRECTORY /root/repo/_asan_build)
+add_test( [==[2.2.3: If `onRejected` is a function,]==] /root/repo/_asan_build/upromise-test [==[2.2.3: If `onRejected` is a function\,]==]  )
+set_tests_properties( [==[2.2.3: If `onRejected` is a function,]==] PROPERTIES WORKING_DIRECTORY /root/repo/_asan_build)
+add_test( [==[2.2.4: `onFulfilled` or `onRejected` must not be called until the execution context stack contains only platform code.]==] /root/repo/_asan_build/upromise-test [==[2.2.4: `onFulfilled` or `onRejected` must not be called until the execution context stack contains only platform code.]==]  )
+set_tests_properties( [==[2.2.4: `onFulfilled` or `onRejected` must not be called until the execution context stack contains only platform code.]==] PROPERTIES WORKING_DIRECTORY /root/repo/_asan_build)
+add_test( [==[2.2.5 `onFulfilled` and `onRejected` must be called as functions (i.e. with no `this` value).]==] /root/repo/_asan_build/upromise-test [==[2.2.5 `onFulfilled` and `onRejected` must be called as functions (i.e. with no `this` value).]==]  )
+set_tests_properties( [==[2.2.5 `onFulfilled` and `onRejected` must be called as functions (i.e. with no `this` value).]==] PROPERTIES WORKING_DIRECTORY /root/repo/_asan_build)
+add_test( [==[2.2.6: `then` may be called multiple times on the same promise.]==] /root/repo/_asan_build/upromise-test [==[2.2.6: `then` may be called multiple times on the same promise.]==]  )
+set_tests_properties( [==[2.2.6: `then` may be called multiple times on the same promise.]==] PROPERTIES WORKING_DIRECTORY /root/repo/_asan_build)
+add_test( [==[2.2.7: `then` must return a promise: `promise2 = promise1.then(onFulfilled, onRejected)`]==] /root/repo/_asan_build/upromise-test [==[2.2.7: `then` must return a promise: `promise2 = promise1.then(onFulfilled\, onRejected)`]==]  )
+set_tests_properties( [==[2.2.7: `then` must return a promise: `promise2 = promise1.then(onFulfilled, onRejected)`]==] PROPERTIES WORKING_DIRECTORY /root/repo/_asan_build)
+add_test( [==[2.3.1: If `promise` and `x` refer to the same object, reject `promise` with a `TypeError' as the reason.]==] /root/repo/_asan_build/upromise-test [==[2.3.1: If `promise` and `x` refer to the same object\, reject `promise` with a `TypeError' as the reason.]==]  )
+set_tests_properties( [==[2.3.1: If `promise` and `x` refer to the same object, reject `promise` with a `TypeError' as the reason.]==] PROPERTIES WORKING_DIRECTORY /root/repo/_asan_build)
+add_test( [==[2.3.2: If `x` is a promise, adopt its state]==] /root/repo/_asan_build/upromise-test [==[2.3.2: If `x` is a promise\, adopt its state]==]  )
+set_tests_properties( [==[2.3.2: If `x` is a promise, adopt its state]==] PROPERTIES WORKING_DIRECTORY /root/repo/_asan_build)
+add_test( [==[2.3.3: Otherwise, if `x` is an object or function,]==] /root/repo/_asan_build/upromise-test [==[2.3.3: Otherwise\, if `x` is an object or function\,]==]  )
+set_tests_properties( [==[2.3.3: Otherwise, if `x` is an object or function,]==] PROPERTIES WORKING_DIRECTORY /root/repo/_asan_build)
+add_test( [==[2.3.4: If `x` is not an object or function, fulfill `promise` with `x`]==] /root/repo/_asan_build/upromise-test [==[2.3.4: If `x` is not an object or function\, fulfill `promise` with `x`]==]  )
+set_tests_properties( [==[2.3.4: If `x` is not an object or function, fulfill `promise` with `x`]==] PROPERTIES WORKING_DIRECTORY /root/repo/_asan_build)
+add_test( [==[async/await demo]==] /root/repo/_asan_build/upromise-test [==[async/await demo]==]  )
+set_tests_properties( [==[async/await demo]==] PROPERTIES WORKING_DIRECTORY /root/repo/_asan_build)
+add_test( [==[generator demo]==] /root/repo/_asan_build/upromise-test [==[generator demo]==]  )
+set_tests_properties( [==[generator demo]==] PROPERTIES WORKING_DIRECTORY /root/repo/_asan_build)
+add_test( [==[async-generator demo]==] /root/repo/_asan_build/upromise-test [==[async-generator demo]==]  )
+set_tests_properties( [==[async-generator demo]==] PROPERTIES WORKING_DIRECTORY /root/repo/_asan_build)
+add_test( [==[dedicated stack dispatcher]==] /root/repo/_asan_build/upromise-test [==[dedicated stack dispatcher]==]  )
+set_tests_properties( [==[dedicated stack dispatcher]==] PROPERTIES WORKING_DIRECTORY /root/repo/_asan_build)
+add_test( [==[dedicated stacks run out]==] /root/repo/_asan_build/upromise-test [==[dedicated stacks run out]==]  )
+set_tests_properties( [==[dedicated stacks run out]==] PROPERTIES WORKING_DIRECTORY /root/repo/_asan_build)
+add_test( [==[coroutine ids]==] /root/repo/_asan_build/upromise-test [==[coroutine ids]==]  )
+set_tests_properties( [==[coroutine ids]==] PROPERTIES WORKING_DIRECTORY /root/repo/_asan_build)
+add_test( [==[coroutine transfer]==] /root/repo/_asan_build/upromise-test [==[coroutine transfer]==]  )
+set_tests_properties( [==[coroutine transfer]==] PROPERTIES WORKING_DIRECTORY /root/repo/_asan_build)
+add_test( timers /root/repo/_asan_build/upromise-test timers  )
+set_tests_properties( timers PROPERTIES WORKING_DIRECTORY /root/repo/_asan_build)
+add_test( [==[cancel tokens]==] /root/repo/_asan_build/upromise-test [==[cancel tokens]==]  )
+set_tests_properties( [==[cancel tokens]==] PROPERTIES WORKING_DIRECTORY /root/repo/_asan_build)
+add_test( executor /root/repo/_asan_build/upromise-test executor  )
+set_tests_properties( executor PROPERTIES WORKING_DIRECTORY /root/repo/_asan_build)
+add_test( [==[cross-thread resolve]==] /root/repo/_asan_build/upromise-test [==[cross-thread resolve]==]  )
+set_tests_properties( [==[cross-thread resolve]==] PROPERTIES WORKING_DIRECTORY /root/repo/_asan_build)
+add_test( [==[idle workers serve their dispatchers]==] /root/repo/_asan_build/upromise-test [==[idle workers serve their dispatchers]==]  )
+set_tests_properties( [==[idle workers serve their dispatchers]==] PROPERTIES WORKING_DIRECTORY /root/repo/_asan_build)
+add_test( [==[async bodies need an executor that can move them]==] /root/repo/_asan_build/upromise-test [==[async bodies need an executor that can move them]==]  )
+set_tests_properties( [==[async bodies need an executor that can move them]==] PROPERTIES WORKING_DIRECTORY /root/repo/_asan_build)
+add_test( [==[run forever]==] /root/repo/_asan_build/upromise-test [==[run forever]==]  )
+set_tests_properties( [==[run forever]==] PROPERTIES WORKING_DIRECTORY /root/repo/_asan_build)
+add_test( [==[a dispatcher needs its wake fd]==] /root/repo/_asan_build/upromise-test [==[a dispatcher needs its wake fd]==]  )
+set_tests_properties( [==[a dispatcher needs its wake fd]==] PROPERTIES WORKING_DIRECTORY /root/repo/_asan_build)
+add_test( [==[budgeted runs]==] /root/repo/_asan_build/upromise-test [==[budgeted runs]==]  )
+set_tests_properties( [==[budgeted runs]==] PROPERTIES WORKING_DIRECTORY /root/repo/_asan_build)
+add_test( [==[priority lanes]==] /root/repo/_asan_build/upromise-test [==[priority lanes]==]  )
+set_tests_properties( [==[priority lanes]==] PROPERTIES WORKING_DIRECTORY /root/repo/_asan_build)
+add_test( reactor /root/repo/_asan_build/upromise-test reactor  )
+set_tests_properties( reactor PROPERTIES WORKING_DIRECTORY /root/repo/_asan_build)
+add_test( combinators /root/repo/_asan_build/upromise-test combinators  )
+set_tests_properties( combinators PROPERTIES WORKING_DIRECTORY /root/repo/_asan_build)
+add_test( [==[redirect chains]==] /root/repo/_asan_build/upromise-test [==[redirect chains]==]  )
+set_tests_properties( [==[redirect chains]==] PROPERTIES WORKING_DIRECTORY /root/repo/_asan_build)
+add_test( [==[recursive loops run in constant memory]==] /root/repo/_asan_build/upromise-test [==[recursive loops run in constant memory]==]  )
+set_tests_properties( [==[recursive loops run in constant memory]==] PROPERTIES WORKING_DIRECTORY /root/repo/_asan_build)
+set( upromise-test_TESTS [==[2.1.2.1: When fulfilled, a promise: must not transition to any other state.]==] [==[2.1.3.1: When rejected, a promise: must not transition to any other state.]==] [==[2.2.1: Both `onFulfilled` and `onRejected` are optional arguments.]==] [==[2.2.2: If `onFulfilled` is a function,]==] [==[2.2.3: If `onRejected` is a function,]==] [==[2.2.4: `onFulfilled` or `onRejected` must not be called until the execution context stack contains only platform code.]==] [==[2.2.5 `onFulfilled` and `onRejected` must be called as functions (i.e. with no `this` value).]==] [==[2.2.6: `then` may be called multiple times on the same promise.]==] [==[2.2.7: `then` must return a promise: `promise2 = promise1.then(onFulfilled, onRejected)`]==] [==[2.3.1: If `promise` and `x` refer to the same object, reject `promise` with a `TypeError' as the reason.]==] [==[2.3.2: If `x` is a promise, adopt its state]==] [==[2.3.3: Otherwise, if `x` is an object or function,]==] [==[2.3.4: If `x` is not an object or function, fulfill `promise` with `x`]==] [==[async/await demo]==] [==[generator demo]==] [==[async-generator demo]==] [==[dedicated stack dispatcher]==] [==[dedicated stacks run out]==] [==[coroutine ids]==] [==[coroutine transfer]==] timers [==[cancel tokens]==] executor [==[cross-thread resolve]==] [==[idle workers serve their dispatchers]==] [==[async bodies need an executor that can move them]==] [==[run forever]==] [==[a dispatcher needs its wake fd]==] [==[budgeted runs]==] [==[priority lanes]==] reactor combinators [==[redirect chains]==] [==[recursive loops run in constant memory]==])
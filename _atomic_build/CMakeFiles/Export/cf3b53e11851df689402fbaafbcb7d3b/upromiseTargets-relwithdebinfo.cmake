@@ -0,0 +1,19 @@
+#----------------------------------------------------------------
+# Generated CMake target import file for configuration "RelWithDebInfo".
+#----------------------------------------------------------------
+
+# Commands may need to know the format version.
+set(CMAKE_IMPORT_FILE_VERSION 1)
+
+# Import target "upromise::upromise" for configuration "RelWithDebInfo"
+set_property(TARGET upromise::upromise APPEND PROPERTY IMPORTED_CONFIGURATIONS RELWITHDEBINFO)
+set_target_properties(upromise::upromise PROPERTIES
+  IMPORTED_LINK_INTERFACE_LANGUAGES_RELWITHDEBINFO "C"
+  IMPORTED_LOCATION_RELWITHDEBINFO "${_IMPORT_PREFIX}/lib/libupromise.a"
+  )
+
+list(APPEND _cmake_import_check_targets upromise::upromise )
+list(APPEND _cmake_import_check_files_for_upromise::upromise "${_IMPORT_PREFIX}/lib/libupromise.a" )
+
+# Commands beyond this point should not need to know the version.
+set(CMAKE_IMPORT_FILE_VERSION)
@@ -0,0 +1,24 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/upromise-test.dir/test/adoption-test.cpp.o"
+  "CMakeFiles/upromise-test.dir/test/adoption-test.cpp.o.d"
+  "CMakeFiles/upromise-test.dir/test/async-test.cpp.o"
+  "CMakeFiles/upromise-test.dir/test/async-test.cpp.o.d"
+  "CMakeFiles/upromise-test.dir/test/combinator-test.cpp.o"
+  "CMakeFiles/upromise-test.dir/test/combinator-test.cpp.o.d"
+  "CMakeFiles/upromise-test.dir/test/dispatcher-test.cpp.o"
+  "CMakeFiles/upromise-test.dir/test/dispatcher-test.cpp.o.d"
+  "CMakeFiles/upromise-test.dir/test/executor-test.cpp.o"
+  "CMakeFiles/upromise-test.dir/test/executor-test.cpp.o.d"
+  "CMakeFiles/upromise-test.dir/test/io-test.cpp.o"
+  "CMakeFiles/upromise-test.dir/test/io-test.cpp.o.d"
+  "CMakeFiles/upromise-test.dir/test/test.cpp.o"
+  "CMakeFiles/upromise-test.dir/test/test.cpp.o.d"
+  "upromise-test"
+  "upromise-test.pdb"
+  "upromise-test_tests-55419e4.cmake"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang CXX)
+  include(CMakeFiles/upromise-test.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
@@ -0,0 +1,25 @@
+
+# Consider dependencies only in project.
+set(CMAKE_DEPENDS_IN_PROJECT_ONLY OFF)
+
+# The set of languages for which implicit dependencies are needed:
+set(CMAKE_DEPENDS_LANGUAGES
+  )
+
+# The set of dependency files which are needed:
+set(CMAKE_DEPENDS_DEPENDENCY_FILES
+  "/root/repo/src/async.c" "CMakeFiles/upromise.dir/src/async.c.o" "gcc" "CMakeFiles/upromise.dir/src/async.c.o.d"
+  "/root/repo/src/cancel.c" "CMakeFiles/upromise.dir/src/cancel.c.o" "gcc" "CMakeFiles/upromise.dir/src/cancel.c.o.d"
+  "/root/repo/src/coroutine.c" "CMakeFiles/upromise.dir/src/coroutine.c.o" "gcc" "CMakeFiles/upromise.dir/src/coroutine.c.o.d"
+  "/root/repo/src/executor.c" "CMakeFiles/upromise.dir/src/executor.c.o" "gcc" "CMakeFiles/upromise.dir/src/executor.c.o.d"
+  "/root/repo/src/io.c" "CMakeFiles/upromise.dir/src/io.c.o" "gcc" "CMakeFiles/upromise.dir/src/io.c.o.d"
+  "/root/repo/src/timer.c" "CMakeFiles/upromise.dir/src/timer.c.o" "gcc" "CMakeFiles/upromise.dir/src/timer.c.o.d"
+  "/root/repo/src/upromise.c" "CMakeFiles/upromise.dir/src/upromise.c.o" "gcc" "CMakeFiles/upromise.dir/src/upromise.c.o.d"
+  )
+
+# Targets to which this target links.
+set(CMAKE_TARGET_LINKED_INFO_FILES
+  )
+
+# Fortran module output directory.
+set(CMAKE_Fortran_TARGET_MODULE_DIR "")
@@ -0,0 +1,23 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/upromise.dir/src/async.c.o"
+  "CMakeFiles/upromise.dir/src/async.c.o.d"
+  "CMakeFiles/upromise.dir/src/cancel.c.o"
+  "CMakeFiles/upromise.dir/src/cancel.c.o.d"
+  "CMakeFiles/upromise.dir/src/coroutine.c.o"
+  "CMakeFiles/upromise.dir/src/coroutine.c.o.d"
+  "CMakeFiles/upromise.dir/src/executor.c.o"
+  "CMakeFiles/upromise.dir/src/executor.c.o.d"
+  "CMakeFiles/upromise.dir/src/io.c.o"
+  "CMakeFiles/upromise.dir/src/io.c.o.d"
+  "CMakeFiles/upromise.dir/src/timer.c.o"
+  "CMakeFiles/upromise.dir/src/timer.c.o.d"
+  "CMakeFiles/upromise.dir/src/upromise.c.o"
+  "CMakeFiles/upromise.dir/src/upromise.c.o.d"
+  "libupromise.a"
+  "libupromise.pdb"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang C)
+  include(CMakeFiles/upromise.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
@@ -0,0 +1,5 @@
+if(EXISTS "/root/repo/_atomic_build/upromise-test_tests-950b200.cmake")
+  include("/root/repo/_atomic_build/upromise-test_tests-950b200.cmake")
+else()
+  add_test(upromise-test_NOT_BUILT-950b200 upromise-test_NOT_BUILT-950b200)
+endif()
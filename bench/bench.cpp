@@ -0,0 +1,582 @@
+#include <upromise/async.h>
+#include <upromise/io.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
+// upromise-bench [--quick] [--out FILE]
+//
+// Runs every benchmark a few times and keeps the best run. Results are
+// written as JSON (to FILE, or stdout) and a readable table goes to stderr.
+
+using bench_clock = std::chrono::steady_clock;
+
+static double elapsed_ns(bench_clock::time_point t0, bench_clock::time_point t1)
+{
+    return std::chrono::duration<double, std::nano>(t1 - t0).count();
+}
+
+struct Record
+{
+    std::string name;
+    std::string variant;
+    size_t n;
+    std::string unit;
+    double value;
+};
+
+static std::vector<Record> records;
+static int repeat = 5;
+
+template <typename F>
+static double best_of(size_t n, F fn)
+{
+    double best = -1;
+    for (int i = 0; i < repeat; i++)
+    {
+        double ns = fn(n);
+        if (best < 0 || ns < best)
+            best = ns;
+    }
+    return best;
+}
+
+template <typename F>
+static void measure(const char *name, const char *variant, size_t n, F fn)
+{
+    records.push_back({name, variant, n, "ns/op", best_of(n, fn) / n});
+}
+
+// the whole run is one operation, `n` only sizes it
+template <typename F>
+static void measure_once(const char *name, const char *variant, size_t n, F fn)
+{
+    records.push_back({name, variant, n, "ns", best_of(n, fn)});
+}
+
+// helpers
+static void *noop(void *data, void **error, void *ctx)
+{
+    return data;
+}
+
+static void *count(void *data, void **error, void *ctx)
+{
+    *(size_t *)ctx += 1;
+    return data;
+}
+
+static void hold(upromise_promise_t *promise, void *ctx)
+{
+    *(upromise_promise_t **)ctx = promise;
+}
+
+static void settle(upromise_promise_t *promise, void *ctx)
+{
+    resolve_upromise_promise(promise, ctx);
+    del_upromise_promise(promise);
+}
+
+// a pending promise, the returned pointer owns the body's reference
+static upromise_promise_t *deferred(upromise_dispatcher_t *dispatcher)
+{
+    upromise_promise_t *promise = nullptr;
+    del_upromise_promise(new_upromise_promise(dispatcher, hold, &promise));
+    return promise;
+}
+
+static upromise_promise_t *resolved(upromise_dispatcher_t *dispatcher, void *value)
+{
+    return new_upromise_promise(dispatcher, settle, value);
+}
+
+static upromise_dispatcher_t *open_dispatcher(upromise_stack_mode mode)
+{
+    upromise_dispatcher_options_t options = {mode, 0, UPROMISE_IO_EPOLL};
+    return new_upromise_dispatcher_ex(&options);
+}
+
+static const char *mode_name(upromise_stack_mode mode)
+{
+    return mode == UPROMISE_STACK_SHARED ? "shared" : "dedicated";
+}
+
+// then
+static double bench_then_chain(size_t n)
+{
+    upromise_dispatcher_t *dispatcher = new_upromise_dispatcher();
+    auto t0 = bench_clock::now();
+    upromise_promise_t *head = deferred(dispatcher);
+    upromise_promise_t *tail = head;
+    for (size_t i = 0; i < n; i++)
+    {
+        upromise_promise_t *next = upromise_promise_then(tail, nullptr, noop, nullptr);
+        if (tail != head)
+            del_upromise_promise(tail);
+        tail = next;
+    }
+    del_upromise_promise(tail);
+    resolve_upromise_promise(head, head);
+    del_upromise_promise(head);
+    upromise_dispatcher_run(dispatcher);
+    auto t1 = bench_clock::now();
+    del_upromise_dispatcher(dispatcher);
+    return elapsed_ns(t0, t1);
+}
+
+static double bench_then_resolved(size_t n)
+{
+    upromise_dispatcher_t *dispatcher = new_upromise_dispatcher();
+    upromise_promise_t *source = resolved(dispatcher, nullptr);
+    auto t0 = bench_clock::now();
+    for (size_t i = 0; i < n; i++)
+        del_upromise_promise(upromise_promise_then(source, nullptr, noop, nullptr));
+    upromise_dispatcher_run(dispatcher);
+    auto t1 = bench_clock::now();
+    del_upromise_promise(source);
+    del_upromise_dispatcher(dispatcher);
+    return elapsed_ns(t0, t1);
+}
+
+static double bench_then_pending(size_t n)
+{
+    upromise_dispatcher_t *dispatcher = new_upromise_dispatcher();
+    upromise_promise_t *source = deferred(dispatcher);
+    auto t0 = bench_clock::now();
+    for (size_t i = 0; i < n; i++)
+        del_upromise_promise(upromise_promise_then(source, nullptr, noop, nullptr));
+    resolve_upromise_promise(source, nullptr);
+    upromise_dispatcher_run(dispatcher);
+    auto t1 = bench_clock::now();
+    del_upromise_promise(source);
+    del_upromise_dispatcher(dispatcher);
+    return elapsed_ns(t0, t1);
+}
+
+// fan-out: one promise with n waiters, settled directly or by adopting
+// another pending promise. `settle` times only the settle call, which
+// splices the waiter list and should not grow with n.
+static double bench_fanout(size_t n, bool adopt, bool settle)
+{
+    upromise_dispatcher_t *dispatcher = new_upromise_dispatcher();
+    upromise_promise_t *source = deferred(dispatcher);
+    upromise_promise_t *target = adopt ? deferred(dispatcher) : nullptr;
+    for (size_t i = 0; i < n; i++)
+        del_upromise_promise(upromise_promise_then(source, nullptr, noop, nullptr));
+    auto t0 = bench_clock::now();
+    if (adopt)
+    {
+        upromise_ref_count_inc(&target->rc); // adoption consumes one reference
+        resolve_upromise_promise_thenable(source, target);
+        resolve_upromise_promise(target, nullptr);
+    }
+    else
+        resolve_upromise_promise(source, nullptr);
+    auto t1 = bench_clock::now();
+    upromise_dispatcher_run(dispatcher);
+    if (!settle)
+        t1 = bench_clock::now();
+    del_upromise_promise(source);
+    if (target)
+        del_upromise_promise(target);
+    del_upromise_dispatcher(dispatcher);
+    return elapsed_ns(t0, t1);
+}
+
+// fan-in: n promises settle into one shared continuation context
+static double bench_fanin(size_t n)
+{
+    upromise_dispatcher_t *dispatcher = new_upromise_dispatcher();
+    std::vector<upromise_promise_t *> sources(n);
+    size_t hits = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        sources[i] = deferred(dispatcher);
+        del_upromise_promise(upromise_promise_then(sources[i], &hits, count, nullptr));
+    }
+    auto t0 = bench_clock::now();
+    for (size_t i = 0; i < n; i++)
+        resolve_upromise_promise(sources[i], nullptr);
+    upromise_dispatcher_run(dispatcher);
+    auto t1 = bench_clock::now();
+    if (hits != n)
+        std::fprintf(stderr, "fan-in: %zu of %zu continuations ran\n", hits, n);
+    for (size_t i = 0; i < n; i++)
+        del_upromise_promise(sources[i]);
+    del_upromise_dispatcher(dispatcher);
+    return elapsed_ns(t0, t1);
+}
+
+// fan-in through upromise_promise_all: one block instead of a then per input
+static double bench_fanin_all(size_t n)
+{
+    upromise_dispatcher_t *dispatcher = new_upromise_dispatcher();
+    std::vector<upromise_promise_t *> sources(n);
+    for (size_t i = 0; i < n; i++)
+        sources[i] = deferred(dispatcher);
+    upromise_promise_t *all = upromise_promise_all(dispatcher, sources.data(), n);
+    auto t0 = bench_clock::now();
+    for (size_t i = 0; i < n; i++)
+        resolve_upromise_promise(sources[i], nullptr);
+    upromise_dispatcher_run(dispatcher);
+    auto t1 = bench_clock::now();
+    if (all->state != UPROMISE_PROMISE_STATE_FULFILLED)
+        std::fprintf(stderr, "fan-in: all did not settle\n");
+    else
+        std::free(all->data);
+    del_upromise_promise(all);
+    for (size_t i = 0; i < n; i++)
+        del_upromise_promise(sources[i]);
+    del_upromise_dispatcher(dispatcher);
+    return elapsed_ns(t0, t1);
+}
+
+// await
+struct await_ctx
+{
+    size_t n;
+    upromise_promise_t *value;
+    bool pending;
+};
+
+static void *await_loop(upromise_async_context_t *context, void **error, void *ctx_raw)
+{
+    await_ctx *ctx = (await_ctx *)ctx_raw;
+    for (size_t i = 0; i < ctx->n; i++)
+    {
+        if (!ctx->pending)
+        {
+            upromise_await(context, ctx->value);
+            continue;
+        }
+        // pending until the then() runs, so the body suspends
+        upromise_promise_t *next = upromise_promise_then(ctx->value, nullptr, noop, nullptr);
+        upromise_await(context, next);
+        del_upromise_promise(next);
+    }
+    return nullptr;
+}
+
+static double bench_await(size_t n, upromise_stack_mode mode, bool pending)
+{
+    upromise_dispatcher_t *dispatcher = open_dispatcher(mode);
+    await_ctx ctx = {n, resolved(dispatcher, nullptr), pending};
+    auto t0 = bench_clock::now();
+    del_upromise_promise(upromise_async(dispatcher, await_loop, &ctx));
+    upromise_dispatcher_run(dispatcher);
+    auto t1 = bench_clock::now();
+    del_upromise_promise(ctx.value);
+    del_upromise_dispatcher(dispatcher);
+    return elapsed_ns(t0, t1);
+}
+
+// coroutine switch: one resume and the yield that comes back, the floor
+// under every await and generator step
+static void switch_body(struct schedule *S, void *ud)
+{
+    size_t n = *(size_t *)ud;
+    for (size_t i = 0; i < n; i++)
+        coroutine_yield(S);
+}
+
+static double bench_switch(size_t n, upromise_stack_mode mode)
+{
+    struct schedule *S = coroutine_open_ex(mode, 0);
+    intptr_t co = coroutine_new(S, switch_body, &n);
+    auto t0 = bench_clock::now();
+    for (size_t i = 0; i < n; i++)
+        coroutine_resume(S, co);
+    auto t1 = bench_clock::now();
+    coroutine_resume(S, co); // runs off the end
+    coroutine_close(S);
+    return elapsed_ns(t0, t1);
+}
+
+// generators, through the C++ wrappers users call
+static double bench_generator(size_t n, upromise_stack_mode mode)
+{
+    upromise_dispatcher_options_t options = {mode, 0, UPROMISE_IO_EPOLL};
+    auto dispatcher = std::make_shared<upromise::Dispatcher>(options);
+    double ns = 0;
+    auto body = upromise::async(
+        dispatcher,
+        [&](upromise::AsyncContext ctx) -> void *
+        {
+            auto gen = upromise::generator(
+                dispatcher,
+                [](upromise::Generator *gen) -> void *
+                {
+                    // echo whatever next() sends
+                    void *value = nullptr;
+                    while (true)
+                        Yield(value, gen, value);
+                })();
+            auto t0 = bench_clock::now();
+            for (size_t i = 0; i < n; i++)
+                gen.next();
+            ns = elapsed_ns(t0, bench_clock::now());
+            gen.Return();
+            return nullptr;
+        });
+    body();
+    dispatcher->run();
+    return ns;
+}
+
+static double bench_agen(size_t n, upromise_stack_mode mode)
+{
+    upromise_dispatcher_options_t options = {mode, 0, UPROMISE_IO_EPOLL};
+    auto dispatcher = std::make_shared<upromise::Dispatcher>(options);
+    upromise::Promise item(dispatcher, resolved(dispatcher->dispatcher, nullptr));
+    double ns = 0;
+    auto body = upromise::async(
+        dispatcher,
+        [&](upromise::AsyncContext ctx) -> void *
+        {
+            auto gen = upromise::agen(
+                dispatcher,
+                [&](upromise::AsyncGenerator *gen) -> void *
+                {
+                    while (true)
+                    {
+                        auto ret = gen->yield(item);
+                        if (ret.need_done)
+                            return ret.data;
+                    }
+                })();
+            auto t0 = bench_clock::now();
+            for (size_t i = 0; i < n; i++)
+                std::free(ctx.await(gen.next()));
+            ns = elapsed_ns(t0, bench_clock::now());
+            std::free(ctx.await(gen.Return()));
+            return nullptr;
+        });
+    body();
+    dispatcher->run();
+    return ns;
+}
+
+// io
+// Several readers stream the same page-cached file in 4KiB chunks, so the
+// cost is the per-read overhead of each backend rather than the disk.
+struct FileReader
+{
+    upromise_dispatcher_t *dispatcher;
+    int fd;
+    char buffer[4096];
+    size_t *reads;
+};
+
+static void file_read_start(FileReader *reader);
+
+static void *file_read_next(void *data, void **error, void *ctx)
+{
+    FileReader *reader = (FileReader *)ctx;
+    if ((intptr_t)data <= 0)
+        return nullptr;
+    *reader->reads += 1;
+    file_read_start(reader);
+    return nullptr;
+}
+
+static void file_read_start(FileReader *reader)
+{
+    upromise_promise_t *read = upromise_read(reader->dispatcher, reader->fd, reader->buffer, sizeof(reader->buffer));
+    del_upromise_promise(upromise_promise_then(read, reader, file_read_next, nullptr));
+    del_upromise_promise(read);
+}
+
+static double bench_file_read(size_t n, upromise_io_backend backend, const char *path)
+{
+    const size_t readers = 16;
+    upromise_dispatcher_options_t options = {UPROMISE_STACK_SHARED, 0, backend};
+    upromise_dispatcher_t *dispatcher = new_upromise_dispatcher_ex(&options);
+    std::vector<FileReader> states(readers);
+    size_t reads = 0;
+    for (FileReader &reader : states)
+        reader = {dispatcher, open(path, O_RDONLY | O_CLOEXEC), {}, &reads};
+    auto t0 = bench_clock::now();
+    for (FileReader &reader : states)
+        file_read_start(&reader);
+    while (reads < n)
+        upromise_dispatcher_run(dispatcher);
+    double ns = elapsed_ns(t0, bench_clock::now());
+    for (FileReader &reader : states)
+        upromise_io_close(dispatcher, reader.fd);
+    upromise_dispatcher_run(dispatcher);
+    del_upromise_dispatcher(dispatcher);
+    return ns;
+}
+
+static void file_read(size_t n)
+{
+    const size_t readers = 16;
+    char path[] = "/tmp/upromise-bench-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0)
+        return;
+    std::vector<char> chunk(4096, 'x');
+    bool written = true;
+    for (size_t i = 0; i < n / readers && written; i++)
+        written = write(fd, chunk.data(), chunk.size()) == (ssize_t)chunk.size();
+    close(fd);
+    if (written)
+        for (upromise_io_backend backend : {UPROMISE_IO_EPOLL, UPROMISE_IO_URING})
+        {
+            // only report io_uring when it is built and allowed
+            upromise_dispatcher_options_t options = {UPROMISE_STACK_SHARED, 0, backend};
+            upromise_dispatcher_t *probe = new_upromise_dispatcher_ex(&options);
+            bool available = upromise_io_backend_of(probe) == backend;
+            del_upromise_dispatcher(probe);
+            if (available)
+                measure("file_read", backend == UPROMISE_IO_URING ? "io_uring" : "epoll", n / readers * readers, [&](size_t n)
+                        { return bench_file_read(n, backend, path); });
+        }
+    unlink(path);
+}
+
+// memory held per pending object, from the allocator's own accounting
+static size_t heap_in_use()
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    struct mallinfo2 info = mallinfo2();
+    return info.uordblks + info.hblkhd;
+#else
+    return 0;
+#endif
+}
+
+static void *await_forever(upromise_async_context_t *context, void **error, void *ctx)
+{
+    upromise_await(context, (upromise_promise_t *)ctx);
+    return nullptr;
+}
+
+static void memory(const char *variant, size_t n)
+{
+    upromise_dispatcher_t *dispatcher = new_upromise_dispatcher();
+    upromise_promise_t *never = deferred(dispatcher);
+    size_t before = heap_in_use();
+    for (size_t i = 0; i < n; i++)
+    {
+        if (std::strcmp(variant, "promise") == 0)
+            deferred(dispatcher);
+        else if (std::strcmp(variant, "promise+then") == 0)
+            upromise_promise_then(deferred(dispatcher), nullptr, noop, nullptr);
+        else
+            upromise_async(dispatcher, await_forever, never);
+    }
+    upromise_dispatcher_run(dispatcher);
+    size_t after = heap_in_use();
+    del_upromise_dispatcher(dispatcher);
+    if (before == 0 && after == 0)
+        return;
+    records.push_back({"memory", variant, n, "bytes/object", (double)(after - before) / n});
+}
+
+// output
+static void write_json(FILE *out)
+{
+    std::fprintf(out, "{\n  \"version\": \"%s\",\n  \"results\": [\n", UPROMISE_BENCH_VERSION);
+    for (size_t i = 0; i < records.size(); i++)
+    {
+        const Record &r = records[i];
+        std::fprintf(out, "    {\"name\": \"%s\", \"variant\": \"%s\", \"n\": %zu, \"unit\": \"%s\", \"value\": %.2f}%s\n",
+                     r.name.c_str(), r.variant.c_str(), r.n, r.unit.c_str(), r.value, i + 1 < records.size() ? "," : "");
+    }
+    std::fprintf(out, "  ]\n}\n");
+}
+
+static void write_table(FILE *out)
+{
+    std::fprintf(out, "%-16s %-12s %10s %14s\n", "benchmark", "variant", "n", "value");
+    for (const Record &r : records)
+        std::fprintf(out, "%-16s %-12s %10zu %14.2f %s\n", r.name.c_str(), r.variant.c_str(), r.n, r.value, r.unit.c_str());
+}
+
+int main(int argc, char **argv)
+{
+    size_t scale = 1;
+    const char *out_path = nullptr;
+    for (int i = 1; i < argc; i++)
+    {
+        if (std::strcmp(argv[i], "--quick") == 0)
+        {
+            scale = 100;
+            repeat = 1;
+        }
+        else if (std::strcmp(argv[i], "--out") == 0 && i + 1 < argc)
+            out_path = argv[++i];
+        else
+        {
+            std::fprintf(stderr, "usage: %s [--quick] [--out FILE]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    const size_t n = 1000000 / scale;
+    const upromise_stack_mode modes[] = {UPROMISE_STACK_SHARED, UPROMISE_STACK_DEDICATED};
+
+    measure("then_chain", "pending", n, bench_then_chain);
+    measure("then", "resolved", n, bench_then_resolved);
+    measure("then", "pending", n, bench_then_pending);
+    for (size_t fanout : {1, 100, 10000, 1000000})
+    {
+        if (fanout > n)
+            break;
+        measure("fanout", "resolve", fanout, [](size_t n)
+                { return bench_fanout(n, false, false); });
+        measure("fanout", "adopt", fanout, [](size_t n)
+                { return bench_fanout(n, true, false); });
+        measure_once("fanout_settle", "resolve", fanout, [](size_t n)
+                     { return bench_fanout(n, false, true); });
+        measure_once("fanout_settle", "adopt", fanout, [](size_t n)
+                     { return bench_fanout(n, true, true); });
+    }
+    measure("fanin", "resolve", n, bench_fanin);
+    measure("fanin", "all", n, bench_fanin_all);
+    for (upromise_stack_mode mode : modes)
+    {
+        measure("switch", mode_name(mode), n, [=](size_t n)
+                { return bench_switch(n, mode); });
+        measure("await", mode_name(mode), n, [=](size_t n)
+                { return bench_await(n, mode, false); });
+        measure("await_pending", mode_name(mode), n, [=](size_t n)
+                { return bench_await(n, mode, true); });
+        measure("generator_next", mode_name(mode), n, [=](size_t n)
+                { return bench_generator(n, mode); });
+        measure("agen_item", mode_name(mode), n / 10, [=](size_t n)
+                { return bench_agen(n, mode); });
+    }
+    file_read(n / 4);
+    // large enough that slab granularity does not show
+    memory("promise", 100000);
+    memory("promise+then", 100000);
+    memory("suspended_async", 10000);
+
+    write_table(stderr);
+    if (out_path != nullptr)
+    {
+        FILE *out = std::fopen(out_path, "w");
+        if (out == nullptr)
+        {
+            std::perror(out_path);
+            return 1;
+        }
+        write_json(out);
+        std::fclose(out);
+    }
+    else
+        write_json(stdout);
+    return 0;
+}
@@ -11,23 +11,42 @@ extern "C"
     // async
     // Async is not like async/await in javascript.
     // If not in a task, async will not start immediately, but set to the first task queue.
+    typedef struct upromise_await_result_t
+    {
+        void *ret;
+        void *error;
+    } upromise_await_result_t;
+
     typedef struct upromise_async_context_t
     {
         upromise_promise_t *promise;
-        int co;
+        upromise_dispatcher_t *dispatcher; // runs the body, an executor may move it between awaits
+        intptr_t co;
+        upromise_cancel_link_t cancel;
+        void *cancelled;                 // the cancel reason once the token fired
+        upromise_promise_t *awaiting;    // the promise the body is suspended on
+        upromise_task_t waiter;          // queued on it, resumes the body
+        upromise_await_result_t result;  // what the woken await returns
+        upromise_task_fn wake;           // switches back into the body, given the context
+        int finished;                    // returned away from the promise's dispatcher
     } upromise_async_context_t;
 
     typedef void *(*upromise_async_fn)(upromise_async_context_t *context, void **error, void *ctx);
 
+    // NULL when out of memory or coroutine stacks, the body does not run
+    // and ctx stays with the caller; the same goes for the generator
+    // constructors, and for next() when out of memory
     upromise_promise_t *upromise_async(upromise_dispatcher_t *dispatcher, upromise_async_fn fn, void *ctx);
-
-    typedef struct upromise_await_result_t
-    {
-        void *ret;
-        void *error;
-    } upromise_await_result_t;
+    // Cancelling `token` rejects the promise with the reason at once and
+    // resumes a suspended await with the reason as its error; every later
+    // await fails the same way without suspending, so the body unwinds and
+    // its coroutine and stack are freed.
+    upromise_promise_t *upromise_async_cancellable(upromise_dispatcher_t *dispatcher, upromise_cancel_token_t *token, upromise_async_fn fn, void *ctx);
 
     upromise_await_result_t upromise_await(upromise_async_context_t *context, upromise_promise_t *promise);
+    // suspend the async body for `ms` milliseconds, or until its token is
+    // cancelled; returns at once when out of memory
+    void upromise_async_sleep(upromise_async_context_t *context, uint64_t ms);
 
     // generator
     // Generator must be used in a task.
@@ -35,7 +54,8 @@ extern "C"
     {
         upromise_ref_count_t rc;
         upromise_dispatcher_t *dispatcher;
-        int co;
+        intptr_t co;
+        intptr_t caller; // the coroutine suspended in next(), switched back to on yield
         int done;
         int need_done;
         void *set_data;
@@ -80,7 +100,7 @@ extern "C"
     {
         upromise_ref_count_t rc;
         upromise_dispatcher_t *dispatcher;
-        int co;
+        intptr_t co;
         int done;
         // upromise_promise_t *done_promise;
         int need_done;
@@ -88,6 +108,11 @@ extern "C"
         void *set_data;
         // upromise_promise_t *next_promise;
         upromise_task_queue_t next_queue;
+        upromise_cancel_link_t cancel;
+        void *cancelled;
+        // the promise the body yielded, and the waiter it left on it
+        upromise_promise_t *yield_promise;
+        upromise_promise_t *yield_then;
     } upromise_agen_t;
 
     typedef void *(*upromise_agen_fn)(upromise_agen_t *agen, void **error, void *ctx);
@@ -104,6 +129,11 @@ extern "C"
     upromise_promise_t *upromise_agen_next(upromise_agen_t *agen, void *value);
     upromise_promise_t *upromise_agen_return(upromise_agen_t *agen, void *value);
     upromise_promise_t *upromise_agen_throw(upromise_agen_t *agen, void *value);
+    // Cancelling `token` rejects the pending next() promise with the reason
+    // and throws it into the body at the AYIELD it is waiting in (or the
+    // next one it reaches). Later next() calls reject with the reason. A
+    // body that never started stays unstarted.
+    void upromise_agen_cancel_on(upromise_agen_t *agen, upromise_cancel_token_t *token);
 
     typedef struct upromise_ayield_result_t
     {
@@ -149,6 +179,8 @@ namespace upromise
             return result.ret;
         }
 
+        void sleep(uint64_t ms) { upromise_async_sleep(context, ms); }
+
         struct BodyContext
         {
             std::function<void *(AsyncContext)> fn;
@@ -187,17 +219,25 @@ namespace upromise
     struct async
     {
         async(const std::shared_ptr<Dispatcher> &dispatcher, F fn) : dispatcher(dispatcher), fn(fn) {}
+        // every call is cancelled by `token`
+        async(const std::shared_ptr<Dispatcher> &dispatcher, CancelToken token, F fn) : dispatcher(dispatcher), token(std::move(token)), fn(fn) {}
 
         template <typename... Args>
         Promise operator()(Args... args) const
         {
             auto ctx = new AsyncContext::BodyContext{std::bind(fn, std::placeholders::_1, args...)};
-            auto promise = upromise_async(dispatcher->dispatcher, &AsyncContext::common_body, ctx);
+            auto promise = upromise_async_cancellable(dispatcher->dispatcher, token.impl(), &AsyncContext::common_body, ctx);
+            if (promise == nullptr)
+            {
+                delete ctx;
+                throw std::bad_alloc();
+            }
             return Promise(dispatcher, promise);
         }
 
     private:
         std::shared_ptr<Dispatcher> dispatcher;
+        CancelToken token;
         F fn;
     };
 
@@ -226,6 +266,11 @@ namespace upromise
             ptr->fn = fn;
             ptr->dispatcher = dispatcher;
             generator = new_upromise_generator(dispatcher->dispatcher, &Generator::common_body, ptr);
+            if (generator == nullptr)
+            {
+                delete ptr;
+                throw std::bad_alloc();
+            }
         }
         ~Generator()
         {
@@ -236,13 +281,17 @@ namespace upromise
         {
             generator = p.generator;
             dispatcher = p.dispatcher;
-            generator->rc += 1;
+            if (generator)
+                upromise_ref_count_inc(&generator->rc);
         }
         Generator &operator=(const Generator &p)
         {
+            if (p.generator)
+                upromise_ref_count_inc(&p.generator->rc);
+            if (generator)
+                del_upromise_generator(generator);
             generator = p.generator;
             dispatcher = p.dispatcher;
-            generator->rc += 1;
             return *this;
         }
         Generator(Generator &&p)
@@ -253,9 +302,8 @@ namespace upromise
         }
         Generator &operator=(Generator &&p)
         {
-            generator = p.generator;
-            p.generator = nullptr;
-            dispatcher = std::move(p.dispatcher);
+            std::swap(generator, p.generator);
+            std::swap(dispatcher, p.dispatcher);
             return *this;
         }
 
@@ -295,6 +343,7 @@ namespace upromise
         static void *common_body(upromise_generator_t *generator, void **error, void *ctx_raw)
         {
             BodyContext *ctx = (BodyContext *)ctx_raw;
+            upromise_ref_count_inc(&generator->rc); // for gen
             Generator gen(ctx->dispatcher, generator);
             void *ret = nullptr;
             try
@@ -352,6 +401,11 @@ namespace upromise
             ptr->fn = fn;
             ptr->dispatcher = dispatcher;
             agen = new_upromise_agen(dispatcher->dispatcher, &AsyncGenerator::common_body, ptr);
+            if (agen == nullptr)
+            {
+                delete ptr;
+                throw std::bad_alloc();
+            }
         }
         ~AsyncGenerator()
         {
@@ -362,13 +416,17 @@ namespace upromise
         {
             agen = p.agen;
             dispatcher = p.dispatcher;
-            agen->rc += 1;
+            if (agen)
+                upromise_ref_count_inc(&agen->rc);
         }
         AsyncGenerator &operator=(const AsyncGenerator &p)
         {
+            if (p.agen)
+                upromise_ref_count_inc(&p.agen->rc);
+            if (agen)
+                del_upromise_agen(agen);
             agen = p.agen;
             dispatcher = p.dispatcher;
-            agen->rc += 1;
             return *this;
         }
         AsyncGenerator(AsyncGenerator &&p)
@@ -379,9 +437,8 @@ namespace upromise
         }
         AsyncGenerator &operator=(AsyncGenerator &&p)
         {
-            agen = p.agen;
-            p.agen = nullptr;
-            dispatcher = std::move(p.dispatcher);
+            std::swap(agen, p.agen);
+            std::swap(dispatcher, p.dispatcher);
             return *this;
         }
 
@@ -390,6 +447,11 @@ namespace upromise
             return Promise(dispatcher, upromise_agen_next(agen, data));
         }
 
+        void cancel_on(const CancelToken &token)
+        {
+            upromise_agen_cancel_on(agen, token.impl());
+        }
+
         Promise Return(void *data = nullptr)
         {
             return Promise(dispatcher, upromise_agen_return(agen, data));
@@ -409,6 +471,7 @@ namespace upromise
         static void *common_body(upromise_agen_t *agen, void **error, void *ctx_raw)
         {
             BodyContext *ctx = (BodyContext *)ctx_raw;
+            upromise_ref_count_inc(&agen->rc); // for gen
             AsyncGenerator gen(ctx->dispatcher, agen);
             void *ret = nullptr;
             try
@@ -6,17 +6,38 @@
 #define COROUTINE_RUNNING 2
 #define COROUTINE_SUSPEND 3
 
+// shared: one stack per schedule, live frames are copied out on yield
+// dedicated: every coroutine owns an mmap'd stack with a guard page
+#define COROUTINE_STACK_SHARED 0
+#define COROUTINE_STACK_DEDICATED 1
+
+#include <stddef.h>
+#include <stdint.h>
+
 struct schedule;
+struct coroutine;
 
 typedef void (*coroutine_func)(struct schedule *, void *ud);
 
 struct schedule * coroutine_open(void);
+// NULL when out of memory
+struct schedule * coroutine_open_ex(int mode, size_t stack_size);
 void coroutine_close(struct schedule *);
 
-int coroutine_new(struct schedule *, coroutine_func, void *ud);
-void coroutine_resume(struct schedule *, int id);
-int coroutine_status(struct schedule *, int id);
-int coroutine_running(struct schedule *);
+// -1 when out of memory, slots or dedicated stacks
+intptr_t coroutine_new(struct schedule *, coroutine_func, void *ud);
+void coroutine_resume(struct schedule *, intptr_t id);
+int coroutine_status(struct schedule *, intptr_t id);
+intptr_t coroutine_running(struct schedule *);
 void coroutine_yield(struct schedule *);
+void coroutine_transfer(struct schedule *, intptr_t id);
+
+// dedicated stack size, 0 for a shared stack
+size_t coroutine_stack_size(struct schedule *);
+// Move a suspended coroutine with a dedicated stack to another schedule of
+// the same stack size: detach returns NULL when `id` cannot move, attach
+// gives it a new id there, -1 when the stack size differs or out of slots.
+struct coroutine * coroutine_detach(struct schedule *, intptr_t id);
+intptr_t coroutine_attach(struct schedule *, struct coroutine *);
 
 #endif
@@ -0,0 +1,161 @@
+#ifndef _UPROMISE_EXECUTOR_H_
+#define _UPROMISE_EXECUTOR_H_
+
+#include "async.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    // executor
+    // A pool of worker threads, each running its own dispatcher. Jobs are
+    // posted to the pool; a worker pushes and pops its own deque at the
+    // bottom and, when it runs dry, steals from the top of the others.
+    // Promises stay on the dispatcher they were made on. Async bodies
+    // started with upromise_executor_async move: every woken await goes
+    // back to the pool as a job, so a pipeline of awaits spreads over the
+    // idle workers instead of waiting for the one that started it.
+    typedef void (*upromise_job_fn)(upromise_dispatcher_t *dispatcher, void *extra);
+
+    typedef struct upromise_executor_t upromise_executor_t;
+
+    // `dispatchers` holds one dispatcher per worker thread, still owned by
+    // the caller and not to be touched until the executor is deleted; NULL
+    // when out of memory or a worker thread cannot be started
+    upromise_executor_t *new_upromise_executor(upromise_dispatcher_t **dispatchers, size_t count);
+    // stops and joins the workers, jobs not yet started are dropped
+    void del_upromise_executor(upromise_executor_t *executor);
+    // thread-safe; from inside a job it goes to the calling worker's deque
+    void upromise_executor_post(upromise_executor_t *executor, upromise_job_fn fn, void *extra);
+    // thread-safe: run fn(extra) on the worker that owns `dispatcher` (one
+    // of the executor's), e.g. to settle a promise a job left waiting
+    void upromise_executor_post_to(upromise_executor_t *executor, upromise_dispatcher_t *dispatcher, upromise_task_fn fn, void *extra);
+    // Blocks until every posted job and continuation has run, and no worker
+    // has timers or I/O outstanding. Idle workers park on their dispatcher,
+    // so work arriving through upromise_dispatcher_post or a threadsafe
+    // settle still runs, but only post_to counts as outstanding.
+    void upromise_executor_wait(upromise_executor_t *executor);
+    // index of the calling thread's dispatcher in the executor's array,
+    // SIZE_MAX when it is not one of the executor's workers
+    size_t upromise_executor_worker(upromise_executor_t *executor);
+    // Whether bodies can move between the workers: only when built
+    // WITH_ATOMIC_REFCOUNT, since a body releases handles and pool objects
+    // on whichever thread it runs, and only when every worker's dispatcher
+    // has dedicated stacks of one size.
+    int upromise_executor_movable(upromise_executor_t *executor);
+    // Like upromise_async on `dispatcher`, one of the executor's, but each
+    // await is woken on whichever worker takes it, so the body must await
+    // promises made on context->dispatcher, and settles its promise back on
+    // `dispatcher`. Thread-locals must not be held across an await. NULL,
+    // without running the body, when the executor is not movable (use
+    // upromise_async to keep a body on one dispatcher) or out of memory.
+    upromise_promise_t *upromise_executor_async(upromise_executor_t *executor, upromise_dispatcher_t *dispatcher, upromise_async_fn fn, void *ctx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#ifdef __cplusplus
+#include <vector>
+
+namespace upromise
+{
+    class Executor
+    {
+        std::vector<std::shared_ptr<Dispatcher>> dispatchers;
+        upromise_executor_t *executor;
+
+    public:
+        using Fn = std::function<void(const std::shared_ptr<Dispatcher> &)>;
+
+        Executor(size_t threads, const upromise_dispatcher_options_t &options = {UPROMISE_STACK_DEDICATED, 0, UPROMISE_IO_EPOLL}) : executor(nullptr)
+        {
+            std::vector<upromise_dispatcher_t *> raw;
+            for (size_t i = 0; i < threads; i++)
+            {
+                dispatchers.push_back(std::make_shared<Dispatcher>(options));
+                raw.push_back(dispatchers.back()->dispatcher);
+            }
+            executor = new_upromise_executor(raw.data(), raw.size());
+            if (executor == nullptr)
+                throw std::runtime_error("cannot create executor");
+        }
+        ~Executor()
+        {
+            if (executor)
+            {
+                wait();
+                del_upromise_executor(executor);
+            }
+        }
+        Executor(const Executor &) = delete;
+        Executor &operator=(const Executor &) = delete;
+
+        void post(Fn fn)
+        {
+            upromise_executor_post(executor, &Executor::common_job, new JobContext{fn, this});
+        }
+        // run fn on the worker that owns `dispatcher`
+        void post(const std::shared_ptr<Dispatcher> &dispatcher, std::function<void()> fn)
+        {
+            upromise_executor_post_to(executor, dispatcher->dispatcher, &Executor::common_continuation, new std::function<void()>(std::move(fn)));
+        }
+        void wait() { upromise_executor_wait(executor); }
+        // the dispatcher of the calling worker, for jobs and the bodies
+        // they start
+        const std::shared_ptr<Dispatcher> &current() const { return dispatchers[upromise_executor_worker(executor)]; }
+        bool movable() const { return upromise_executor_movable(executor); }
+        // start fn on `dispatcher`, awaits may wake on other workers: make
+        // the promises it awaits on current()
+        Promise async(const std::shared_ptr<Dispatcher> &dispatcher, std::function<void *(AsyncContext)> fn)
+        {
+            if (!movable())
+                throw std::runtime_error("executor cannot move async bodies");
+            auto ctx = new AsyncContext::BodyContext{std::move(fn)};
+            auto promise = upromise_executor_async(executor, dispatcher->dispatcher, &AsyncContext::common_body, ctx);
+            if (promise == nullptr)
+            {
+                delete ctx;
+                throw std::bad_alloc();
+            }
+            return Promise(dispatcher, promise);
+        }
+
+    private:
+        struct JobContext
+        {
+            Fn fn;
+            Executor *executor;
+        };
+
+        static void common_job(upromise_dispatcher_t *, void *ctx_raw)
+        {
+            JobContext *ctx = (JobContext *)ctx_raw;
+            try
+            {
+                ctx->fn(ctx->executor->current());
+            }
+            catch (Error)
+            {
+            }
+            delete ctx;
+        }
+
+        static void common_continuation(void *ctx_raw)
+        {
+            std::function<void()> *fn = (std::function<void()> *)ctx_raw;
+            try
+            {
+                (*fn)();
+            }
+            catch (Error)
+            {
+            }
+            delete fn;
+        }
+    };
+}
+#endif
+
+#endif
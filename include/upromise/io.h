@@ -0,0 +1,72 @@
+#ifndef _UPROMISE_IO_H_
+#define _UPROMISE_IO_H_
+
+#include "upromise.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    // io
+    // I/O on the dispatcher's reactor, created on first use. With epoll,
+    // fds must be non-blocking; operations try the syscall first and only
+    // wait for readiness when it would block. With the io_uring backend
+    // (options.io_backend) operations are queued and submitted in one batch
+    // per loop turn, which also makes regular-file reads asynchronous.
+    // Promises resolve with a non-negative count (or fd) cast to void *,
+    // and reject with the errno value cast to void *. Close registered
+    // fds with upromise_io_close so the reactor forgets them. Buffers must
+    // outlive the operation, and with UPROMISE_STACK_SHARED must not be
+    // locals of the awaiting coroutine. The calls below that make a
+    // promise return NULL when out of memory.
+
+    // resolve with NULL once fd is readable / writable (or hung up)
+    upromise_promise_t *upromise_fd_readable(upromise_dispatcher_t *dispatcher, int fd);
+    upromise_promise_t *upromise_fd_writable(upromise_dispatcher_t *dispatcher, int fd);
+    // resolve with the bytes read, 0 at end of file
+    upromise_promise_t *upromise_read(upromise_dispatcher_t *dispatcher, int fd, void *buf, size_t len);
+    // resolve with len once all of buf is written
+    upromise_promise_t *upromise_write(upromise_dispatcher_t *dispatcher, int fd, const void *buf, size_t len);
+    // resolve with the accepted fd, already non-blocking and close-on-exec
+    upromise_promise_t *upromise_accept(upromise_dispatcher_t *dispatcher, int fd);
+    // reject pending operations on fd with ECANCELED, then close it
+    int upromise_io_close(upromise_dispatcher_t *dispatcher, int fd);
+    // the backend the dispatcher's reactor runs on, sets the reactor up
+    upromise_io_backend upromise_io_backend_of(upromise_dispatcher_t *dispatcher);
+
+#ifdef __cplusplus
+}
+#endif
+
+#ifdef __cplusplus
+namespace upromise
+{
+    inline Promise readable(const std::shared_ptr<Dispatcher> &dispatcher, int fd)
+    {
+        return Promise(dispatcher, upromise_fd_readable(dispatcher->dispatcher, fd));
+    }
+
+    inline Promise writable(const std::shared_ptr<Dispatcher> &dispatcher, int fd)
+    {
+        return Promise(dispatcher, upromise_fd_writable(dispatcher->dispatcher, fd));
+    }
+
+    inline Promise read(const std::shared_ptr<Dispatcher> &dispatcher, int fd, void *buf, size_t len)
+    {
+        return Promise(dispatcher, upromise_read(dispatcher->dispatcher, fd, buf, len));
+    }
+
+    inline Promise write(const std::shared_ptr<Dispatcher> &dispatcher, int fd, const void *buf, size_t len)
+    {
+        return Promise(dispatcher, upromise_write(dispatcher->dispatcher, fd, buf, len));
+    }
+
+    inline Promise accept(const std::shared_ptr<Dispatcher> &dispatcher, int fd)
+    {
+        return Promise(dispatcher, upromise_accept(dispatcher->dispatcher, fd));
+    }
+}
+#endif
+
+#endif
@@ -6,20 +6,37 @@ extern "C"
 {
 #endif
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include "coroutine.h"
 
     // refcount
+    // Plain counters by default. Built WITH_ATOMIC_REFCOUNT (which defines
+    // UPROMISE_ATOMIC_REFCOUNT for users too) they are atomic, so handles
+    // to one object may be copied and dropped on several threads, and the
+    // dispatcher's pool takes a lock for the final release; settling and
+    // then() still belong to the dispatcher thread.
     typedef uint32_t upromise_ref_count_t;
 
+    void upromise_ref_count_inc(upromise_ref_count_t *rc);
+    // returns true when the count dropped to zero
+    bool upromise_ref_count_dec(upromise_ref_count_t *rc);
+
     // task queue
+    // A task either resumes coroutine `co`, or, when `fn` is set, calls
+    // fn(extra) directly on the dispatcher loop without a coroutine.
+    typedef void (*upromise_task_fn)(void *extra);
+
     typedef struct upromise_task_t
     {
         struct upromise_task_t *next;
+        upromise_task_fn fn;
         intptr_t co;
         void *extra;
     } upromise_task_t;
 
+    // head and tail are both NULL when the queue is empty
     typedef struct upromise_task_queue_t
     {
         upromise_task_t *head;
@@ -28,19 +45,190 @@ extern "C"
 
     void upromise_task_queue_push(upromise_task_queue_t *queue, upromise_task_t *task);
     void upromise_task_queue_push_immediately(upromise_task_queue_t *queue, upromise_task_t *task);
+    void upromise_task_queue_splice(upromise_task_queue_t *dst, upromise_task_queue_t *src);
     upromise_task_t *upromise_task_queue_pop(upromise_task_queue_t *queue);
 
+    // run queue
+    // Power-of-two ring of task records stored by value, so queueing work
+    // touches no allocator. A record with `next` set stands for a spliced
+    // waiter list: the loop runs its first node and puts the rest in front.
+    typedef struct upromise_run_queue_t
+    {
+        upromise_task_t *tasks;
+        size_t mask;
+        size_t head;
+        size_t size;
+    } upromise_run_queue_t;
+
+    // push aborts when the queue cannot grow, try_push returns 0 instead
+    void upromise_run_queue_push(upromise_run_queue_t *queue, upromise_task_fn fn, intptr_t co, void *extra);
+    int upromise_run_queue_try_push(upromise_run_queue_t *queue, upromise_task_fn fn, intptr_t co, void *extra);
+    void upromise_run_queue_push_immediately(upromise_run_queue_t *queue, upromise_task_fn fn, intptr_t co, void *extra);
+    void upromise_run_queue_splice(upromise_run_queue_t *queue, upromise_task_queue_t *src);
+    int upromise_run_queue_pop(upromise_run_queue_t *queue, upromise_task_t *task);
+
+    // pool
+    // Size-class free lists carved out of large slabs. Objects go back to
+    // their class on free; slabs are only released all at once when the
+    // pool is cleared.
+#define UPROMISE_POOL_GRANULE 16
+#define UPROMISE_POOL_CLASSES 16
+
+    typedef struct upromise_pool_t
+    {
+        void *free[UPROMISE_POOL_CLASSES];
+        void *slabs;
+        char *cursor;
+        char *end;
+#ifdef UPROMISE_ATOMIC_REFCOUNT
+        bool lock; // the last handle may be dropped on any thread
+#endif
+    } upromise_pool_t;
+
+    void *upromise_pool_alloc(upromise_pool_t *pool, size_t size);
+    void upromise_pool_free(upromise_pool_t *pool, void *ptr, size_t size);
+
+    // inbox
+    // Intrusive multi-producer single-consumer queue (Vyukov). Any thread
+    // may push; only the dispatcher thread pops. `head` is accessed with
+    // atomic builtins, `tail` belongs to the consumer.
+    typedef struct upromise_inbox_t
+    {
+        upromise_task_t *head;
+        upromise_task_t *tail;
+        upromise_task_t stub;
+    } upromise_inbox_t;
+
+    // timer
+    // Hierarchical timing wheel with 1ms ticks: 4 levels of 64 slots reach
+    // about 4.6 hours, later deadlines park in the top level and cascade
+    // down as it turns. Timers are intrusive and caller-owned, so start
+    // and cancel are O(1) list operations with no allocation.
+#define UPROMISE_WHEEL_BITS 6
+#define UPROMISE_WHEEL_SLOTS (1 << UPROMISE_WHEEL_BITS)
+#define UPROMISE_WHEEL_LEVELS 4
+
+    typedef struct upromise_timer_t
+    {
+        struct upromise_timer_t *next;
+        struct upromise_timer_t **pprev; // NULL when not pending
+        uint64_t deadline;               // ms, monotonic clock
+        int slot;                        // level * UPROMISE_WHEEL_SLOTS + slot, -1 once taken out
+        upromise_task_fn fn;
+        void *extra;
+    } upromise_timer_t;
+
+    typedef struct upromise_timer_wheel_t
+    {
+        uint64_t now;            // last tick processed
+        uint64_t (*clock)(void); // ms, CLOCK_MONOTONIC unless replaced before any timer starts
+        size_t count;
+        uint64_t occupied[UPROMISE_WHEEL_LEVELS];
+        // slots are FIFO so equal deadlines fire in start order
+        upromise_timer_t *slots[UPROMISE_WHEEL_LEVELS * UPROMISE_WHEEL_SLOTS];
+        upromise_timer_t **tails[UPROMISE_WHEEL_LEVELS * UPROMISE_WHEEL_SLOTS];
+    } upromise_timer_wheel_t;
+
+    // epoll or io_uring state for upromise/io.h, created on first use
+    typedef struct upromise_reactor_t upromise_reactor_t;
+
+    typedef enum upromise_io_backend
+    {
+        UPROMISE_IO_EPOLL = 0,
+        // io_uring when built WITH_IO_URING and the kernel allows it, epoll otherwise
+        UPROMISE_IO_URING = 1,
+    } upromise_io_backend;
+
+    // priority
+    // Every class has its own lane. The dispatcher runs the most urgent
+    // non-empty lane, but a lane passed over UPROMISE_PRIORITY_BOUND times
+    // gets the next turn, so background work still advances under load.
+    typedef enum upromise_priority
+    {
+        UPROMISE_PRIORITY_HIGH = 0,
+        UPROMISE_PRIORITY_NORMAL = 1,
+        UPROMISE_PRIORITY_BACKGROUND = 2,
+    } upromise_priority;
+#define UPROMISE_PRIORITY_COUNT 3
+#define UPROMISE_PRIORITY_BOUND 16
+
     // dispatcher
     typedef struct upromise_dispatcher_t
     {
         struct schedule *sch;
-        upromise_task_queue_t queue;
+        upromise_run_queue_t lanes[UPROMISE_PRIORITY_COUNT];
+        unsigned starved[UPROMISE_PRIORITY_COUNT];
+        upromise_priority priority; // class of the running task, new work joins it
+        upromise_pool_t pool;
+        int running; // inside upromise_dispatcher_run
+        upromise_inbox_t inbox;
+        // run_forever parks on wake_fd[0] (an eventfd, or a pipe where
+        // there is none); posters only write to it while `sleeping` is set
+        int wake_fd[2];
+        int sleeping;
+        int stop;
+        upromise_timer_wheel_t timers;
+        upromise_reactor_t *reactor;
+        upromise_io_backend io_backend; // requested, the reactor may fall back
     } upromise_dispatcher_t;
 
+    typedef enum upromise_stack_mode
+    {
+        // all coroutines share one stack, suspended frames are copied out
+        UPROMISE_STACK_SHARED = COROUTINE_STACK_SHARED,
+        // every coroutine owns a guarded stack, switches copy nothing
+        UPROMISE_STACK_DEDICATED = COROUTINE_STACK_DEDICATED,
+    } upromise_stack_mode;
+
+    typedef struct upromise_dispatcher_options_t
+    {
+        upromise_stack_mode stack_mode;
+        size_t stack_size; // dedicated mode only, 0 for default
+        upromise_io_backend io_backend;
+    } upromise_dispatcher_options_t;
+
+    // NULL when the wake-up fd cannot be created (e.g. out of descriptors)
+    // or out of memory
     upromise_dispatcher_t *new_upromise_dispatcher();
+    upromise_dispatcher_t *new_upromise_dispatcher_ex(const upromise_dispatcher_options_t *options);
     void del_upromise_dispatcher(upromise_dispatcher_t *dispatcher);
     void upromise_dispatcher_run(upromise_dispatcher_t *dispatcher);
 
+    typedef struct upromise_run_result_t
+    {
+        size_t ran;
+        size_t queued;  // run queue depth left behind
+        int remaining;  // queued tasks or posts are waiting for the next run
+        int timeout_ms; // until the next timer, -1 for none
+    } upromise_run_result_t;
+
+    // Budgeted runs for embedding in a host loop: stop after `max_tasks`
+    // tasks, or once `max_ns` have passed (the clock is read every 16
+    // tasks). At least one task runs when there is any.
+    upromise_run_result_t upromise_dispatcher_run_n(upromise_dispatcher_t *dispatcher, size_t max_tasks);
+    upromise_run_result_t upromise_dispatcher_run_for(upromise_dispatcher_t *dispatcher, uint64_t max_ns);
+    // Run tasks and sleep while idle until upromise_dispatcher_stop. A stop
+    // request is consumed by the run_forever call it ends.
+    void upromise_dispatcher_run_forever(upromise_dispatcher_t *dispatcher);
+    // thread-safe
+    void upromise_dispatcher_stop(upromise_dispatcher_t *dispatcher);
+    // thread-safe: queue fn(extra) to run on the dispatcher's own thread
+    void upromise_dispatcher_post(upromise_dispatcher_t *dispatcher, upromise_task_fn fn, void *extra);
+
+    // Work created from now on (promises, async bodies and the continuations
+    // they settle) belongs to `priority`; returns the previous class. Inside
+    // a task this is the task's class.
+    upromise_priority upromise_dispatcher_set_priority(upromise_dispatcher_t *dispatcher, upromise_priority priority);
+
+    // milliseconds on the clock this dispatcher's timers read; not the
+    // wheel's last tick, which lags while no timer is due
+    uint64_t upromise_dispatcher_now(upromise_dispatcher_t *dispatcher);
+    // fn(extra) runs on the dispatcher loop once `ms` have passed
+    void upromise_timer_start(upromise_dispatcher_t *dispatcher, upromise_timer_t *timer, uint64_t ms, upromise_task_fn fn, void *extra);
+    // returns 1 if the timer was still pending; a timer that was never
+    // started must be zeroed
+    int upromise_timer_cancel(upromise_dispatcher_t *dispatcher, upromise_timer_t *timer);
+
     // promise
     typedef enum upromise_promise_state
     {
@@ -54,6 +242,7 @@ extern "C"
         upromise_ref_count_t rc;
         upromise_dispatcher_t *dispatcher;
         upromise_promise_state state;
+        upromise_priority priority; // the lane its waiters run in
         void *data;
         upromise_task_queue_t queue;
     } upromise_promise_t;
@@ -62,25 +251,113 @@ extern "C"
     typedef void *(*upromise_promise_then_fn)(void *data, void **error, void *ctx);
     typedef upromise_promise_t *(*upromise_promise_then_fn_thenable)(void *data, void **error, void *ctx);
 
+    // NULL when out of memory, fn is not called then
     upromise_promise_t *new_upromise_promise(upromise_dispatcher_t *dispatcher, upromise_promise_fn fn, void *ctx);
     void del_upromise_promise(upromise_promise_t *promise);
     void resolve_upromise_promise(upromise_promise_t *promise, void *value);
     void reject_upromise_promise(upromise_promise_t *promise, void *reason);
     void resolve_upromise_promise_thenable(upromise_promise_t *promise, upromise_promise_t *value);
+    // thread-safe: settle through the dispatcher's inbox, the caller's
+    // reference to `promise` is released on the dispatcher thread
+    void resolve_upromise_promise_threadsafe(upromise_promise_t *promise, void *value);
+    void reject_upromise_promise_threadsafe(upromise_promise_t *promise, void *reason);
+    // the then() family returns NULL when out of memory, ctx stays with
+    // the caller and no callback runs
     upromise_promise_t *upromise_promise_then(upromise_promise_t *promise, void *ctx, upromise_promise_then_fn onFulfilled, upromise_promise_then_fn onRejected);
     upromise_promise_t *upromise_promise_then_thenable_common(upromise_promise_t *promise, void *ctx, upromise_promise_then_fn_thenable onFulfilled, upromise_promise_then_fn onRejected);
     upromise_promise_t *upromise_promise_then_common_thenable(upromise_promise_t *promise, void *ctx, upromise_promise_then_fn onFulfilled, upromise_promise_then_fn_thenable onRejected);
     upromise_promise_t *upromise_promise_then_thenable(upromise_promise_t *promise, void *ctx, upromise_promise_then_fn_thenable onFulfilled, upromise_promise_then_fn_thenable onRejected);
+    typedef void (*upromise_then_release_fn)(void *ctx);
+    // `release` gets the then() ctx of the pending promise `next` if its
+    // callbacks are dropped unrun, as when a cancel takes the waiter back or
+    // the source settles in a state with no callback
+    void upromise_promise_then_release(upromise_promise_t *next, upromise_then_release_fn release);
     extern void *upromise_recurse_error;
 
+    // combinators
+    // Like Promise.all / allSettled / race / any over `count` promises that
+    // stay owned by the caller. Arrays handed to a callback are malloc'd in
+    // input order and belong to it. all fulfils with the values (void *[])
+    // or rejects with the first reason; all_settled fulfils with a
+    // upromise_settled_t[]; race follows the first to settle and never
+    // settles for none; any fulfils with the first value or rejects with
+    // the reasons (void *[]). They reject with upromise_nomem_error when
+    // the waiters or the array cannot be allocated, and return NULL when
+    // not even the promise can be.
+    typedef struct upromise_settled_t
+    {
+        upromise_promise_state state;
+        void *data;
+    } upromise_settled_t;
+
+    upromise_promise_t *upromise_promise_all(upromise_dispatcher_t *dispatcher, upromise_promise_t **promises, size_t count);
+    upromise_promise_t *upromise_promise_all_settled(upromise_dispatcher_t *dispatcher, upromise_promise_t **promises, size_t count);
+    upromise_promise_t *upromise_promise_race(upromise_dispatcher_t *dispatcher, upromise_promise_t **promises, size_t count);
+    upromise_promise_t *upromise_promise_any(upromise_dispatcher_t *dispatcher, upromise_promise_t **promises, size_t count);
+    extern void *upromise_nomem_error;
+
+    // cancel
+    // A token fans one cancel out to every link registered on it. Links are
+    // intrusive and caller-owned like timers; each holds a token reference
+    // until it is unlinked or fired, so the token may be released any time.
+    typedef void (*upromise_cancel_fn)(void *extra, void *reason);
+
+    typedef struct upromise_cancel_token_t upromise_cancel_token_t;
+
+    typedef struct upromise_cancel_link_t
+    {
+        struct upromise_cancel_link_t *next;
+        struct upromise_cancel_link_t **pprev; // NULL when not linked
+        upromise_cancel_token_t *token;
+        upromise_cancel_fn fn;
+        void *extra;
+    } upromise_cancel_link_t;
+
+    struct upromise_cancel_token_t
+    {
+        upromise_ref_count_t rc;
+        upromise_dispatcher_t *dispatcher;
+        int cancelled;
+        void *reason;
+        upromise_cancel_link_t *links;
+    };
+
+    // NULL when out of memory
+    upromise_cancel_token_t *new_upromise_cancel_token(upromise_dispatcher_t *dispatcher);
+    void del_upromise_cancel_token(upromise_cancel_token_t *token);
+    // fire every link once, later calls do nothing; a NULL reason becomes
+    // upromise_cancel_error so it still reads as an error
+    void upromise_cancel(upromise_cancel_token_t *token, void *reason);
+    // returns 0 without linking when the token is already cancelled
+    int upromise_cancel_link(upromise_cancel_token_t *token, upromise_cancel_link_t *link, upromise_cancel_fn fn, void *extra);
+    // returns 1 if the link was still waiting
+    int upromise_cancel_unlink(upromise_cancel_link_t *link);
+    // Reject `promise` with the reason once the token is cancelled, unless
+    // it has settled (or adopted another promise) by then; its waiters are
+    // released right away, and so is the waiter a promise made by then()
+    // still has on its source. When out of memory for the watch it is
+    // rejected with upromise_nomem_error instead.
+    void upromise_promise_cancel_on(upromise_promise_t *promise, upromise_cancel_token_t *token);
+    extern void *upromise_cancel_error;
+
+    // a promise fulfilled with NULL once `ms` have passed, NULL when out
+    // of memory
+    upromise_promise_t *upromise_sleep(upromise_dispatcher_t *dispatcher, uint64_t ms);
+    // also rejects with the reason, dropping the timer, once `token` is
+    // cancelled
+    upromise_promise_t *upromise_sleep_cancellable(upromise_dispatcher_t *dispatcher, uint64_t ms, upromise_cancel_token_t *token);
+
 #ifdef __cplusplus
 }
 #endif
 
 #ifdef __cplusplus
+#include <chrono>
 #include <functional>
 #include <memory>
+#include <new>
 #include <variant>
+#include <vector>
 #include <stdexcept>
 
 namespace upromise
@@ -90,7 +367,18 @@ namespace upromise
     public:
         upromise_dispatcher_t *dispatcher;
 
-        Dispatcher() : dispatcher(nullptr) { dispatcher = new_upromise_dispatcher(); }
+        Dispatcher() : dispatcher(nullptr)
+        {
+            dispatcher = new_upromise_dispatcher();
+            if (!dispatcher)
+                throw std::runtime_error("cannot create dispatcher");
+        }
+        Dispatcher(const upromise_dispatcher_options_t &options) : dispatcher(nullptr)
+        {
+            dispatcher = new_upromise_dispatcher_ex(&options);
+            if (!dispatcher)
+                throw std::runtime_error("cannot create dispatcher");
+        }
         ~Dispatcher()
         {
             if (dispatcher)
@@ -112,6 +400,24 @@ namespace upromise
             return *this;
         }
         void run() { upromise_dispatcher_run(dispatcher); }
+        upromise_run_result_t run_n(size_t max_tasks) { return upromise_dispatcher_run_n(dispatcher, max_tasks); }
+        upromise_run_result_t run_for(std::chrono::nanoseconds budget) { return upromise_dispatcher_run_for(dispatcher, budget.count() < 0 ? 0 : budget.count()); }
+        void run_forever() { upromise_dispatcher_run_forever(dispatcher); }
+        void stop() { upromise_dispatcher_stop(dispatcher); }
+        upromise_priority set_priority(upromise_priority priority) { return upromise_dispatcher_set_priority(dispatcher, priority); }
+        // thread-safe, fn runs on the thread that runs this dispatcher
+        void post(std::function<void()> fn)
+        {
+            upromise_dispatcher_post(dispatcher, &Dispatcher::common_post, new std::function<void()>(std::move(fn)));
+        }
+
+    private:
+        static void common_post(void *ctx_raw)
+        {
+            std::function<void()> *fn = (std::function<void()> *)ctx_raw;
+            (*fn)();
+            delete fn;
+        }
     };
 
     struct Error
@@ -119,6 +425,57 @@ namespace upromise
         void *err;
     };
 
+    class CancelToken
+    {
+        upromise_cancel_token_t *token;
+
+    public:
+        CancelToken() : token(nullptr) {}
+        CancelToken(const std::shared_ptr<Dispatcher> &dispatcher) : token(new_upromise_cancel_token(dispatcher->dispatcher))
+        {
+            if (token == nullptr)
+                throw std::bad_alloc();
+        }
+        ~CancelToken()
+        {
+            if (token)
+                del_upromise_cancel_token(token);
+        }
+        CancelToken(const CancelToken &t) : token(t.token)
+        {
+            if (token)
+                upromise_ref_count_inc(&token->rc);
+        }
+        CancelToken &operator=(const CancelToken &t)
+        {
+            if (t.token)
+                upromise_ref_count_inc(&t.token->rc);
+            if (token)
+                del_upromise_cancel_token(token);
+            token = t.token;
+            return *this;
+        }
+        CancelToken(CancelToken &&t) : token(t.token) { t.token = nullptr; }
+        CancelToken &operator=(CancelToken &&t)
+        {
+            std::swap(token, t.token);
+            return *this;
+        }
+
+        upromise_cancel_token_t *impl() const { return token; }
+        void cancel(void *reason = nullptr) { upromise_cancel(checked(), reason); }
+        bool cancelled() const { return checked()->cancelled; }
+        void *reason() const { return checked()->reason; }
+
+    private:
+        upromise_cancel_token_t *checked() const
+        {
+            if (!token)
+                throw std::runtime_error("uninitialized cancel token");
+            return token;
+        }
+    };
+
     class Promise;
     class Thenable
     {
@@ -155,8 +512,14 @@ namespace upromise
 
         Promise() : promise(nullptr) {}
 
+        // takes the reference `ptr` holds; a NULL from an allocating call
+        // throws std::bad_alloc
         Promise(const std::shared_ptr<Dispatcher> &dispatcher, upromise_promise_t *ptr)
-            : dispatcher(dispatcher), promise(ptr) {}
+            : dispatcher(dispatcher), promise(ptr)
+        {
+            if (promise == nullptr)
+                throw std::bad_alloc();
+        }
 
         struct BodyContext
         {
@@ -170,6 +533,11 @@ namespace upromise
             ptr->fn = fn;
             ptr->dispatcher = dispatcher;
             promise = new_upromise_promise(dispatcher->dispatcher, &Promise::common_body, ptr);
+            if (promise == nullptr)
+            {
+                delete ptr;
+                throw std::bad_alloc();
+            }
         }
         ~Promise()
         {
@@ -180,13 +548,17 @@ namespace upromise
         {
             promise = p.promise;
             dispatcher = p.dispatcher;
-            promise->rc += 1;
+            if (promise)
+                upromise_ref_count_inc(&promise->rc);
         }
         Promise &operator=(const Promise &p)
         {
+            if (p.promise)
+                upromise_ref_count_inc(&p.promise->rc);
+            if (promise)
+                del_upromise_promise(promise);
             promise = p.promise;
             dispatcher = p.dispatcher;
-            promise->rc += 1;
             return *this;
         }
         Promise(Promise &&p)
@@ -197,14 +569,22 @@ namespace upromise
         }
         Promise &operator=(Promise &&p)
         {
-            promise = p.promise;
-            p.promise = NULL;
-            dispatcher = std::move(p.dispatcher);
+            std::swap(promise, p.promise);
+            std::swap(dispatcher, p.dispatcher);
             return *this;
         }
 
         upromise_promise_t *impl() { return promise; }
 
+        // reject with the token's reason if it is cancelled first
+        const Promise &cancel_on(const CancelToken &token) const
+        {
+            if (!token.impl())
+                throw std::runtime_error("uninitialized cancel token");
+            upromise_promise_cancel_on(promise, token.impl());
+            return *this;
+        }
+
         Promise then(CallbackFn onFulfilled, CallbackFn onRejected = nullptr) const
         {
             if (!promise)
@@ -311,25 +691,65 @@ namespace upromise
                 new_promise = upromise_promise_then_common_thenable(promise, ctx, onFulfilled.index() != 0 ? &Promise::common_fulfilled : nullptr, &Promise::common_rejected_thenable);
             else if (onFulfilled.index() == 2 && onRejected.index() == 2)
                 new_promise = upromise_promise_then_thenable(promise, ctx, &Promise::common_fulfilled_thenable, &Promise::common_rejected_thenable);
+            if (new_promise == NULL)
+            {
+                delete ctx;
+                throw std::bad_alloc();
+            }
+            upromise_promise_then_release(new_promise, &Promise::common_release);
             return Promise(dispatcher, new_promise);
         }
 
-        struct Notifier
+        // resolve functions may be kept and called after the body returned,
+        // so the pair shares one hold on the promise. The first call takes it
+        // and the rest are no-ops, so a resolve function captured by a
+        // callback of its own promise does not keep that promise alive once
+        // it has settled.
+        struct Settler
         {
             upromise_promise_t *promise;
+            Settler(upromise_promise_t *promise) : promise(promise)
+            {
+                upromise_ref_count_inc(&promise->rc);
+            }
+            Settler(const Settler &) = delete;
+            Settler &operator=(const Settler &) = delete;
+            ~Settler()
+            {
+                if (promise != NULL)
+                    del_upromise_promise(promise);
+            }
+            upromise_promise_t *take()
+            {
+                upromise_promise_t *ret = promise;
+                promise = NULL;
+                return ret;
+            }
+        };
+
+        struct NotifierBase
+        {
+            std::shared_ptr<Settler> settler;
             std::shared_ptr<Dispatcher> dispatcher;
-            Notifier(upromise_promise_t *promise, std::shared_ptr<Dispatcher> dispatcher) : promise(promise), dispatcher(dispatcher) {}
+            NotifierBase(std::shared_ptr<Settler> settler, std::shared_ptr<Dispatcher> dispatcher) : settler(settler), dispatcher(dispatcher) {}
+        };
+
+        struct Notifier : NotifierBase
+        {
+            using NotifierBase::NotifierBase;
             void operator()(void *data)
             {
+                upromise_promise_t *promise = settler->take();
+                if (promise == NULL)
+                    return;
                 reject_upromise_promise(promise, data);
+                del_upromise_promise(promise);
             }
         };
 
-        struct ResolveNotifier
+        struct ResolveNotifier : NotifierBase
         {
-            upromise_promise_t *promise;
-            std::shared_ptr<Dispatcher> dispatcher;
-            ResolveNotifier(upromise_promise_t *promise, std::shared_ptr<Dispatcher> dispatcher) : promise(promise), dispatcher(dispatcher) {}
+            using NotifierBase::NotifierBase;
             void operator()(Resolvable data);
         };
 
@@ -338,7 +758,8 @@ namespace upromise
             BodyContext *ctx = (BodyContext *)ctx_raw;
             try
             {
-                ctx->fn(ResolveNotifier(promise, ctx->dispatcher), Notifier(promise, ctx->dispatcher));
+                auto settler = std::make_shared<Settler>(promise);
+                ctx->fn(ResolveNotifier(settler, ctx->dispatcher), Notifier(settler, ctx->dispatcher));
             }
             catch (Error err)
             {
@@ -354,6 +775,11 @@ namespace upromise
             std::variant<std::monostate, CallbackFn, ThenableCallbackFn> onRejected;
         };
 
+        static void common_release(void *ctx_raw)
+        {
+            delete (common_then_ctx *)ctx_raw;
+        }
+
         static void *common_fulfilled(void *data, void **error, void *ctx_raw)
         {
             common_then_ctx *ctx = (common_then_ctx *)ctx_raw;
@@ -367,6 +793,7 @@ namespace upromise
             {
                 *error = err.err;
             }
+            delete ctx;
             return nullptr;
         }
 
@@ -383,6 +810,7 @@ namespace upromise
             {
                 *error = err.err;
             }
+            delete ctx;
             return nullptr;
         }
 
@@ -401,6 +829,7 @@ namespace upromise
             {
                 *error = err.err;
             }
+            delete ctx;
             return nullptr;
         }
 
@@ -419,12 +848,57 @@ namespace upromise
             {
                 *error = err.err;
             }
+            delete ctx;
             return nullptr;
         }
     };
 
+    inline Promise sleep(const std::shared_ptr<Dispatcher> &dispatcher, uint64_t ms)
+    {
+        return Promise(dispatcher, upromise_sleep(dispatcher->dispatcher, ms));
+    }
+
+    inline Promise sleep(const std::shared_ptr<Dispatcher> &dispatcher, uint64_t ms, const CancelToken &token)
+    {
+        return Promise(dispatcher, upromise_sleep_cancellable(dispatcher->dispatcher, ms, token.impl()));
+    }
+
+    using Combinator = upromise_promise_t *(*)(upromise_dispatcher_t *, upromise_promise_t **, size_t);
+
+    inline Promise combine(Combinator fn, const std::shared_ptr<Dispatcher> &dispatcher, std::vector<Promise> promises)
+    {
+        std::vector<upromise_promise_t *> raw;
+        raw.reserve(promises.size());
+        for (auto &promise : promises)
+            raw.push_back(promise.impl());
+        return Promise(dispatcher, fn(dispatcher->dispatcher, raw.data(), raw.size()));
+    }
+
+    inline Promise all(const std::shared_ptr<Dispatcher> &dispatcher, std::vector<Promise> promises)
+    {
+        return combine(upromise_promise_all, dispatcher, std::move(promises));
+    }
+
+    inline Promise all_settled(const std::shared_ptr<Dispatcher> &dispatcher, std::vector<Promise> promises)
+    {
+        return combine(upromise_promise_all_settled, dispatcher, std::move(promises));
+    }
+
+    inline Promise race(const std::shared_ptr<Dispatcher> &dispatcher, std::vector<Promise> promises)
+    {
+        return combine(upromise_promise_race, dispatcher, std::move(promises));
+    }
+
+    inline Promise any(const std::shared_ptr<Dispatcher> &dispatcher, std::vector<Promise> promises)
+    {
+        return combine(upromise_promise_any, dispatcher, std::move(promises));
+    }
+
     inline void Promise::ResolveNotifier::operator()(Resolvable data)
     {
+        upromise_promise_t *promise = settler->take();
+        if (promise == NULL)
+            return;
         switch (data.index())
         {
         case 0:
@@ -454,6 +928,7 @@ namespace upromise
         default:
             break;
         }
+        del_upromise_promise(promise);
     }
 }
 #endif
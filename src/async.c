@@ -2,26 +2,37 @@
 #include <stdlib.h>
 #include <stdbool.h>
 
+upromise_task_t *new_upromise_task(upromise_dispatcher_t *dispatcher, upromise_task_fn fn, intptr_t co, void *extra);
+void del_upromise_task(upromise_dispatcher_t *dispatcher, upromise_task_t *task);
 void init_upromise_task_queue(upromise_task_queue_t *queue);
-void clear_upromise_task_queue(upromise_task_queue_t *queue);
-void upromise_ref_count_inc(upromise_ref_count_t *rc);
-bool upromise_ref_count_dec(upromise_ref_count_t *rc);
+void upromise_dispatcher_run_until(upromise_dispatcher_t *dispatcher, void *marker);
+void clear_upromise_task_queue(upromise_dispatcher_t *dispatcher, upromise_task_queue_t *queue);
+int upromise_promise_unthen(upromise_promise_t *promise, upromise_promise_t *next);
+void upromise_promise_wait(upromise_promise_t *promise, upromise_task_t *task);
+int upromise_promise_unwait(upromise_promise_t *promise, upromise_task_t *task);
+upromise_promise_t *upromise_promise_target(upromise_promise_t *promise);
 
-void run_immediately(upromise_dispatcher_t *dispatcher, upromise_task_t *task)
+void run_immediately(upromise_dispatcher_t *dispatcher, intptr_t co)
 {
-    int current_co = coroutine_running(dispatcher->sch);
-    bool yieldable = false;
-    if (coroutine_status(dispatcher->sch, current_co) == COROUTINE_RUNNING)
+    intptr_t current_co = coroutine_running(dispatcher->sch);
+    if (current_co < 0 && dispatcher->running)
     {
-        upromise_task_t *current_task = malloc(sizeof(upromise_task_t));
-        current_task->co = current_co;
-        current_task->extra = NULL;
-        upromise_task_queue_push_immediately(&dispatcher->queue, current_task);
-        yieldable = true;
+        // called from an inline task on the dispatcher loop: the caller has
+        // no coroutine to yield, so run everything queued in front of it here
+        char marker;
+        upromise_run_queue_push_immediately(&dispatcher->lanes[dispatcher->priority], NULL, -1, &marker);
+        upromise_run_queue_push_immediately(&dispatcher->lanes[dispatcher->priority], NULL, co, NULL);
+        upromise_dispatcher_run_until(dispatcher, &marker);
+        return;
+    }
+    if (current_co >= 0 && coroutine_status(dispatcher->sch, current_co) == COROUTINE_RUNNING)
+    {
+        // the caller goes on once `co` yields, `co` itself skips the queue
+        upromise_run_queue_push_immediately(&dispatcher->lanes[dispatcher->priority], NULL, current_co, NULL);
+        coroutine_transfer(dispatcher->sch, co);
+        return;
     }
-    upromise_task_queue_push_immediately(&dispatcher->queue, task);
-    if (yieldable)
-        coroutine_yield(dispatcher->sch);
+    upromise_run_queue_push_immediately(&dispatcher->lanes[dispatcher->priority], NULL, co, NULL);
 }
 
 // async
@@ -38,11 +49,20 @@ void async_task_fn(struct schedule *sch, void *ctx_raw)
     upromise_async_fn fn = ctx->fn;
     void *fn_ctx = ctx->ctx;
     upromise_async_context_t *actx = ctx->actx;
-    free(ctx);
+    upromise_dispatcher_t *dispatcher = actx->promise->dispatcher;
+    upromise_pool_free(&dispatcher->pool, ctx, sizeof(async_promise_context));
     void *error = NULL;
     void *ret = fn(actx, &error, fn_ctx);
+    if (actx->dispatcher != dispatcher)
+    {
+        // moved by an executor: go back to settle where the promise lives
+        actx->finished = 1;
+        upromise_run_queue_push(&actx->dispatcher->lanes[actx->dispatcher->priority], actx->wake, -1, actx);
+        coroutine_yield(actx->dispatcher->sch);
+    }
     upromise_promise_t *promise = actx->promise;
-    free(actx);
+    upromise_cancel_unlink(&actx->cancel);
+    upromise_pool_free(&dispatcher->pool, actx, sizeof(upromise_async_context_t));
     if (error != NULL)
         reject_upromise_promise(promise, error);
     else
@@ -50,66 +70,146 @@ void async_task_fn(struct schedule *sch, void *ctx_raw)
     del_upromise_promise(promise);
 }
 
+// Reject right away; a body suspended in an await is resumed with the
+// reason so it unwinds now instead of when the awaited promise settles.
+void async_cancel_fn(void *extra, void *reason)
+{
+    upromise_async_context_t *actx = (upromise_async_context_t *)extra;
+    actx->cancelled = reason;
+    reject_upromise_promise(actx->promise, reason);
+    if (actx->awaiting == NULL || !upromise_promise_unwait(actx->awaiting, &actx->waiter))
+        return;
+    // the await takes the reason; with the waiter gone this is the only
+    // wake-up left, and it goes through `wake` like any other
+    del_upromise_promise(actx->awaiting);
+    actx->awaiting = NULL;
+    actx->result.ret = NULL;
+    actx->result.error = reason;
+    upromise_run_queue_push_immediately(&actx->dispatcher->lanes[actx->promise->priority], actx->wake, -1, actx);
+}
+
 void async_promise_fn(upromise_promise_t *promise, void *ctx_raw)
 {
     async_promise_context *ctx = (async_promise_context *)ctx_raw;
-    ctx->actx = malloc(sizeof(upromise_async_context_t));
-    ctx->actx->promise = promise;
-    upromise_task_t *task = malloc(sizeof(upromise_task_t));
-    task->co = coroutine_new(promise->dispatcher->sch, async_task_fn, ctx);
-    ctx->actx->co = task->co;
-    task->extra = NULL;
-    run_immediately(promise->dispatcher, task);
+    ctx->actx->promise = promise; // the fn hold goes to the body
 }
 
-upromise_promise_t *upromise_async(upromise_dispatcher_t *dispatcher, upromise_async_fn fn, void *ctx)
+static void async_resume_fn(void *extra)
 {
-    async_promise_context *promise_ctx = malloc(sizeof(async_promise_context));
+    upromise_async_context_t *context = (upromise_async_context_t *)extra;
+    coroutine_resume(context->dispatcher->sch, context->co);
+}
+
+// `wake` switches back into the body, straight away unless an executor
+// moves it elsewhere first. Everything that can fail is set up before the
+// body may run, so on NULL `ctx` is still the caller's.
+upromise_promise_t *upromise_async_impl(upromise_dispatcher_t *dispatcher, upromise_cancel_token_t *token, upromise_task_fn wake, upromise_async_fn fn, void *ctx)
+{
+    async_promise_context *promise_ctx = upromise_pool_alloc(&dispatcher->pool, sizeof(async_promise_context));
+    upromise_async_context_t *actx = upromise_pool_alloc(&dispatcher->pool, sizeof(upromise_async_context_t));
+    upromise_promise_t *promise = NULL;
+    if (promise_ctx != NULL && actx != NULL)
+    {
+        promise_ctx->actx = actx;
+        promise = new_upromise_promise(dispatcher, async_promise_fn, promise_ctx);
+    }
+    if (promise == NULL)
+    {
+        if (promise_ctx != NULL)
+            upromise_pool_free(&dispatcher->pool, promise_ctx, sizeof(async_promise_context));
+        if (actx != NULL)
+            upromise_pool_free(&dispatcher->pool, actx, sizeof(upromise_async_context_t));
+        return NULL;
+    }
+    actx->co = coroutine_new(dispatcher->sch, async_task_fn, promise_ctx);
+    if (actx->co < 0)
+    {
+        // nothing has seen the promise yet: drop the fn hold and the return
+        // hold together with the contexts
+        upromise_pool_free(&dispatcher->pool, promise_ctx, sizeof(async_promise_context));
+        upromise_pool_free(&dispatcher->pool, actx, sizeof(upromise_async_context_t));
+        del_upromise_promise(promise);
+        del_upromise_promise(promise);
+        return NULL;
+    }
     promise_ctx->fn = fn;
     promise_ctx->ctx = ctx;
-    return new_upromise_promise(dispatcher, async_promise_fn, promise_ctx);
+    actx->dispatcher = dispatcher;
+    actx->wake = wake;
+    actx->finished = 0;
+    actx->cancelled = NULL;
+    actx->awaiting = NULL;
+    actx->cancel.pprev = NULL;
+    if (token != NULL && !upromise_cancel_link(token, &actx->cancel, async_cancel_fn, actx))
+        async_cancel_fn(actx, token->reason);
+    run_immediately(dispatcher, actx->co);
+    return promise;
 }
 
-typedef struct await_promise_context
+upromise_promise_t *upromise_async(upromise_dispatcher_t *dispatcher, upromise_async_fn fn, void *ctx)
 {
-    upromise_async_context_t *context;
-    upromise_await_result_t result;
-} await_promise_context;
+    return upromise_async_impl(dispatcher, NULL, async_resume_fn, fn, ctx);
+}
 
-void *await_then_resolve(void *data, void **error, void *ctx_raw)
+upromise_promise_t *upromise_async_cancellable(upromise_dispatcher_t *dispatcher, upromise_cancel_token_t *token, upromise_async_fn fn, void *ctx)
 {
-    await_promise_context *ctx = (await_promise_context *)ctx_raw;
-    ctx->result.ret = data;
-    ctx->result.error = NULL;
-    upromise_task_t *task = malloc(sizeof(upromise_task_t));
-    task->co = ctx->context->co;
-    task->extra = NULL;
-    upromise_task_queue_push_immediately(&ctx->context->promise->dispatcher->queue, task);
-    return NULL;
+    return upromise_async_impl(dispatcher, token, async_resume_fn, fn, ctx);
 }
 
-void *await_then_reject(void *data, void **error, void *ctx_raw)
+static upromise_await_result_t await_result(upromise_promise_t *settled)
 {
-    await_promise_context *ctx = (await_promise_context *)ctx_raw;
-    ctx->result.ret = NULL;
-    ctx->result.error = data;
-    upromise_task_t *task = malloc(sizeof(upromise_task_t));
-    task->co = ctx->context->co;
-    task->extra = NULL;
-    upromise_task_queue_push_immediately(&ctx->context->promise->dispatcher->queue, task);
-    return NULL;
+    upromise_await_result_t ret;
+    ret.ret = settled->state == UPROMISE_PROMISE_STATE_FULFILLED ? settled->data : NULL;
+    ret.error = settled->state == UPROMISE_PROMISE_STATE_REJECTED ? settled->data : NULL;
+    return ret;
+}
+
+// The awaited promise settled: take its result here, on the thread that
+// settled it, then hand the body to `wake`.
+static void await_wake_fn(void *extra)
+{
+    upromise_async_context_t *context = (upromise_async_context_t *)extra;
+    // the waiter may have been moved on by an adoption meanwhile
+    context->result = await_result(upromise_promise_target(context->awaiting));
+    del_upromise_promise(context->awaiting);
+    context->awaiting = NULL;
+    context->wake(context);
 }
 
 upromise_await_result_t upromise_await(upromise_async_context_t *context, upromise_promise_t *promise)
 {
-    await_promise_context *ctx = malloc(sizeof(await_promise_context));
-    ctx->context = context;
-    upromise_promise_t *temp = upromise_promise_then(promise, ctx, await_then_resolve, await_then_reject);
-    del_upromise_promise(temp);
-    coroutine_yield(context->promise->dispatcher->sch);
-    upromise_await_result_t ret = ctx->result;
-    free(ctx);
-    return ret;
+    upromise_await_result_t ret;
+    if (context->cancelled != NULL)
+    {
+        ret.ret = NULL;
+        ret.error = context->cancelled;
+        return ret;
+    }
+    // a settled promise has nothing to wait for, take its value without
+    // leaving the coroutine
+    upromise_promise_t *target = upromise_promise_target(promise);
+    if (target->state == UPROMISE_PROMISE_STATE_FULFILLED || target->state == UPROMISE_PROMISE_STATE_REJECTED)
+        return await_result(target);
+    context->awaiting = target;
+    upromise_ref_count_inc(&target->rc); // for waiter hold
+    context->waiter.fn = await_wake_fn;
+    context->waiter.co = -1;
+    context->waiter.extra = context;
+    upromise_promise_wait(target, &context->waiter);
+    coroutine_yield(context->dispatcher->sch);
+    return context->result;
+}
+
+// The timer follows the body's cancel token, so a cancelled sleeper does
+// not keep it until the deadline.
+void upromise_async_sleep(upromise_async_context_t *context, uint64_t ms)
+{
+    upromise_cancel_token_t *token = context->cancel.pprev != NULL ? context->cancel.token : NULL;
+    upromise_promise_t *timeout = upromise_sleep_cancellable(context->dispatcher, ms, token);
+    if (timeout == NULL)
+        return; // out of memory: there is no timer to wait for
+    upromise_await(context, timeout);
+    del_upromise_promise(timeout);
 }
 
 // generator
@@ -126,23 +226,36 @@ void generator_task_fn(struct schedule *sch, void *ctx_raw)
     upromise_generator_t *generator = ctx->generator;
     upromise_generator_fn fn = ctx->fn;
     void *fn_ctx = ctx->ctx;
-    free(ctx);
+    upromise_pool_free(&generator->dispatcher->pool, ctx, sizeof(generator_context));
     void *error = NULL;
-    upromise_ref_count_inc(&generator->rc);
     void *ret = fn(generator, &error, fn_ctx);
     generator->done = 1;
     generator->error = error;
     if (error == NULL)
         generator->data = ret;
+    // a finished coroutine can only return to the dispatcher
+    if (generator->caller >= 0)
+        upromise_run_queue_push_immediately(&generator->dispatcher->lanes[generator->dispatcher->priority], NULL, generator->caller, NULL);
+    generator->caller = -1;
     del_upromise_generator(generator);
     return;
 }
 
 upromise_generator_t *new_upromise_generator(upromise_dispatcher_t *dispatcher, upromise_generator_fn fn, void *ctx)
 {
-    upromise_generator_t *ret = malloc(sizeof(upromise_generator_t));
+    upromise_generator_t *ret = upromise_pool_alloc(&dispatcher->pool, sizeof(upromise_generator_t));
+    generator_context *task_ctx = upromise_pool_alloc(&dispatcher->pool, sizeof(generator_context));
+    if (ret == NULL || task_ctx == NULL)
+    {
+        if (ret != NULL)
+            upromise_pool_free(&dispatcher->pool, ret, sizeof(upromise_generator_t));
+        if (task_ctx != NULL)
+            upromise_pool_free(&dispatcher->pool, task_ctx, sizeof(generator_context));
+        return NULL;
+    }
     ret->rc = 0;
     ret->dispatcher = dispatcher;
+    ret->caller = -1;
     ret->done = 0;
     ret->need_done = 0;
     ret->data = NULL;
@@ -150,11 +263,16 @@ upromise_generator_t *new_upromise_generator(upromise_dispatcher_t *dispatcher,
     ret->set_data = NULL;
     upromise_ref_count_inc(&ret->rc); // for return hold
     upromise_ref_count_inc(&ret->rc); // for fn hold
-    generator_context *task_ctx = malloc(sizeof(generator_context));
     task_ctx->generator = ret;
     task_ctx->fn = fn;
     task_ctx->ctx = ctx;
     ret->co = coroutine_new(dispatcher->sch, generator_task_fn, task_ctx);
+    if (ret->co < 0)
+    {
+        upromise_pool_free(&dispatcher->pool, task_ctx, sizeof(generator_context));
+        upromise_pool_free(&dispatcher->pool, ret, sizeof(upromise_generator_t));
+        return NULL;
+    }
     return ret;
 }
 
@@ -162,7 +280,7 @@ void del_upromise_generator(upromise_generator_t *generator)
 {
     if (!upromise_ref_count_dec(&generator->rc))
         return;
-    free(generator);
+    upromise_pool_free(&generator->dispatcher->pool, generator, sizeof(upromise_generator_t));
 }
 
 upromise_generator_result_t upromise_generator_next(upromise_generator_t *generator, void *value)
@@ -175,10 +293,16 @@ upromise_generator_result_t upromise_generator_next(upromise_generator_t *genera
         ret.error = generator->error;
         return ret;
     }
-    upromise_task_t *task = malloc(sizeof(upromise_task_t));
-    task->co = generator->co;
-    task->extra = NULL;
-    run_immediately(generator->dispatcher, task);
+    // a coroutine caller switches to the generator and is switched back to
+    // by its yield, neither goes through the dispatcher
+    intptr_t caller = coroutine_running(generator->dispatcher->sch);
+    if (caller >= 0)
+    {
+        generator->caller = caller;
+        coroutine_transfer(generator->dispatcher->sch, generator->co);
+    }
+    else
+        run_immediately(generator->dispatcher, generator->co);
     ret.done = generator->done;
     ret.data = generator->data;
     ret.error = generator->error;
@@ -207,7 +331,12 @@ upromise_generator_result_t upromise_generator_throw(upromise_generator_t *gener
 upromise_yield_result_t upromise_yield(upromise_generator_t *generator, void *data)
 {
     generator->data = data;
-    coroutine_yield(generator->dispatcher->sch);
+    intptr_t caller = generator->caller;
+    generator->caller = -1;
+    if (caller >= 0)
+        coroutine_transfer(generator->dispatcher->sch, caller);
+    else
+        coroutine_yield(generator->dispatcher->sch);
     upromise_yield_result_t ret;
     ret.need_done = generator->need_done;
     generator->need_done = 0;
@@ -235,26 +364,30 @@ void agen_task_fn(struct schedule *sch, void *ctx_raw)
     upromise_agen_t *agen = ctx->agen;
     upromise_agen_fn fn = ctx->fn;
     void *fn_ctx = ctx->ctx;
-    free(ctx);
+    upromise_pool_free(&agen->dispatcher->pool, ctx, sizeof(agen_context));
     void *error = NULL;
     void *ret = fn(agen, &error, fn_ctx);
     agen->done = 1;
+    upromise_cancel_unlink(&agen->cancel);
     while (1)
     {
         upromise_task_t *task = upromise_task_queue_pop(&agen->next_queue);
         if (task == NULL)
             break;
         upromise_promise_t *next_promise = (upromise_promise_t *)task->extra;
-        free(task);
+        del_upromise_task(agen->dispatcher, task);
+        upromise_agen_result_t *result = NULL;
+        if (error == NULL && (result = malloc(sizeof(upromise_agen_result_t))) == NULL)
+            error = upromise_nomem_error;
         if (error != NULL)
             reject_upromise_promise(next_promise, error);
         else
         {
-            upromise_agen_result_t *result = malloc(sizeof(upromise_agen_result_t));
             result->done = 1;
             result->data = ret;
             resolve_upromise_promise(next_promise, result);
         }
+        del_upromise_promise(next_promise); // the queue's hold
         error = NULL;
         ret = NULL;
     }
@@ -264,7 +397,16 @@ void agen_task_fn(struct schedule *sch, void *ctx_raw)
 
 upromise_agen_t *new_upromise_agen(upromise_dispatcher_t *dispatcher, upromise_agen_fn fn, void *ctx)
 {
-    upromise_agen_t *ret = malloc(sizeof(upromise_agen_t));
+    upromise_agen_t *ret = upromise_pool_alloc(&dispatcher->pool, sizeof(upromise_agen_t));
+    agen_context *task_ctx = upromise_pool_alloc(&dispatcher->pool, sizeof(agen_context));
+    if (ret == NULL || task_ctx == NULL)
+    {
+        if (ret != NULL)
+            upromise_pool_free(&dispatcher->pool, ret, sizeof(upromise_agen_t));
+        if (task_ctx != NULL)
+            upromise_pool_free(&dispatcher->pool, task_ctx, sizeof(agen_context));
+        return NULL;
+    }
     ret->rc = 0;
     ret->dispatcher = dispatcher;
     ret->done = 0;
@@ -272,13 +414,22 @@ upromise_agen_t *new_upromise_agen(upromise_dispatcher_t *dispatcher, upromise_a
     ret->need_throw = 0;
     ret->set_data = NULL;
     init_upromise_task_queue(&ret->next_queue);
+    ret->cancel.pprev = NULL;
+    ret->cancelled = NULL;
+    ret->yield_promise = NULL;
+    ret->yield_then = NULL;
     upromise_ref_count_inc(&ret->rc); // for return hold
     upromise_ref_count_inc(&ret->rc); // for fn hold
-    agen_context *task_ctx = malloc(sizeof(agen_context));
     task_ctx->agen = ret;
     task_ctx->fn = fn;
     task_ctx->ctx = ctx;
     ret->co = coroutine_new(dispatcher->sch, agen_task_fn, task_ctx);
+    if (ret->co < 0)
+    {
+        upromise_pool_free(&dispatcher->pool, task_ctx, sizeof(agen_context));
+        upromise_pool_free(&dispatcher->pool, ret, sizeof(upromise_agen_t));
+        return NULL;
+    }
     return ret;
 }
 
@@ -286,8 +437,8 @@ void del_upromise_agen(upromise_agen_t *agen)
 {
     if (!upromise_ref_count_dec(&agen->rc))
         return;
-    clear_upromise_task_queue(&agen->next_queue);
-    free(agen);
+    clear_upromise_task_queue(agen->dispatcher, &agen->next_queue);
+    upromise_pool_free(&agen->dispatcher->pool, agen, sizeof(upromise_agen_t));
 }
 
 typedef struct agen_next_then_context
@@ -306,18 +457,20 @@ void agen_schedule(agen_next_then_context *ctx)
     agen->need_throw = ctx->need_throw;
     if (agen->need_done || agen->need_throw)
         agen->set_data = ctx->over_value;
-    free(ctx);
-    upromise_task_t *task = malloc(sizeof(upromise_task_t));
-    task->co = agen->co;
-    task->extra = NULL;
-    upromise_task_queue_push_immediately(&agen->dispatcher->queue, task);
+    upromise_pool_free(&agen->dispatcher->pool, ctx, sizeof(agen_next_then_context));
+    upromise_run_queue_push_immediately(&agen->dispatcher->lanes[agen->dispatcher->priority], NULL, agen->co, NULL);
+    del_upromise_agen(agen);
 }
 
 void *agen_next_wait_prev(void *data, void **error, void *ctx_raw)
 {
     agen_next_then_context *ctx = (agen_next_then_context *)ctx_raw;
-    if (ctx->agen->done)
-        free(ctx);
+    upromise_agen_t *agen = ctx->agen;
+    if (agen->done)
+    {
+        upromise_pool_free(&agen->dispatcher->pool, ctx, sizeof(agen_next_then_context));
+        del_upromise_agen(agen);
+    }
     else
         agen_schedule(ctx);
     return NULL;
@@ -329,6 +482,10 @@ void agen_next_promise_fn(upromise_promise_t *promise, void *ctx_raw)
     if (ctx->prev != NULL)
     {
         upromise_promise_t *temp = upromise_promise_then(ctx->prev, ctx, agen_next_wait_prev, agen_next_wait_prev);
+        // next() calls resume the body strictly in order, one that cannot
+        // wait for the one before has no place to go
+        if (temp == NULL)
+            abort();
         del_upromise_promise(temp);
         del_upromise_promise(ctx->prev);
     }
@@ -340,27 +497,60 @@ upromise_promise_t *upromise_agen_next_impl(upromise_agen_t *agen, void *value,
 {
     if (agen->done)
     {
+        upromise_promise_t *ret = new_upromise_promise(agen->dispatcher, agen_promise_fn, NULL);
+        if (ret == NULL)
+            return NULL;
         upromise_agen_result_t *result = malloc(sizeof(upromise_agen_result_t));
+        if (result == NULL)
+        {
+            reject_upromise_promise(ret, upromise_nomem_error);
+            return ret;
+        }
         result->done = 1;
         result->data = NULL;
-        upromise_promise_t *ret = new_upromise_promise(agen->dispatcher, agen_promise_fn, NULL);
         resolve_upromise_promise(ret, result);
         return ret;
     }
-    agen_next_then_context *ctx = malloc(sizeof(agen_next_then_context));
+    if (agen->cancelled != NULL)
+    {
+        upromise_promise_t *ret = new_upromise_promise(agen->dispatcher, agen_promise_fn, NULL);
+        if (ret != NULL)
+            reject_upromise_promise(ret, agen->cancelled);
+        return ret;
+    }
+    // the queue node comes first: once the promise exists the call can no
+    // longer be taken back
+    upromise_task_t *next_task = new_upromise_task(agen->dispatcher, NULL, (intptr_t)value, NULL);
+    agen_next_then_context *ctx = upromise_pool_alloc(&agen->dispatcher->pool, sizeof(agen_next_then_context));
+    if (next_task == NULL || ctx == NULL)
+    {
+        if (next_task != NULL)
+            del_upromise_task(agen->dispatcher, next_task);
+        if (ctx != NULL)
+            upromise_pool_free(&agen->dispatcher->pool, ctx, sizeof(agen_next_then_context));
+        return NULL;
+    }
     ctx->agen = agen;
+    upromise_ref_count_inc(&agen->rc); // for ctx hold
     ctx->over_value = over_value;
     ctx->need_done = need_done;
     ctx->need_throw = need_throw;
     ctx->prev = NULL;
-    if (agen->next_queue.head != agen->next_queue.tail)
+    if (agen->next_queue.tail != NULL)
     {
         ctx->prev = (upromise_promise_t *)agen->next_queue.tail->extra;
         upromise_ref_count_inc(&ctx->prev->rc);
     }
     upromise_promise_t *next_promise = new_upromise_promise(agen->dispatcher, agen_next_promise_fn, ctx);
-    upromise_task_t *next_task = malloc(sizeof(upromise_task_t));
-    next_task->co = (intptr_t)value;
+    if (next_promise == NULL)
+    {
+        if (ctx->prev != NULL)
+            del_upromise_promise(ctx->prev);
+        upromise_pool_free(&agen->dispatcher->pool, ctx, sizeof(agen_next_then_context));
+        del_upromise_task(agen->dispatcher, next_task);
+        del_upromise_agen(agen);
+        return NULL;
+    }
     next_task->extra = next_promise;
     upromise_task_queue_push(&agen->next_queue, next_task);
     return next_promise;
@@ -368,56 +558,126 @@ upromise_promise_t *upromise_agen_next_impl(upromise_agen_t *agen, void *value,
 
 upromise_promise_t *upromise_agen_next(upromise_agen_t *agen, void *value)
 {
-    upromise_agen_next_impl(agen, value, NULL, 0, 0);
+    return upromise_agen_next_impl(agen, value, NULL, 0, 0);
 }
 
 upromise_promise_t *upromise_agen_return(upromise_agen_t *agen, void *value)
 {
-    upromise_agen_next_impl(agen, NULL, value, 1, 0);
+    return upromise_agen_next_impl(agen, NULL, value, 1, 0);
 }
 
 upromise_promise_t *upromise_agen_throw(upromise_agen_t *agen, void *value)
 {
-    upromise_agen_next_impl(agen, NULL, value, 0, 1);
+    return upromise_agen_next_impl(agen, NULL, value, 0, 1);
 }
 
 void *ayield_then_resolve(void *data, void **error, void *ctx)
 {
     upromise_agen_t *agen = (upromise_agen_t *)ctx;
-    upromise_agen_result_t *ret = malloc(sizeof(upromise_agen_result_t));
-    ret->done = 0;
-    ret->data = data;
+    agen->yield_then = NULL;
     upromise_task_t *task = upromise_task_queue_pop(&agen->next_queue);
     upromise_promise_t *next_promise = (upromise_promise_t *)task->extra;
     agen->set_data = (void *)task->co;
-    resolve_upromise_promise(next_promise, ret);
+    del_upromise_task(agen->dispatcher, task);
+    upromise_agen_result_t *ret = malloc(sizeof(upromise_agen_result_t));
+    if (ret == NULL)
+        reject_upromise_promise(next_promise, upromise_nomem_error);
+    else
+    {
+        ret->done = 0;
+        ret->data = data;
+        resolve_upromise_promise(next_promise, ret);
+    }
+    del_upromise_promise(next_promise);
     return NULL;
 }
 
 void *ayield_then_reject(void *data, void **error, void *ctx)
 {
     upromise_agen_t *agen = (upromise_agen_t *)ctx;
+    agen->yield_then = NULL;
     upromise_task_t *task = upromise_task_queue_pop(&agen->next_queue);
     upromise_promise_t *next_promise = (upromise_promise_t *)task->extra;
-    free(task);
+    del_upromise_task(agen->dispatcher, task);
     agen->set_data = NULL;
     agen->need_done = true;
     reject_upromise_promise(next_promise, data);
+    del_upromise_promise(next_promise);
 
-    upromise_task_t *fin_task = malloc(sizeof(upromise_task_t));
-    fin_task->co = agen->co;
-    fin_task->extra = NULL;
-    upromise_task_queue_push_immediately(&agen->dispatcher->queue, fin_task);
+    upromise_run_queue_push_immediately(&agen->dispatcher->lanes[agen->dispatcher->priority], NULL, agen->co, NULL);
 
     return NULL;
 }
 
+// fail the next() the body is producing a value for
+static void agen_reject_front(upromise_agen_t *agen, void *reason)
+{
+    upromise_task_t *task = upromise_task_queue_pop(&agen->next_queue);
+    if (task == NULL)
+        return;
+    upromise_promise_t *next_promise = (upromise_promise_t *)task->extra;
+    del_upromise_task(agen->dispatcher, task);
+    reject_upromise_promise(next_promise, reason);
+    del_upromise_promise(next_promise);
+}
+
+static void agen_throw(upromise_agen_t *agen, void *reason)
+{
+    agen->need_throw = 1;
+    agen->set_data = reason;
+    upromise_run_queue_push_immediately(&agen->dispatcher->lanes[agen->dispatcher->priority], NULL, agen->co, NULL);
+}
+
+// A body waiting on its yielded promise drops that wait and takes the
+// throw now; one parked until the next next() takes it right away too.
+// Anywhere else it meets the reason at its next AYIELD.
+void agen_cancel_fn(void *extra, void *reason)
+{
+    upromise_agen_t *agen = (upromise_agen_t *)extra;
+    agen->cancelled = reason;
+    if (agen->done)
+        return;
+    if (agen->yield_then != NULL)
+    {
+        if (!upromise_promise_unthen(agen->yield_promise, agen->yield_then))
+            return;
+        agen->yield_then = NULL;
+        agen_reject_front(agen, reason);
+        agen_throw(agen, reason);
+    }
+    else if (agen->next_queue.head == NULL && !agen->need_done &&
+             coroutine_status(agen->dispatcher->sch, agen->co) == COROUTINE_SUSPEND)
+        agen_throw(agen, reason);
+}
+
+void upromise_agen_cancel_on(upromise_agen_t *agen, upromise_cancel_token_t *token)
+{
+    upromise_cancel_unlink(&agen->cancel);
+    if (!upromise_cancel_link(token, &agen->cancel, agen_cancel_fn, agen))
+        agen_cancel_fn(agen, token->reason);
+}
+
 upromise_ayield_result_t upromise_ayield(upromise_agen_t *agen, upromise_promise_t *data)
 {
-    upromise_promise_t *temp = upromise_promise_then(data, agen, ayield_then_resolve, ayield_then_reject);
-    del_upromise_promise(temp);
-    coroutine_yield(agen->dispatcher->sch);
     upromise_ayield_result_t ret;
+    upromise_promise_t *temp = NULL;
+    if (agen->cancelled == NULL)
+        temp = upromise_promise_then(data, agen, ayield_then_resolve, ayield_then_reject);
+    if (temp == NULL)
+    {
+        // cancelled, or out of memory: the body takes it as a throw
+        void *reason = agen->cancelled != NULL ? agen->cancelled : upromise_nomem_error;
+        agen_reject_front(agen, reason);
+        ret.need_done = 0;
+        ret.need_throw = 1;
+        ret.data = reason;
+        return ret;
+    }
+    agen->yield_promise = data;
+    agen->yield_then = temp;
+    coroutine_yield(agen->dispatcher->sch);
+    agen->yield_then = NULL;
+    del_upromise_promise(temp);
     ret.need_done = agen->need_done;
     agen->need_done = 0;
     ret.need_throw = agen->need_throw;
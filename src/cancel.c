@@ -0,0 +1,140 @@
+#include "upromise/upromise.h"
+#include <stdlib.h>
+#include <stdbool.h>
+
+upromise_promise_t *upromise_promise_settle_target(upromise_promise_t *promise);
+int upromise_promise_untie(upromise_promise_t *promise);
+
+void *upromise_cancel_error = "[promise error] cancelled";
+
+upromise_cancel_token_t *new_upromise_cancel_token(upromise_dispatcher_t *dispatcher)
+{
+    upromise_cancel_token_t *ret = upromise_pool_alloc(&dispatcher->pool, sizeof(upromise_cancel_token_t));
+    if (ret == NULL)
+        return NULL;
+    ret->rc = 0;
+    ret->dispatcher = dispatcher;
+    ret->cancelled = 0;
+    ret->reason = NULL;
+    ret->links = NULL;
+    upromise_ref_count_inc(&ret->rc); // for return hold
+    return ret;
+}
+
+void del_upromise_cancel_token(upromise_cancel_token_t *token)
+{
+    if (!upromise_ref_count_dec(&token->rc))
+        return;
+    // links hold a reference, so none is left here
+    upromise_pool_free(&token->dispatcher->pool, token, sizeof(upromise_cancel_token_t));
+}
+
+static void upromise_cancel_link_remove(upromise_cancel_link_t *link)
+{
+    *link->pprev = link->next;
+    if (link->next != NULL)
+        link->next->pprev = link->pprev;
+    link->next = NULL;
+    link->pprev = NULL;
+}
+
+int upromise_cancel_link(upromise_cancel_token_t *token, upromise_cancel_link_t *link, upromise_cancel_fn fn, void *extra)
+{
+    link->next = NULL;
+    link->pprev = NULL;
+    link->token = token;
+    link->fn = fn;
+    link->extra = extra;
+    if (token->cancelled)
+        return 0;
+    link->next = token->links;
+    link->pprev = &token->links;
+    if (token->links != NULL)
+        token->links->pprev = &link->next;
+    token->links = link;
+    upromise_ref_count_inc(&token->rc); // for link hold
+    return 1;
+}
+
+int upromise_cancel_unlink(upromise_cancel_link_t *link)
+{
+    if (link->pprev == NULL)
+        return 0;
+    upromise_cancel_link_remove(link);
+    del_upromise_cancel_token(link->token);
+    return 1;
+}
+
+void upromise_cancel(upromise_cancel_token_t *token, void *reason)
+{
+    if (token->cancelled)
+        return;
+    token->cancelled = 1;
+    token->reason = reason != NULL ? reason : upromise_cancel_error;
+    // callbacks may unlink other links or drop the caller's last hold
+    upromise_ref_count_inc(&token->rc);
+    while (token->links != NULL)
+    {
+        upromise_cancel_link_t *link = token->links;
+        upromise_cancel_link_remove(link);
+        link->fn(link->extra, token->reason);
+        del_upromise_cancel_token(token); // the link's hold
+    }
+    del_upromise_cancel_token(token);
+}
+
+// promise
+// The context is both a token link and a waiter on the promise. The waiter
+// runs once the promise settles, whichever way, and releases the context.
+typedef struct promise_cancel_context
+{
+    upromise_task_t task;
+    upromise_cancel_link_t link;
+    upromise_promise_t *promise;
+} promise_cancel_context;
+
+static void promise_cancel_fn(void *extra, void *reason)
+{
+    promise_cancel_context *ctx = (promise_cancel_context *)extra;
+    // a promise from then() may wait on a source that never settles
+    upromise_promise_untie(ctx->promise);
+    reject_upromise_promise(ctx->promise, reason);
+}
+
+static void promise_cancel_task_fn(void *extra)
+{
+    promise_cancel_context *ctx = (promise_cancel_context *)extra;
+    upromise_promise_t *promise = ctx->promise;
+    upromise_cancel_unlink(&ctx->link);
+    upromise_pool_free(&promise->dispatcher->pool, ctx, sizeof(promise_cancel_context));
+    del_upromise_promise(promise);
+}
+
+void upromise_promise_cancel_on(upromise_promise_t *promise, upromise_cancel_token_t *token)
+{
+    upromise_promise_t *target = upromise_promise_settle_target(promise);
+    if (target == NULL)
+        return;
+    if (token->cancelled)
+    {
+        upromise_promise_untie(promise);
+        reject_upromise_promise(promise, token->reason);
+        return;
+    }
+    promise_cancel_context *ctx = upromise_pool_alloc(&promise->dispatcher->pool, sizeof(promise_cancel_context));
+    if (ctx == NULL)
+    {
+        // a promise that cannot be watched is failed rather than left
+        // running where the cancel would never reach it
+        upromise_promise_untie(promise);
+        reject_upromise_promise(promise, upromise_nomem_error);
+        return;
+    }
+    ctx->promise = promise;
+    upromise_ref_count_inc(&promise->rc); // for waiter hold
+    ctx->task.fn = promise_cancel_task_fn;
+    ctx->task.co = -1;
+    ctx->task.extra = ctx;
+    upromise_task_queue_push(&target->queue, &ctx->task);
+    upromise_cancel_link(token, &ctx->link, promise_cancel_fn, ctx);
+}
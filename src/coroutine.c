@@ -5,65 +5,374 @@
 #include <stddef.h>
 #include <string.h>
 #include <stdint.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
+#if defined(UPROMISE_ASM_CONTEXT) && defined(__ELF__) && (defined(__x86_64__) || defined(__aarch64__))
+	#define USE_ASM_CONTEXT 1
+#endif
+
+#ifndef USE_ASM_CONTEXT
 #if __APPLE__ && __MACH__
 	#include <sys/ucontext.h>
 #else 
 	#include <ucontext.h>
 #endif 
+#endif
+
+// Shared-stack frames are copied byte for byte, redzones included, so the
+// copy must not be checked by AddressSanitizer, nor by the object-size
+// check of the UndefinedBehaviorSanitizer built along; the shared stack is
+// unpoisoned before a frame is put back so it does not inherit the shadow
+// of the coroutine that ran there last.
+// Switches are announced as fiber switches, so exceptions unwinding a
+// coroutine clear the shadow of the right stack.
+#if defined(__SANITIZE_ADDRESS__)
+	#include <sanitizer/asan_interface.h>
+	#include <sanitizer/common_interface_defs.h>
+	#define NO_SANITIZE __attribute__((no_sanitize("address", "undefined")))
+	#define ASAN_START_SWITCH(fake, bottom, size) __sanitizer_start_switch_fiber(fake, bottom, size)
+	#define ASAN_FINISH_SWITCH(fake, bottom, size) __sanitizer_finish_switch_fiber(fake, bottom, size)
+#else
+	#define NO_SANITIZE
+	#define ASAN_START_SWITCH(fake, bottom, size) ((void)0)
+	#define ASAN_FINISH_SWITCH(fake, bottom, size) ((void)0)
+#endif
+
+// ThreadSanitizer keeps a call stack per fiber: every coroutine runs on its
+// own, so it may be resumed on another thread than the one it yielded on.
+#if defined(__SANITIZE_THREAD__)
+	#include <sanitizer/tsan_interface.h>
+	#define TSAN_SWITCH(fiber) __tsan_switch_to_fiber(fiber, 0)
+#else
+	#define TSAN_SWITCH(fiber) ((void)0)
+#endif
 
 #define STACK_SIZE (1024*1024)
-#define DEFAULT_COROUTINE 16
+#define DEDICATED_STACK_SIZE (256*1024)
+// ids are (generation << SLOT_BITS) | slot, so an id kept after its
+// coroutine died no longer matches once the slot is reused; with a 64-bit
+// intptr_t the generation takes 32 bits and a slot is good for 2^32 reuses
+#define SLOT_BITS 22
+#define SLOT_MASK ((1 << SLOT_BITS) - 1)
+#if INTPTR_MAX > INT32_MAX
+#define GEN_MASK 0xffffffffu
+#else
+#define GEN_MASK 0x1ffu
+#endif
+#define CHUNK_BITS 10
+#define CHUNK_SIZE (1 << CHUNK_BITS)
+#define STACK_CACHE 64
+// saved-stack buffers up to this size stay with a dead coroutine for reuse
+#define SAVED_STACK_KEEP (16*1024)
+
+#ifdef USE_ASM_CONTEXT
+
+// Register-only context switch. Unlike swapcontext it never touches the
+// signal mask, so a switch costs a handful of moves instead of a syscall.
+// Callee-saved registers, sp and pc are kept in the context struct rather
+// than pushed on the stack, which keeps the shared-stack copy in
+// _save_stack valid.
+//
+// x86-64:  rbx rbp r12 r13 r14 r15 sp pc mxcsr/fpucw arg
+// aarch64: x19-x28 x29 x30 sp d8-d15 arg
+typedef struct coctx {
+	void *regs[22];
+} coctx_t;
+
+#if defined(__x86_64__)
+#define COCTX_SP 6
+#define COCTX_PC 7
+#define COCTX_ARG 9
+#else
+#define COCTX_SP 12
+#define COCTX_PC 11
+#define COCTX_ARG 21
+#endif
+
+__attribute__((visibility("hidden"))) void upromise_coctx_swap(coctx_t *from, coctx_t *to);
+
+#if defined(__x86_64__)
+__asm__(
+	".text\n"
+	".globl upromise_coctx_swap\n"
+	".hidden upromise_coctx_swap\n"
+	".type upromise_coctx_swap,@function\n"
+	".align 16\n"
+	"upromise_coctx_swap:\n"
+	"	movq (%rsp), %rax\n"
+	"	leaq 8(%rsp), %rcx\n"
+	"	movq %rbx, 0(%rdi)\n"
+	"	movq %rbp, 8(%rdi)\n"
+	"	movq %r12, 16(%rdi)\n"
+	"	movq %r13, 24(%rdi)\n"
+	"	movq %r14, 32(%rdi)\n"
+	"	movq %r15, 40(%rdi)\n"
+	"	movq %rcx, 48(%rdi)\n"
+	"	movq %rax, 56(%rdi)\n"
+	"	stmxcsr 64(%rdi)\n"
+	"	fnstcw 68(%rdi)\n"
+	"	movq 0(%rsi), %rbx\n"
+	"	movq 8(%rsi), %rbp\n"
+	"	movq 16(%rsi), %r12\n"
+	"	movq 24(%rsi), %r13\n"
+	"	movq 32(%rsi), %r14\n"
+	"	movq 40(%rsi), %r15\n"
+	"	movq 48(%rsi), %rsp\n"
+	"	ldmxcsr 64(%rsi)\n"
+	"	fldcw 68(%rsi)\n"
+	"	movq 72(%rsi), %rdi\n"
+	"	jmpq *56(%rsi)\n"
+	".size upromise_coctx_swap,.-upromise_coctx_swap\n"
+);
+#else
+__asm__(
+	".text\n"
+	".globl upromise_coctx_swap\n"
+	".hidden upromise_coctx_swap\n"
+	".type upromise_coctx_swap,%function\n"
+	".align 4\n"
+	"upromise_coctx_swap:\n"
+	"	mov x9, sp\n"
+	"	stp x19, x20, [x0, #0]\n"
+	"	stp x21, x22, [x0, #16]\n"
+	"	stp x23, x24, [x0, #32]\n"
+	"	stp x25, x26, [x0, #48]\n"
+	"	stp x27, x28, [x0, #64]\n"
+	"	stp x29, x30, [x0, #80]\n"
+	"	str x9, [x0, #96]\n"
+	"	stp d8, d9, [x0, #104]\n"
+	"	stp d10, d11, [x0, #120]\n"
+	"	stp d12, d13, [x0, #136]\n"
+	"	stp d14, d15, [x0, #152]\n"
+	"	ldp x19, x20, [x1, #0]\n"
+	"	ldp x21, x22, [x1, #16]\n"
+	"	ldp x23, x24, [x1, #32]\n"
+	"	ldp x25, x26, [x1, #48]\n"
+	"	ldp x27, x28, [x1, #64]\n"
+	"	ldp x29, x30, [x1, #80]\n"
+	"	ldr x9, [x1, #96]\n"
+	"	mov sp, x9\n"
+	"	ldp d8, d9, [x1, #104]\n"
+	"	ldp d10, d11, [x1, #120]\n"
+	"	ldp d12, d13, [x1, #136]\n"
+	"	ldp d14, d15, [x1, #152]\n"
+	"	ldr x0, [x1, #168]\n"
+	"	ret\n"
+	".size upromise_coctx_swap,.-upromise_coctx_swap\n"
+);
+#endif
+
+#endif
 
 struct coroutine;
 
+struct slot {
+	struct coroutine *co;
+	uint32_t gen;
+	int next_free;
+};
+
 struct schedule {
-	char stack[STACK_SIZE];
+	int mode;
+	char *stack;
+	size_t stack_size;
+	size_t page;
+	char *retired;
+	int ncache;
+	char *cache[STACK_CACHE];
+#ifdef USE_ASM_CONTEXT
+	coctx_t main;
+	coctx_t dead;
+#else
 	ucontext_t main;
+#endif
 	int nco;
 	int cap;
-	int running;
-	struct coroutine **co;
+	intptr_t running;
+	int free_slot;
+	int nchunk;
+	struct slot **chunks;
+	struct coroutine *free_co;
+	intptr_t transfer; // resumed from main once the running coroutine yields
+#if defined(__SANITIZE_ADDRESS__)
+	void *asan_fake;
+	const void *asan_main_bottom;
+	size_t asan_main_size;
+	int asan_transfer;
+#endif
+#if defined(__SANITIZE_THREAD__)
+	void *tsan_main;
+	void *tsan_retired;
+#endif
 };
 
 struct coroutine {
 	coroutine_func func;
 	void *ud;
+#ifdef USE_ASM_CONTEXT
+	coctx_t ctx;
+#else
 	ucontext_t ctx;
+#endif
 	struct schedule * sch;
 	ptrdiff_t cap;
 	ptrdiff_t size;
 	int status;
 	char *stack;
+	struct coroutine *next;
+#if defined(__SANITIZE_ADDRESS__)
+	// not on the coroutine stack: a shared stack is restored from the copy
+	// taken before the switch
+	void *asan_fake;
+#endif
+#if defined(__SANITIZE_THREAD__)
+	void *tsan_fiber;
+#endif
 };
 
+// A coroutine entered by coroutine_transfer comes from another coroutine's
+// stack, the main stack bounds it knows stay valid.
+#if defined(__SANITIZE_ADDRESS__)
+static void
+_asan_enter(struct schedule *S, void *fake) {
+	if (S->asan_transfer) {
+		S->asan_transfer = 0;
+		__sanitizer_finish_switch_fiber(fake, NULL, NULL);
+	} else {
+		__sanitizer_finish_switch_fiber(fake, &S->asan_main_bottom, &S->asan_main_size);
+	}
+}
+	#define ASAN_ENTER(S, fake) _asan_enter(S, fake)
+#else
+	#define ASAN_ENTER(S, fake) ((void)0)
+#endif
+
+// dead coroutines are kept on a free list together with a small saved-stack
+// buffer and released in bulk by coroutine_close
 struct coroutine * 
 _co_new(struct schedule *S , coroutine_func func, void *ud) {
-	struct coroutine * co = malloc(sizeof(*co));
+	struct coroutine * co = S->free_co;
+	if (co) {
+		S->free_co = co->next;
+	} else {
+		co = malloc(sizeof(*co));
+		if (co == NULL)
+			return NULL;
+		co->cap = 0;
+		co->stack = NULL;
+	}
 	co->func = func;
 	co->ud = ud;
 	co->sch = S;
-	co->cap = 0;
 	co->size = 0;
 	co->status = COROUTINE_READY;
-	co->stack = NULL;
+	co->next = NULL;
+#if defined(__SANITIZE_THREAD__)
+	co->tsan_fiber = __tsan_create_fiber(0);
+#endif
 	return co;
 }
 
+// dedicated stacks: [guard page][stack_size bytes], the guard page is PROT_NONE
+static char *
+_stack_alloc(struct schedule *S) {
+	if (S->ncache > 0)
+		return S->cache[--S->ncache];
+	size_t len = S->page + S->stack_size;
+	char *base = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED)
+		return NULL;
+	if (mprotect(base, S->page, PROT_NONE) != 0) {
+		// without the guard an overflow would run into the next mapping
+		munmap(base, len);
+		return NULL;
+	}
+	return base;
+}
+
+static void
+_stack_free(struct schedule *S, char *base) {
+	if (S->ncache < STACK_CACHE)
+		S->cache[S->ncache++] = base;
+	else
+		munmap(base, S->page + S->stack_size);
+}
+
 void
 _co_delete(struct coroutine *co) {
-	free(co->stack);
+	struct schedule *S = co->sch;
+	if (S->mode == COROUTINE_STACK_DEDICATED) {
+		if (co->stack)
+			_stack_free(S, co->stack);
+		co->stack = NULL;
+		co->cap = 0;
+	} else if (co->cap > SAVED_STACK_KEEP) {
+		// a deep frame copy is not kept around for the life of the schedule
+		free(co->stack);
+		co->stack = NULL;
+		co->cap = 0;
+	}
+	co->next = S->free_co;
+	S->free_co = co;
+}
+
+static void
+_co_destroy(struct coroutine *co) {
+#if defined(__SANITIZE_THREAD__)
+	if (co->tsan_fiber)
+		__tsan_destroy_fiber(co->tsan_fiber);
+#endif
+	if (co->sch->mode == COROUTINE_STACK_DEDICATED) {
+		if (co->stack)
+			munmap(co->stack, co->sch->page + co->sch->stack_size);
+	} else {
+		free(co->stack);
+	}
 	free(co);
 }
 
 struct schedule * 
 coroutine_open(void) {
+	return coroutine_open_ex(COROUTINE_STACK_SHARED, 0);
+}
+
+struct schedule * 
+coroutine_open_ex(int mode, size_t stack_size) {
 	struct schedule *S = malloc(sizeof(*S));
+	if (S == NULL)
+		return NULL;
+	S->mode = mode;
+	S->page = (size_t)sysconf(_SC_PAGESIZE);
+	S->retired = NULL;
+	S->ncache = 0;
+	S->transfer = -1;
+#if defined(__SANITIZE_ADDRESS__)
+	S->asan_transfer = 0;
+#endif
+#if defined(__SANITIZE_THREAD__)
+	S->tsan_retired = NULL;
+#endif
+	if (mode == COROUTINE_STACK_DEDICATED) {
+		if (stack_size == 0)
+			stack_size = DEDICATED_STACK_SIZE;
+		S->stack_size = (stack_size + S->page - 1) / S->page * S->page;
+		S->stack = NULL;
+	} else {
+		S->stack_size = STACK_SIZE;
+		S->stack = malloc(STACK_SIZE);
+		if (S->stack == NULL) {
+			free(S);
+			return NULL;
+		}
+	}
 	S->nco = 0;
-	S->cap = DEFAULT_COROUTINE;
+	S->cap = 0;
 	S->running = -1;
-	S->co = malloc(sizeof(struct coroutine *) * S->cap);
-	memset(S->co, 0, sizeof(struct coroutine *) * S->cap);
+	S->free_slot = -1;
+	S->nchunk = 0;
+	S->chunks = NULL;
+	S->free_co = NULL;
 	return S;
 }
 
@@ -71,87 +380,271 @@ void
 coroutine_close(struct schedule *S) {
 	int i;
 	for (i=0;i<S->cap;i++) {
-		struct coroutine * co = S->co[i];
+		struct coroutine * co = S->chunks[i >> CHUNK_BITS][i & (CHUNK_SIZE - 1)].co;
 		if (co) {
-			_co_delete(co);
+			_co_destroy(co);
 		}
 	}
-	free(S->co);
-	S->co = NULL;
+	while (S->free_co) {
+		struct coroutine * co = S->free_co;
+		S->free_co = co->next;
+		_co_destroy(co);
+	}
+	for (i=0;i<S->nchunk;i++) {
+		free(S->chunks[i]);
+	}
+	free(S->chunks);
+	S->chunks = NULL;
+	for (i=0;i<S->ncache;i++) {
+		munmap(S->cache[i], S->page + S->stack_size);
+	}
+	free(S->stack);
 	free(S);
 }
 
-int 
-coroutine_new(struct schedule *S, coroutine_func func, void *ud) {
-	struct coroutine *co = _co_new(S, func , ud);
-	if (S->nco >= S->cap) {
-		int id = S->cap;
-		S->co = realloc(S->co, S->cap * 2 * sizeof(struct coroutine *));
-		memset(S->co + S->cap , 0 , sizeof(struct coroutine *) * S->cap);
-		S->co[S->cap] = co;
-		S->cap *= 2;
-		++S->nco;
-		return id;
-	} else {
+static inline struct slot *
+_slot_at(struct schedule *S, int index) {
+	return &S->chunks[index >> CHUNK_BITS][index & (CHUNK_SIZE - 1)];
+}
+
+// resolve an id to its live coroutine, NULL for dead or stale ids
+static inline struct coroutine *
+_co_get(struct schedule *S, intptr_t id) {
+	assert(id >= 0);
+	int index = id & SLOT_MASK;
+	if (index >= S->cap)
+		return NULL;
+	struct slot *slot = _slot_at(S, index);
+	if (slot->gen != (uintptr_t)id >> SLOT_BITS)
+		return NULL;
+	return slot->co;
+}
+
+// slots are recycled through a free list and grown one chunk at a time, so
+// neither allocation nor release ever scans or copies the table
+static int
+_slot_alloc(struct schedule *S) {
+	if (S->free_slot < 0) {
+		if (S->cap + CHUNK_SIZE > SLOT_MASK + 1)
+			return -1;
+		struct slot **chunks = realloc(S->chunks, (S->nchunk + 1) * sizeof(struct slot *));
+		if (chunks == NULL)
+			return -1;
+		S->chunks = chunks;
+		struct slot *chunk = malloc(CHUNK_SIZE * sizeof(struct slot));
+		if (chunk == NULL)
+			return -1;
+		S->chunks[S->nchunk++] = chunk;
 		int i;
-		for (i=0;i<S->cap;i++) {
-			int id = (i+S->nco) % S->cap;
-			if (S->co[id] == NULL) {
-				S->co[id] = co;
-				++S->nco;
-				return id;
-			}
+		for (i=CHUNK_SIZE-1;i>=0;i--) {
+			chunk[i].co = NULL;
+			chunk[i].gen = 0;
+			chunk[i].next_free = S->free_slot;
+			S->free_slot = S->cap + i;
 		}
+		S->cap += CHUNK_SIZE;
 	}
-	assert(0);
-	return -1;
+	int index = S->free_slot;
+	S->free_slot = _slot_at(S, index)->next_free;
+	return index;
 }
 
 static void
-mainfunc(uint32_t low32, uint32_t hi32) {
-	uintptr_t ptr = (uintptr_t)low32 | ((uintptr_t)hi32 << 32);
-	struct schedule *S = (struct schedule *)ptr;
-	int id = S->running;
-	struct coroutine *C = S->co[id];
+_slot_release(struct schedule *S, intptr_t id) {
+	int index = id & SLOT_MASK;
+	struct slot *slot = _slot_at(S, index);
+	slot->co = NULL;
+	slot->gen = (slot->gen + 1) & GEN_MASK;
+	slot->next_free = S->free_slot;
+	S->free_slot = index;
+}
+
+intptr_t 
+coroutine_new(struct schedule *S, coroutine_func func, void *ud) {
+	struct coroutine *co = _co_new(S, func , ud);
+	if (co == NULL)
+		return -1;
+	if (S->mode == COROUTINE_STACK_DEDICATED) {
+		co->stack = _stack_alloc(S);
+		if (co->stack == NULL) {
+			_co_delete(co);
+			return -1;
+		}
+		co->cap = S->page + S->stack_size;
+	}
+	int index = _slot_alloc(S);
+	if (index < 0) {
+		_co_delete(co);
+		return -1;
+	}
+	struct slot *slot = _slot_at(S, index);
+	slot->co = co;
+	++S->nco;
+	return (intptr_t)((uintptr_t)slot->gen << SLOT_BITS | index);
+}
+
+static NO_SANITIZE void
+_stack_copy(char *dst, const char *src, ptrdiff_t size) {
+#if defined(__SANITIZE_ADDRESS__)
+	// memcpy itself is intercepted, and a plain loop would be turned
+	// back into a call to it
+	volatile char *to = dst;
+	ptrdiff_t i;
+	for (i = 0; i < size; i++)
+		to[i] = src[i];
+#else
+	memcpy(dst, src, size);
+#endif
+}
+
+// returns the schedule the coroutine ended on, it may have been attached
+// to another one while suspended
+static struct schedule *
+_co_finish(struct coroutine *C) {
+	struct schedule *S = C->sch;
+	ASAN_ENTER(S, NULL);
 	C->func(S,C->ud);
+	S = C->sch;
+	intptr_t id = S->running;
+	if (S->mode == COROUTINE_STACK_DEDICATED) {
+		// still running on this stack, release it after switching out
+		S->retired = C->stack;
+		C->stack = NULL;
+	}
 	_co_delete(C);
-	S->co[id] = NULL;
+	_slot_release(S, id);
 	--S->nco;
 	S->running = -1;
+#if defined(__SANITIZE_ADDRESS__)
+	void *fake;
+	ASAN_START_SWITCH(&fake, S->asan_main_bottom, S->asan_main_size);
+#endif
+#if defined(__SANITIZE_THREAD__)
+	// still running on this fiber, destroyed after switching out
+	S->tsan_retired = C->tsan_fiber;
+	C->tsan_fiber = NULL;
+#endif
+	return S;
 }
 
-void 
-coroutine_resume(struct schedule * S, int id) {
-	assert(S->running == -1);
-	assert(id >=0 && id < S->cap);
-	struct coroutine *C = S->co[id];
-	if (C == NULL)
-		return;
+#ifdef USE_ASM_CONTEXT
+
+static void
+mainfunc(struct coroutine *C) {
+	struct schedule *S = _co_finish(C);
+	TSAN_SWITCH(S->tsan_main);
+	upromise_coctx_swap(&S->dead, &S->main);
+	abort();
+}
+
+static void
+_ctx_make(coctx_t *ctx, char *stack, size_t size, struct coroutine *C) {
+	uintptr_t top = ((uintptr_t)(stack + size)) & ~(uintptr_t)15;
+	memset(ctx, 0, sizeof(*ctx));
+#if defined(__x86_64__)
+	// enter as if called: the slot at sp holds a (null) return address
+	top -= sizeof(void *);
+	*(void **)top = NULL;
+	uint32_t csr[2] = {0, 0};
+	__asm__ volatile("stmxcsr %0\n\tfnstcw %1" : "=m"(csr[0]), "=m"(csr[1]));
+	memcpy(&ctx->regs[8], csr, sizeof(void *));
+#endif
+	ctx->regs[COCTX_SP] = (void *)top;
+	ctx->regs[COCTX_PC] = (void *)mainfunc;
+	ctx->regs[COCTX_ARG] = C;
+}
+
+#else
+
+static void
+mainfunc(uint32_t low32, uint32_t hi32) {
+	uintptr_t ptr = (uintptr_t)low32 | ((uintptr_t)hi32 << 32);
+	struct schedule *S = _co_finish((struct coroutine *)ptr);
+	TSAN_SWITCH(S->tsan_main);
+	setcontext(&S->main);
+}
+
+#endif
+
+#ifdef USE_ASM_CONTEXT
+typedef coctx_t cocontext_t;
+#else
+typedef ucontext_t cocontext_t;
+#endif
+
+// switch from `from` into C, starting it on `stack` if it never ran
+static void
+_co_switch(struct schedule *S, intptr_t id, struct coroutine *C, char *stack, cocontext_t *from) {
 	int status = C->status;
+	S->running = id;
+	C->status = COROUTINE_RUNNING;
+	TSAN_SWITCH(C->tsan_fiber);
 	switch(status) {
 	case COROUTINE_READY:
+#ifdef USE_ASM_CONTEXT
+		_ctx_make(&C->ctx, stack, S->stack_size, C);
+		upromise_coctx_swap(from, &C->ctx);
+#else
 		getcontext(&C->ctx);
-		C->ctx.uc_stack.ss_sp = S->stack;
-		C->ctx.uc_stack.ss_size = STACK_SIZE;
+		C->ctx.uc_stack.ss_sp = stack;
+		C->ctx.uc_stack.ss_size = S->stack_size;
 		C->ctx.uc_link = &S->main;
-		S->running = id;
-		C->status = COROUTINE_RUNNING;
-		uintptr_t ptr = (uintptr_t)S;
+		uintptr_t ptr = (uintptr_t)C;
 		makecontext(&C->ctx, (void (*)(void)) mainfunc, 2, (uint32_t)ptr, (uint32_t)(ptr>>32));
-		swapcontext(&S->main, &C->ctx);
+		swapcontext(from, &C->ctx);
+#endif
 		break;
 	case COROUTINE_SUSPEND:
-		memcpy(S->stack + STACK_SIZE - C->size, C->stack, C->size);
-		S->running = id;
-		C->status = COROUTINE_RUNNING;
-		swapcontext(&S->main, &C->ctx);
+#ifdef USE_ASM_CONTEXT
+		upromise_coctx_swap(from, &C->ctx);
+#else
+		swapcontext(from, &C->ctx);
+#endif
 		break;
 	default:
 		assert(0);
 	}
 }
 
-static void
+void 
+coroutine_resume(struct schedule * S, intptr_t id) {
+	assert(S->running == -1);
+#if defined(__SANITIZE_THREAD__)
+	S->tsan_main = __tsan_get_current_fiber();
+#endif
+	// a transfer requested by a shared-stack coroutine is carried out here,
+	// in a loop so chained handoffs do not grow the main stack
+	do {
+		struct coroutine *C = _co_get(S, id);
+		if (C == NULL)
+			return;
+		char *stack = S->mode == COROUTINE_STACK_DEDICATED ? C->stack + S->page : S->stack;
+		ASAN_START_SWITCH(&S->asan_fake, stack, S->stack_size);
+		if (S->mode != COROUTINE_STACK_DEDICATED) {
+#if defined(__SANITIZE_ADDRESS__)
+			ASAN_UNPOISON_MEMORY_REGION(S->stack, STACK_SIZE);
+#endif
+			if (C->status == COROUTINE_SUSPEND)
+				_stack_copy(S->stack + STACK_SIZE - C->size, C->stack, C->size);
+		}
+		_co_switch(S, id, C, stack, &S->main);
+		ASAN_FINISH_SWITCH(S->asan_fake, NULL, NULL);
+		if (S->retired) {
+			_stack_free(S, S->retired);
+			S->retired = NULL;
+		}
+#if defined(__SANITIZE_THREAD__)
+		if (S->tsan_retired) {
+			__tsan_destroy_fiber(S->tsan_retired);
+			S->tsan_retired = NULL;
+		}
+#endif
+		id = S->transfer;
+		S->transfer = -1;
+	} while (id >= 0);
+}
+
+static NO_SANITIZE void
 _save_stack(struct coroutine *C, char *top) {
 	char dummy = 0;
 	assert(top - &dummy <= STACK_SIZE);
@@ -161,32 +654,103 @@ _save_stack(struct coroutine *C, char *top) {
 		C->stack = malloc(C->cap);
 	}
 	C->size = top - &dummy;
-	memcpy(C->stack, &dummy, C->size);
+	_stack_copy(C->stack, &dummy, C->size);
 }
 
 void
 coroutine_yield(struct schedule * S) {
-	int id = S->running;
+	intptr_t id = S->running;
 	assert(id >= 0);
-	struct coroutine * C = S->co[id];
-	assert((char *)&C > S->stack);
-	_save_stack(C,S->stack + STACK_SIZE);
+	struct coroutine * C = _co_get(S, id);
+	if (S->mode != COROUTINE_STACK_DEDICATED) {
+		assert((char *)&C > S->stack);
+		_save_stack(C,S->stack + STACK_SIZE);
+	}
 	C->status = COROUTINE_SUSPEND;
 	S->running = -1;
+	ASAN_START_SWITCH(&C->asan_fake, S->asan_main_bottom, S->asan_main_size);
+	TSAN_SWITCH(S->tsan_main);
+#ifdef USE_ASM_CONTEXT
+	upromise_coctx_swap(&C->ctx , &S->main);
+#else
 	swapcontext(&C->ctx , &S->main);
+#endif
+	// resumed by whichever schedule it was attached to meanwhile
+	S = C->sch;
+	ASAN_ENTER(S, C->asan_fake);
+}
+
+// Hand the running coroutine's turn to `id` without going through the
+// caller of coroutine_resume; the running one is left suspended and `id`
+// yields back to that caller as usual. A shared stack cannot be replaced
+// while it is in use, so there the switch happens from the main context
+// right after the yield, still without a round trip through its caller.
+void
+coroutine_transfer(struct schedule * S, intptr_t id) {
+	intptr_t from = S->running;
+	assert(from >= 0);
+	struct coroutine *T = _co_get(S, id);
+	if (T == NULL || id == from)
+		return;
+	if (S->mode != COROUTINE_STACK_DEDICATED) {
+		S->transfer = id;
+		coroutine_yield(S);
+		return;
+	}
+	struct coroutine *C = _co_get(S, from);
+	C->status = COROUTINE_SUSPEND;
+#if defined(__SANITIZE_ADDRESS__)
+	S->asan_transfer = 1;
+#endif
+	ASAN_START_SWITCH(&C->asan_fake, T->stack + S->page, S->stack_size);
+	_co_switch(S, id, T, T->stack + S->page, &C->ctx);
+	ASAN_ENTER(S, C->asan_fake);
 }
 
 int 
-coroutine_status(struct schedule * S, int id) {
-	assert(id>=0 && id < S->cap);
-	if (S->co[id] == NULL) {
+coroutine_status(struct schedule * S, intptr_t id) {
+	struct coroutine * C = _co_get(S, id);
+	if (C == NULL) {
 		return COROUTINE_DEAD;
 	}
-	return S->co[id]->status;
+	return C->status;
 }
 
-int 
+intptr_t 
 coroutine_running(struct schedule * S) {
 	return S->running;
 }
 
+
+size_t
+coroutine_stack_size(struct schedule * S) {
+	return S->mode == COROUTINE_STACK_DEDICATED ? S->stack_size : 0;
+}
+
+// A suspended coroutine with a dedicated stack owns everything it needs,
+// so it can be taken out of one schedule and resumed from another with
+// the same stack size, on any thread.
+struct coroutine *
+coroutine_detach(struct schedule * S, intptr_t id) {
+	struct coroutine *C = _co_get(S, id);
+	if (C == NULL || S->mode != COROUTINE_STACK_DEDICATED || C->status != COROUTINE_SUSPEND)
+		return NULL;
+	_slot_release(S, id);
+	--S->nco;
+	C->sch = NULL;
+	return C;
+}
+
+intptr_t
+coroutine_attach(struct schedule * S, struct coroutine *C) {
+	if (S->mode != COROUTINE_STACK_DEDICATED || C->cap != (ptrdiff_t)(S->page + S->stack_size))
+		return -1;
+	int index = _slot_alloc(S);
+	if (index < 0)
+		return -1;
+	struct slot *slot = _slot_at(S, index);
+	slot->co = C;
+	C->sch = S;
+	++S->nco;
+	return (intptr_t)((uintptr_t)slot->gen << SLOT_BITS | index);
+}
@@ -0,0 +1,535 @@
+#include "upromise/executor.h"
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <pthread.h>
+
+void upromise_dispatcher_park(upromise_dispatcher_t *dispatcher, int timeout_ms);
+int upromise_dispatcher_timeout(upromise_dispatcher_t *dispatcher);
+size_t upromise_reactor_waiting(upromise_dispatcher_t *dispatcher);
+upromise_promise_t *upromise_async_impl(upromise_dispatcher_t *dispatcher, upromise_cancel_token_t *token, upromise_task_fn wake, upromise_async_fn fn, void *ctx);
+
+typedef struct upromise_job_t
+{
+    struct upromise_job_t *next; // injector list only
+    upromise_job_fn fn;
+    void *extra;
+} upromise_job_t;
+
+// work-stealing deque
+// Chase-Lev deque with the C11 orderings of Le et al. The owner pushes and
+// takes at the bottom, thieves steal at the top. Arrays replaced on growth
+// may still be read by a thief, so they are kept until the executor dies.
+typedef struct ws_array
+{
+    int64_t size;
+    struct ws_array *retired;
+    _Atomic(upromise_job_t *) jobs[];
+} ws_array;
+
+typedef struct ws_deque
+{
+    _Atomic int64_t top;
+    _Atomic int64_t bottom;
+    _Atomic(ws_array *) array;
+} ws_deque;
+
+#define WS_DEQUE_INIT 64
+#define WS_ABORT ((upromise_job_t *)1)
+
+static ws_array *ws_array_new(int64_t size)
+{
+    ws_array *array = malloc(sizeof(ws_array) + size * sizeof(upromise_job_t *));
+    if (array == NULL)
+        return NULL;
+    array->size = size;
+    array->retired = NULL;
+    return array;
+}
+
+static bool ws_deque_init(ws_deque *deque)
+{
+    ws_array *array = ws_array_new(WS_DEQUE_INIT);
+    if (array == NULL)
+        return false;
+    atomic_init(&deque->top, 0);
+    atomic_init(&deque->bottom, 0);
+    atomic_init(&deque->array, array);
+    return true;
+}
+
+static void ws_deque_clear(ws_deque *deque)
+{
+    ws_array *array = atomic_load_explicit(&deque->array, memory_order_relaxed);
+    int64_t t = atomic_load_explicit(&deque->top, memory_order_relaxed);
+    int64_t b = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    for (; t < b; t++)
+        free(atomic_load_explicit(&array->jobs[t & (array->size - 1)], memory_order_relaxed));
+    while (array != NULL)
+    {
+        ws_array *next = array->retired;
+        free(array);
+        array = next;
+    }
+}
+
+// false when the deque is full and cannot grow, the job is not pushed
+static bool ws_deque_push(ws_deque *deque, upromise_job_t *job)
+{
+    int64_t b = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    int64_t t = atomic_load_explicit(&deque->top, memory_order_acquire);
+    ws_array *array = atomic_load_explicit(&deque->array, memory_order_relaxed);
+    if (b - t > array->size - 1)
+    {
+        ws_array *bigger = ws_array_new(array->size * 2);
+        if (bigger == NULL)
+            return false;
+        for (int64_t i = t; i < b; i++)
+            atomic_store_explicit(&bigger->jobs[i & (bigger->size - 1)],
+                                  atomic_load_explicit(&array->jobs[i & (array->size - 1)], memory_order_relaxed),
+                                  memory_order_relaxed);
+        bigger->retired = array;
+        atomic_store_explicit(&deque->array, bigger, memory_order_release);
+        array = bigger;
+    }
+    atomic_store_explicit(&array->jobs[b & (array->size - 1)], job, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+    return true;
+}
+
+static upromise_job_t *ws_deque_take(ws_deque *deque)
+{
+    int64_t b = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    ws_array *array = atomic_load_explicit(&deque->array, memory_order_relaxed);
+    atomic_store_explicit(&deque->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t t = atomic_load_explicit(&deque->top, memory_order_relaxed);
+    upromise_job_t *job = NULL;
+    if (t <= b)
+    {
+        job = atomic_load_explicit(&array->jobs[b & (array->size - 1)], memory_order_relaxed);
+        if (t == b)
+        {
+            // last one, race the thieves for it
+            if (!atomic_compare_exchange_strong_explicit(&deque->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed))
+                job = NULL;
+            atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+        }
+    }
+    else
+        atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+    return job;
+}
+
+static upromise_job_t *ws_deque_steal(ws_deque *deque)
+{
+    int64_t t = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t b = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+    if (t >= b)
+        return NULL;
+    ws_array *array = atomic_load_explicit(&deque->array, memory_order_acquire);
+    upromise_job_t *job = atomic_load_explicit(&array->jobs[t & (array->size - 1)], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed))
+        return WS_ABORT;
+    return job;
+}
+
+// executor
+typedef struct upromise_worker_t
+{
+    upromise_executor_t *executor;
+    upromise_dispatcher_t *dispatcher;
+    ws_deque deque;
+    pthread_t thread;
+    size_t index;
+    atomic_bool parked; // set before the last look at `queued`
+    bool holding;       // counted in `pending` while timers or I/O are outstanding
+    size_t continued;   // continuations run since the last drain
+} upromise_worker_t;
+
+struct upromise_executor_t
+{
+    upromise_worker_t *workers;
+    size_t count;
+    // jobs posted from outside the pool
+    upromise_job_t *inject_head;
+    upromise_job_t *inject_tail;
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    atomic_size_t queued;  // posted, not picked up yet
+    atomic_size_t pending; // jobs and continuations not finished, plus busy workers
+    atomic_bool stop;
+    bool movable; // async bodies may move between the workers' dispatchers
+};
+
+typedef struct upromise_continuation_t
+{
+    upromise_executor_t *executor;
+    upromise_task_fn fn;
+    void *extra;
+} upromise_continuation_t;
+
+static _Thread_local upromise_worker_t *current_worker = NULL;
+
+static upromise_job_t *upromise_executor_inject_pop(upromise_executor_t *executor)
+{
+    pthread_mutex_lock(&executor->lock);
+    upromise_job_t *job = executor->inject_head;
+    if (job != NULL)
+    {
+        executor->inject_head = job->next;
+        if (executor->inject_head == NULL)
+            executor->inject_tail = NULL;
+    }
+    pthread_mutex_unlock(&executor->lock);
+    return job;
+}
+
+static upromise_job_t *upromise_worker_find(upromise_worker_t *worker)
+{
+    upromise_executor_t *executor = worker->executor;
+    upromise_job_t *job = ws_deque_take(&worker->deque);
+    if (job == NULL)
+        job = upromise_executor_inject_pop(executor);
+    while (job == NULL)
+    {
+        bool contended = false;
+        size_t i;
+        for (i = 1; i < executor->count && job == NULL; i++)
+        {
+            upromise_worker_t *victim = &executor->workers[(worker->index + i) % executor->count];
+            job = ws_deque_steal(&victim->deque);
+            if (job == WS_ABORT)
+            {
+                contended = true;
+                job = NULL;
+            }
+        }
+        if (!contended)
+            break;
+    }
+    if (job != NULL)
+        atomic_fetch_sub(&executor->queued, 1);
+    return job;
+}
+
+static void upromise_job_finish(upromise_executor_t *executor, size_t count)
+{
+    if (atomic_fetch_sub(&executor->pending, count) == count)
+    {
+        pthread_mutex_lock(&executor->lock);
+        pthread_cond_broadcast(&executor->done);
+        pthread_mutex_unlock(&executor->lock);
+    }
+}
+
+// a parked worker leaves upromise_dispatcher_park once its inbox has work
+static void upromise_worker_nudge(void *extra)
+{
+    (void)extra;
+}
+
+static void upromise_executor_wake_one(upromise_executor_t *executor)
+{
+    size_t i;
+    for (i = 0; i < executor->count; i++)
+    {
+        upromise_worker_t *worker = &executor->workers[i];
+        if (atomic_load(&worker->parked) && atomic_exchange(&worker->parked, false))
+        {
+            upromise_dispatcher_post(worker->dispatcher, upromise_worker_nudge, NULL);
+            return;
+        }
+    }
+}
+
+// Settle the books after the dispatcher ran dry. A worker with timers or
+// I/O outstanding holds one unit of `pending`, so upromise_executor_wait
+// also waits for the continuations those will run.
+static void upromise_worker_drained(upromise_worker_t *worker)
+{
+    upromise_executor_t *executor = worker->executor;
+    upromise_dispatcher_t *dispatcher = worker->dispatcher;
+    bool holding = dispatcher->timers.count != 0 || upromise_reactor_waiting(dispatcher) != 0;
+    if (holding && !worker->holding)
+        atomic_fetch_add(&executor->pending, 1);
+    size_t done = worker->continued + (!holding && worker->holding ? 1 : 0);
+    worker->holding = holding;
+    worker->continued = 0;
+    if (done != 0)
+        upromise_job_finish(executor, done);
+}
+
+static void *upromise_worker_main(void *arg)
+{
+    upromise_worker_t *worker = (upromise_worker_t *)arg;
+    upromise_executor_t *executor = worker->executor;
+    current_worker = worker;
+    while (true)
+    {
+        upromise_job_t *job = upromise_worker_find(worker);
+        if (job != NULL)
+        {
+            job->fn(worker->dispatcher, job->extra);
+            free(job);
+        }
+        upromise_dispatcher_run(worker->dispatcher);
+        upromise_worker_drained(worker);
+        if (job != NULL)
+        {
+            upromise_job_finish(executor, 1);
+            continue;
+        }
+        // idle: sleep on the dispatcher, which wakes for its timers, I/O
+        // and posts; upromise_executor_post nudges it through the inbox
+        atomic_store(&worker->parked, true);
+        if (!atomic_load(&executor->stop) && atomic_load(&executor->queued) == 0)
+            upromise_dispatcher_park(worker->dispatcher, upromise_dispatcher_timeout(worker->dispatcher));
+        atomic_store(&worker->parked, false);
+        if (atomic_load(&executor->stop))
+            break;
+    }
+    current_worker = NULL;
+    return NULL;
+}
+
+// stop and join the first `started` workers, then release what the first
+// `inited` deques and the executor hold
+static void upromise_executor_free(upromise_executor_t *executor, size_t inited, size_t started)
+{
+    atomic_store(&executor->stop, true);
+    size_t i;
+    for (i = 0; i < started; i++)
+        upromise_dispatcher_post(executor->workers[i].dispatcher, upromise_worker_nudge, NULL);
+    for (i = 0; i < started; i++)
+        pthread_join(executor->workers[i].thread, NULL);
+    for (i = 0; i < inited; i++)
+        ws_deque_clear(&executor->workers[i].deque);
+    while (executor->inject_head != NULL)
+    {
+        upromise_job_t *next = executor->inject_head->next;
+        free(executor->inject_head);
+        executor->inject_head = next;
+    }
+    pthread_cond_destroy(&executor->done);
+    pthread_mutex_destroy(&executor->lock);
+    free(executor->workers);
+    free(executor);
+}
+
+upromise_executor_t *new_upromise_executor(upromise_dispatcher_t **dispatchers, size_t count)
+{
+    upromise_executor_t *ret = malloc(sizeof(upromise_executor_t));
+    if (ret == NULL)
+        return NULL;
+    ret->workers = malloc(count * sizeof(upromise_worker_t));
+    if (ret->workers == NULL)
+    {
+        free(ret);
+        return NULL;
+    }
+    ret->count = count;
+    ret->inject_head = NULL;
+    ret->inject_tail = NULL;
+    pthread_mutex_init(&ret->lock, NULL);
+    pthread_cond_init(&ret->done, NULL);
+    atomic_init(&ret->queued, 0);
+    atomic_init(&ret->pending, 0);
+    atomic_init(&ret->stop, false);
+    // a body only moves between threads safely with atomic reference
+    // counts, and its stack must fit every dispatcher
+    ret->movable = false;
+#ifdef UPROMISE_ATOMIC_REFCOUNT
+    ret->movable = count != 0 && coroutine_stack_size(dispatchers[0]->sch) != 0;
+#endif
+    size_t i;
+    for (i = 0; i < count; i++)
+        if (coroutine_stack_size(dispatchers[i]->sch) != coroutine_stack_size(dispatchers[0]->sch))
+            ret->movable = false;
+    for (i = 0; i < count; i++)
+    {
+        upromise_worker_t *worker = &ret->workers[i];
+        worker->executor = ret;
+        worker->dispatcher = dispatchers[i];
+        worker->index = i;
+        atomic_init(&worker->parked, false);
+        worker->holding = false;
+        worker->continued = 0;
+        if (!ws_deque_init(&worker->deque))
+        {
+            upromise_executor_free(ret, i, 0);
+            return NULL;
+        }
+    }
+    for (i = 0; i < count; i++)
+        if (pthread_create(&ret->workers[i].thread, NULL, upromise_worker_main, &ret->workers[i]) != 0)
+        {
+            upromise_executor_free(ret, count, i);
+            return NULL;
+        }
+    return ret;
+}
+
+void del_upromise_executor(upromise_executor_t *executor)
+{
+    upromise_executor_free(executor, executor->count, executor->count);
+}
+
+void upromise_executor_post(upromise_executor_t *executor, upromise_job_fn fn, void *extra)
+{
+    upromise_job_t *job = malloc(sizeof(upromise_job_t));
+    // like upromise_dispatcher_post, a lost job would hang wait()
+    if (job == NULL)
+        abort();
+    job->next = NULL;
+    job->fn = fn;
+    job->extra = extra;
+    atomic_fetch_add(&executor->pending, 1);
+    atomic_fetch_add(&executor->queued, 1);
+    // a deque that cannot grow hands the job to the injection list
+    if (current_worker == NULL || current_worker->executor != executor || !ws_deque_push(&current_worker->deque, job))
+    {
+        pthread_mutex_lock(&executor->lock);
+        if (executor->inject_tail != NULL)
+            executor->inject_tail->next = job;
+        else
+            executor->inject_head = job;
+        executor->inject_tail = job;
+        pthread_mutex_unlock(&executor->lock);
+    }
+    // a worker about to park re-checks `queued` after raising `parked`
+    upromise_executor_wake_one(executor);
+}
+
+static void upromise_continuation_fn(void *ctx_raw)
+{
+    upromise_continuation_t *ctx = (upromise_continuation_t *)ctx_raw;
+    upromise_executor_t *executor = ctx->executor;
+    upromise_task_fn fn = ctx->fn;
+    void *extra = ctx->extra;
+    free(ctx);
+    fn(extra);
+    // finished once the dispatcher has also run what `fn` settled; a
+    // dispatcher run off the pool has no drain to wait for
+    upromise_worker_t *worker = current_worker;
+    if (worker != NULL && worker->executor == executor)
+        worker->continued += 1;
+    else
+        upromise_job_finish(executor, 1);
+}
+
+void upromise_executor_post_to(upromise_executor_t *executor, upromise_dispatcher_t *dispatcher, upromise_task_fn fn, void *extra)
+{
+    upromise_continuation_t *ctx = malloc(sizeof(upromise_continuation_t));
+    if (ctx == NULL)
+        abort();
+    ctx->executor = executor;
+    ctx->fn = fn;
+    ctx->extra = extra;
+    atomic_fetch_add(&executor->pending, 1);
+    upromise_dispatcher_post(dispatcher, upromise_continuation_fn, ctx);
+}
+
+void upromise_executor_wait(upromise_executor_t *executor)
+{
+    pthread_mutex_lock(&executor->lock);
+    while (atomic_load(&executor->pending) != 0)
+        pthread_cond_wait(&executor->done, &executor->lock);
+    pthread_mutex_unlock(&executor->lock);
+}
+
+size_t upromise_executor_worker(upromise_executor_t *executor)
+{
+    if (current_worker == NULL || current_worker->executor != executor)
+        return SIZE_MAX;
+    return current_worker->index;
+}
+
+// async bodies moving between workers
+typedef struct upromise_move_t
+{
+    upromise_executor_t *executor;
+    upromise_async_context_t *context;
+    struct coroutine *co;
+} upromise_move_t;
+
+static void upromise_move_back(void *extra);
+
+// Where a body goes when it cannot be attached elsewhere: back to the
+// dispatcher it left, or, once it returned, the one that settles it.
+static upromise_dispatcher_t *upromise_move_fallback(upromise_async_context_t *context)
+{
+    return context->finished ? context->promise->dispatcher : context->dispatcher;
+}
+
+static void upromise_move_in(upromise_dispatcher_t *dispatcher, upromise_move_t *move)
+{
+    upromise_async_context_t *context = move->context;
+    intptr_t co = coroutine_attach(dispatcher->sch, move->co);
+    if (co < 0)
+    {
+        // out of coroutine slots here: fall back, and keep trying there
+        // until one frees up
+        upromise_executor_post_to(move->executor, upromise_move_fallback(context), upromise_move_back, move);
+        return;
+    }
+    free(move);
+    context->dispatcher = dispatcher;
+    context->co = co;
+    coroutine_resume(dispatcher->sch, co);
+}
+
+static void upromise_move_job(upromise_dispatcher_t *dispatcher, void *extra)
+{
+    upromise_move_in(dispatcher, (upromise_move_t *)extra);
+}
+
+static void upromise_move_back(void *extra)
+{
+    upromise_move_t *move = (upromise_move_t *)extra;
+    upromise_move_in(upromise_move_fallback(move->context), move);
+}
+
+// Runs on the body's dispatcher with the body suspended: a woken await is
+// posted as a job for whichever worker gets to it first, a body that
+// returned goes back to the dispatcher of its promise to settle it.
+static void upromise_executor_wake(void *extra)
+{
+    upromise_async_context_t *context = (upromise_async_context_t *)extra;
+    upromise_worker_t *worker = current_worker;
+    upromise_move_t *move = NULL;
+    struct coroutine *co = NULL;
+    if (worker != NULL && worker->executor->movable && worker->dispatcher == context->dispatcher)
+        move = malloc(sizeof(upromise_move_t));
+    if (move != NULL)
+        co = coroutine_detach(context->dispatcher->sch, context->co);
+    if (co == NULL)
+    {
+        // stays where it is
+        free(move);
+        coroutine_resume(context->dispatcher->sch, context->co);
+        return;
+    }
+    move->executor = worker->executor;
+    move->context = context;
+    move->co = co;
+    if (context->finished)
+        upromise_executor_post_to(worker->executor, context->promise->dispatcher, upromise_move_back, move);
+    else
+        upromise_executor_post(worker->executor, upromise_move_job, move);
+}
+
+int upromise_executor_movable(upromise_executor_t *executor)
+{
+    return executor->movable;
+}
+
+upromise_promise_t *upromise_executor_async(upromise_executor_t *executor, upromise_dispatcher_t *dispatcher, upromise_async_fn fn, void *ctx)
+{
+    if (!executor->movable)
+        return NULL;
+    return upromise_async_impl(dispatcher, NULL, upromise_executor_wake, fn, ctx);
+}
@@ -0,0 +1,748 @@
+#define _GNU_SOURCE
+#include "upromise/io.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#endif
+#ifdef UPROMISE_USE_IO_URING
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+typedef enum io_op
+{
+    IO_READABLE,
+    IO_WRITABLE,
+    IO_READ,
+    IO_WRITE,
+    IO_ACCEPT,
+} io_op;
+
+typedef struct io_context
+{
+    upromise_task_t task; // the waiter node on the fd's watch
+    upromise_dispatcher_t *dispatcher;
+    upromise_promise_t *promise;
+    io_op op;
+    int fd;
+    char *buf;
+    size_t len;
+    size_t done;
+    bool not_socket; // write(2) instead of send(2)
+    bool polling;    // io_uring: waiting for readiness after EAGAIN
+} io_context;
+
+void io_finish(io_context *ctx, intptr_t value)
+{
+    upromise_promise_t *promise = ctx->promise;
+    upromise_pool_free(&ctx->dispatcher->pool, ctx, sizeof(io_context));
+    resolve_upromise_promise(promise, (void *)value);
+    del_upromise_promise(promise);
+}
+
+void io_fail(io_context *ctx, int error)
+{
+    upromise_promise_t *promise = ctx->promise;
+    upromise_pool_free(&ctx->dispatcher->pool, ctx, sizeof(io_context));
+    reject_upromise_promise(promise, (void *)(intptr_t)error);
+    del_upromise_promise(promise);
+}
+
+#ifdef __linux__
+#ifdef UPROMISE_USE_IO_URING
+// io_uring
+// Rings are set up with raw syscalls, liburing is not needed. Operations
+// become SQEs when they start and everything queued is submitted with one
+// io_uring_enter when the run queue drains or the loop parks. Completions
+// are reaped from the shared ring without a syscall.
+typedef struct upromise_uring_t
+{
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    size_t sqes_size;
+} upromise_uring_t;
+
+#define UPROMISE_URING_ENTRIES 256
+// user_data of the internal requests, contexts never sit this low
+#define UPROMISE_URING_WAKE 0
+#define UPROMISE_URING_CANCEL 1
+
+static void upromise_uring_clear(upromise_uring_t *ring)
+{
+    if (ring->sqes != MAP_FAILED)
+        munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    if (ring->sq_ring != MAP_FAILED)
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+static bool upromise_uring_cancels_by_fd(upromise_uring_t *ring);
+
+static bool upromise_uring_init(upromise_uring_t *ring)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CLAMP;
+    ring->fd = (int)syscall(__NR_io_uring_setup, UPROMISE_URING_ENTRIES, &params);
+    if (ring->fd < 0)
+        return false;
+    ring->sq_ring = MAP_FAILED;
+    ring->cq_ring = MAP_FAILED;
+    ring->sqes = MAP_FAILED;
+    // parking needs a timeout on the wait itself
+    if (!(params.features & IORING_FEAT_EXT_ARG))
+    {
+        upromise_uring_clear(ring);
+        return false;
+    }
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single && ring->cq_ring_size > ring->sq_ring_size)
+        ring->sq_ring_size = ring->cq_ring_size;
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (single)
+        ring->cq_ring = ring->sq_ring;
+    else
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED)
+    {
+        upromise_uring_clear(ring);
+        return false;
+    }
+    char *sq = (char *)ring->sq_ring;
+    char *cq = (char *)ring->cq_ring;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    if (!upromise_uring_cancels_by_fd(ring))
+    {
+        upromise_uring_clear(ring);
+        return false;
+    }
+    return true;
+}
+
+static unsigned upromise_uring_unsubmitted(upromise_uring_t *ring)
+{
+    return *ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+}
+
+// submit what is queued, with `wait` also block until a completion or `timeout_ms`
+static void upromise_uring_enter(upromise_uring_t *ring, bool wait, int timeout_ms)
+{
+    unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+    struct __kernel_timespec ts = {timeout_ms / 1000, (long long)(timeout_ms % 1000) * 1000000};
+    struct io_uring_getevents_arg arg = {0, 0, 0, (uint64_t)(uintptr_t)&ts};
+    void *argp = NULL;
+    size_t argsz = 0;
+    if (wait && timeout_ms >= 0)
+    {
+        flags |= IORING_ENTER_EXT_ARG;
+        argp = &arg;
+        argsz = sizeof(arg);
+    }
+    // EINTR and ETIME just end the wait
+    syscall(__NR_io_uring_enter, ring->fd, upromise_uring_unsubmitted(ring), wait ? 1 : 0, flags, argp, argsz);
+}
+
+// a zeroed SQE at the tail, published by upromise_uring_push
+static struct io_uring_sqe *upromise_uring_sqe(upromise_uring_t *ring)
+{
+    if (upromise_uring_unsubmitted(ring) == ring->sq_entries)
+        upromise_uring_enter(ring, false, 0);
+    unsigned index = *ring->sq_tail & ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    return sqe;
+}
+
+static void upromise_uring_push(upromise_uring_t *ring)
+{
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail + 1, __ATOMIC_RELEASE);
+}
+
+// upromise_io_close cancels with IORING_ASYNC_CANCEL_FD (Linux 5.19).
+// Older kernels reject the flags with EINVAL, and operations pending on a
+// closed fd would then never settle, so such a ring is not used.
+static bool upromise_uring_cancels_by_fd(upromise_uring_t *ring)
+{
+    struct io_uring_sqe *sqe = upromise_uring_sqe(ring);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = ring->fd; // nothing is ever queued on the ring itself
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data = UPROMISE_URING_CANCEL;
+    upromise_uring_push(ring);
+    upromise_uring_enter(ring, true, -1);
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        return false;
+    int res = ring->cqes[head & ring->cq_mask].res;
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    return res != -EINVAL;
+}
+#endif
+
+// reactor
+// One watch per fd, indexed by fd. Interest is level triggered and
+// EPOLLONESHOT: a watch is armed for the directions it has waiters in and
+// re-armed after an event while waiters remain, so an idle fd costs
+// nothing and no event is ever lost between two waits.
+typedef struct upromise_io_watch_t
+{
+    upromise_task_queue_t readers;
+    upromise_task_queue_t writers;
+    uint32_t armed; // 0 once the oneshot fired
+    bool added;
+} upromise_io_watch_t;
+
+struct upromise_reactor_t
+{
+    int epoll_fd;
+    upromise_io_watch_t *watches;
+    size_t capacity;
+    size_t waiting; // parked on a watch, or queued on the ring
+#ifdef UPROMISE_USE_IO_URING
+    bool uring;
+    upromise_uring_t ring;
+#endif
+};
+
+#define UPROMISE_REACTOR_EVENTS 64
+
+#ifdef UPROMISE_USE_IO_URING
+static void upromise_uring_arm_wake(upromise_dispatcher_t *dispatcher, upromise_reactor_t *reactor)
+{
+    struct io_uring_sqe *sqe = upromise_uring_sqe(&reactor->ring);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = dispatcher->wake_fd[0];
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = UPROMISE_URING_WAKE;
+    upromise_uring_push(&reactor->ring);
+}
+#endif
+
+// NULL with errno set when the reactor cannot be set up, every operation
+// that needs it then fails with that errno
+static upromise_reactor_t *upromise_reactor_get(upromise_dispatcher_t *dispatcher)
+{
+    if (dispatcher->reactor != NULL)
+        return dispatcher->reactor;
+    upromise_reactor_t *reactor = malloc(sizeof(upromise_reactor_t));
+    if (reactor == NULL)
+        return NULL;
+    reactor->epoll_fd = -1;
+    reactor->watches = NULL;
+    reactor->capacity = 0;
+    reactor->waiting = 0;
+#ifdef UPROMISE_USE_IO_URING
+    reactor->uring = dispatcher->io_backend == UPROMISE_IO_URING && upromise_uring_init(&reactor->ring);
+    if (reactor->uring)
+    {
+        // parking waits in io_uring_enter, so wake-ups come through the ring too
+        upromise_uring_arm_wake(dispatcher, reactor);
+        dispatcher->reactor = reactor;
+        return reactor;
+    }
+#endif
+    reactor->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (reactor->epoll_fd < 0)
+    {
+        free(reactor);
+        return NULL;
+    }
+    // parking moves from poll(2) to epoll_wait, so wake-ups come through here too
+    struct epoll_event event = {EPOLLIN, {.fd = dispatcher->wake_fd[0]}};
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, dispatcher->wake_fd[0], &event) != 0)
+    {
+        // a reactor that cannot be woken would park through posts and stops
+        int error = errno;
+        close(reactor->epoll_fd);
+        free(reactor);
+        errno = error;
+        return NULL;
+    }
+    dispatcher->reactor = reactor;
+    return reactor;
+}
+
+void clear_upromise_reactor(upromise_dispatcher_t *dispatcher)
+{
+    upromise_reactor_t *reactor = dispatcher->reactor;
+    if (reactor == NULL)
+        return;
+    // waiting contexts live in the dispatcher's pool
+#ifdef UPROMISE_USE_IO_URING
+    if (reactor->uring)
+        upromise_uring_clear(&reactor->ring);
+#endif
+    if (reactor->epoll_fd >= 0)
+        close(reactor->epoll_fd);
+    free(reactor->watches);
+    free(reactor);
+    dispatcher->reactor = NULL;
+}
+
+// NULL when the table cannot grow to `fd`, the watches in it stay put
+static upromise_io_watch_t *upromise_reactor_watch(upromise_reactor_t *reactor, int fd)
+{
+    if ((size_t)fd >= reactor->capacity)
+    {
+        size_t capacity = reactor->capacity == 0 ? 64 : reactor->capacity;
+        while (capacity <= (size_t)fd)
+            capacity *= 2;
+        upromise_io_watch_t *watches = realloc(reactor->watches, capacity * sizeof(upromise_io_watch_t));
+        if (watches == NULL)
+            return NULL;
+        reactor->watches = watches;
+        memset(reactor->watches + reactor->capacity, 0, (capacity - reactor->capacity) * sizeof(upromise_io_watch_t));
+        reactor->capacity = capacity;
+    }
+    return &reactor->watches[fd];
+}
+
+// reject everything waiting on the watch
+static void upromise_io_watch_fail(upromise_reactor_t *reactor, upromise_io_watch_t *watch, int error)
+{
+    upromise_task_queue_splice(&watch->readers, &watch->writers);
+    upromise_task_t *node;
+    while ((node = upromise_task_queue_pop(&watch->readers)) != NULL)
+    {
+        reactor->waiting -= 1;
+        io_fail((io_context *)node->extra, error);
+    }
+}
+
+static void upromise_io_watch_arm(upromise_reactor_t *reactor, int fd)
+{
+    upromise_io_watch_t *watch = &reactor->watches[fd];
+    uint32_t want = (watch->readers.head != NULL ? EPOLLIN | EPOLLRDHUP : 0) |
+                    (watch->writers.head != NULL ? EPOLLOUT : 0);
+    if (want == 0 || want == watch->armed)
+        return;
+    struct epoll_event event = {want | EPOLLONESHOT, {.fd = fd}};
+    int ret = epoll_ctl(reactor->epoll_fd, watch->added ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &event);
+    // closed behind our back (and maybe reused), or added by an earlier owner
+    if (ret < 0 && (errno == ENOENT || errno == EEXIST))
+        ret = epoll_ctl(reactor->epoll_fd, errno == ENOENT ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, fd, &event);
+    if (ret < 0)
+    {
+        upromise_io_watch_fail(reactor, watch, errno);
+        return;
+    }
+    watch->added = true;
+    watch->armed = want;
+}
+
+static void io_wait(io_context *ctx)
+{
+    upromise_reactor_t *reactor = upromise_reactor_get(ctx->dispatcher);
+    if (reactor == NULL)
+    {
+        io_fail(ctx, errno);
+        return;
+    }
+    upromise_io_watch_t *watch = upromise_reactor_watch(reactor, ctx->fd);
+    if (watch == NULL)
+    {
+        io_fail(ctx, ENOMEM);
+        return;
+    }
+    bool write = ctx->op == IO_WRITABLE || ctx->op == IO_WRITE;
+    upromise_task_queue_push(write ? &watch->writers : &watch->readers, &ctx->task);
+    reactor->waiting += 1;
+    upromise_io_watch_arm(reactor, ctx->fd);
+}
+
+#ifdef UPROMISE_USE_IO_URING
+static void upromise_uring_submit(upromise_reactor_t *reactor, io_context *ctx)
+{
+    struct io_uring_sqe *sqe = upromise_uring_sqe(&reactor->ring);
+    sqe->fd = ctx->fd;
+    sqe->user_data = (uint64_t)(uintptr_t)ctx;
+    // one SQE moves at most 1GiB, longer writes continue on completion
+    unsigned len = ctx->len - ctx->done > (1u << 30) ? (1u << 30) : (unsigned)(ctx->len - ctx->done);
+    if (ctx->polling || ctx->op == IO_READABLE || ctx->op == IO_WRITABLE)
+    {
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->poll32_events = ctx->op == IO_WRITABLE || ctx->op == IO_WRITE ? POLLOUT : POLLIN | POLLRDHUP;
+    }
+    else if (ctx->op == IO_READ)
+    {
+        sqe->opcode = IORING_OP_READ;
+        sqe->addr = (uint64_t)(uintptr_t)ctx->buf;
+        sqe->len = len;
+        sqe->off = (uint64_t)-1; // the file position, like read(2)
+    }
+    else if (ctx->op == IO_WRITE)
+    {
+        sqe->opcode = ctx->not_socket ? IORING_OP_WRITE : IORING_OP_SEND;
+        sqe->addr = (uint64_t)(uintptr_t)(ctx->buf + ctx->done);
+        sqe->len = len;
+        if (ctx->not_socket)
+            sqe->off = (uint64_t)-1;
+        else
+            sqe->msg_flags = MSG_NOSIGNAL;
+    }
+    else
+    {
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    }
+    upromise_uring_push(&reactor->ring);
+    reactor->waiting += 1;
+}
+
+static void upromise_uring_complete(upromise_reactor_t *reactor, io_context *ctx, int res)
+{
+    reactor->waiting -= 1;
+    if (ctx->op == IO_READABLE || ctx->op == IO_WRITABLE)
+    {
+        if (res < 0)
+            io_fail(ctx, -res);
+        else
+            io_finish(ctx, 0);
+        return;
+    }
+    if (ctx->polling && res >= 0)
+    {
+        ctx->polling = false;
+        upromise_uring_submit(reactor, ctx);
+        return;
+    }
+    // a non-blocking fd that was not ready, wait for it like epoll would
+    if (!ctx->polling && (res == -EAGAIN || res == -EINTR))
+    {
+        ctx->polling = res == -EAGAIN;
+        upromise_uring_submit(reactor, ctx);
+        return;
+    }
+    if (ctx->op == IO_WRITE && res == -ENOTSOCK && !ctx->not_socket)
+    {
+        ctx->not_socket = true;
+        upromise_uring_submit(reactor, ctx);
+        return;
+    }
+    if (res < 0)
+    {
+        io_fail(ctx, -res);
+        return;
+    }
+    if (ctx->op == IO_WRITE)
+    {
+        ctx->done += res;
+        if (ctx->done < ctx->len)
+            upromise_uring_submit(reactor, ctx);
+        else
+            io_finish(ctx, ctx->len);
+        return;
+    }
+    io_finish(ctx, res);
+}
+
+static size_t upromise_uring_poll(upromise_dispatcher_t *dispatcher, upromise_reactor_t *reactor, int timeout_ms)
+{
+    upromise_uring_t *ring = &reactor->ring;
+    if (timeout_ms != 0 || upromise_uring_unsubmitted(ring) != 0)
+        upromise_uring_enter(ring, timeout_ms != 0, timeout_ms);
+    size_t count = 0;
+    unsigned head = *ring->cq_head;
+    while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+    {
+        struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+        uint64_t user_data = cqe->user_data;
+        int res = cqe->res;
+        // hand the entry back first, completing may queue more work
+        head += 1;
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+        if (user_data == UPROMISE_URING_WAKE)
+            upromise_uring_arm_wake(dispatcher, reactor);
+        else if (user_data != UPROMISE_URING_CANCEL)
+        {
+            upromise_uring_complete(reactor, (io_context *)(uintptr_t)user_data, res);
+            count += 1;
+        }
+    }
+    return count;
+}
+#endif
+
+// Wait up to `timeout_ms` for I/O and run the operations it unblocks,
+// returns how many events there were. Only the wake fd is polled when
+// nothing waits on I/O.
+size_t upromise_reactor_poll(upromise_dispatcher_t *dispatcher, int timeout_ms)
+{
+    upromise_reactor_t *reactor = dispatcher->reactor;
+    if (reactor == NULL || (reactor->waiting == 0 && timeout_ms == 0))
+        return 0;
+#ifdef UPROMISE_USE_IO_URING
+    if (reactor->uring)
+        return upromise_uring_poll(dispatcher, reactor, timeout_ms);
+#endif
+    struct epoll_event events[UPROMISE_REACTOR_EVENTS];
+    int n;
+    while ((n = epoll_wait(reactor->epoll_fd, events, UPROMISE_REACTOR_EVENTS, timeout_ms)) < 0 && errno == EINTR)
+        ;
+    size_t count = 0;
+    int i;
+    for (i = 0; i < n; i++)
+    {
+        int fd = events[i].data.fd;
+        if (fd == dispatcher->wake_fd[0])
+            continue;
+        upromise_io_watch_t *watch = &reactor->watches[fd];
+        uint32_t ready = events[i].events;
+        upromise_task_queue_t list = {NULL, NULL};
+        watch->armed = 0;
+        if (ready & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+            upromise_task_queue_splice(&list, &watch->readers);
+        if (ready & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+            upromise_task_queue_splice(&list, &watch->writers);
+        // an operation that would still block goes back on the watch
+        upromise_task_t *node;
+        while ((node = upromise_task_queue_pop(&list)) != NULL)
+        {
+            reactor->waiting -= 1;
+            node->fn(node->extra);
+        }
+        upromise_io_watch_arm(reactor, fd);
+        count += 1;
+    }
+    return count;
+}
+
+// operations parked on the reactor, they keep an executor worker busy
+size_t upromise_reactor_waiting(upromise_dispatcher_t *dispatcher)
+{
+    return dispatcher->reactor != NULL ? dispatcher->reactor->waiting : 0;
+}
+
+void io_attempt_fn(void *ctx_raw)
+{
+    io_context *ctx = (io_context *)ctx_raw;
+    ssize_t n;
+    while (true)
+    {
+        switch (ctx->op)
+        {
+        case IO_READABLE:
+        case IO_WRITABLE:
+            io_finish(ctx, 0);
+            return;
+        case IO_READ:
+            n = read(ctx->fd, ctx->buf, ctx->len);
+            if (n >= 0)
+            {
+                io_finish(ctx, n);
+                return;
+            }
+            break;
+        case IO_WRITE:
+            while (ctx->done < ctx->len)
+            {
+                // no SIGPIPE for a peer that went away
+                n = ctx->not_socket ? -1 : send(ctx->fd, ctx->buf + ctx->done, ctx->len - ctx->done, MSG_NOSIGNAL);
+                if (n < 0 && !ctx->not_socket && errno == ENOTSOCK)
+                    ctx->not_socket = true;
+                if (ctx->not_socket)
+                    n = write(ctx->fd, ctx->buf + ctx->done, ctx->len - ctx->done);
+                if (n < 0)
+                    break;
+                ctx->done += n;
+            }
+            if (ctx->done == ctx->len)
+            {
+                io_finish(ctx, ctx->len);
+                return;
+            }
+            break;
+        case IO_ACCEPT:
+            n = accept4(ctx->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (n >= 0)
+            {
+                io_finish(ctx, n);
+                return;
+            }
+            break;
+        }
+        if (errno != EINTR)
+            break;
+    }
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+        io_wait(ctx);
+    else
+        io_fail(ctx, errno);
+}
+
+int upromise_io_close(upromise_dispatcher_t *dispatcher, int fd)
+{
+    upromise_reactor_t *reactor = dispatcher->reactor;
+#ifdef UPROMISE_USE_IO_URING
+    if (reactor != NULL && reactor->uring)
+    {
+        // queued operations on fd go in ahead of the cancel and end with ECANCELED
+        struct io_uring_sqe *sqe = upromise_uring_sqe(&reactor->ring);
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = fd;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+        sqe->user_data = UPROMISE_URING_CANCEL;
+        upromise_uring_push(&reactor->ring);
+        upromise_uring_enter(&reactor->ring, false, 0);
+        return close(fd);
+    }
+#endif
+    if (reactor != NULL && fd >= 0 && (size_t)fd < reactor->capacity)
+    {
+        upromise_io_watch_t *watch = &reactor->watches[fd];
+        upromise_io_watch_fail(reactor, watch, ECANCELED);
+        if (watch->added)
+            epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+        watch->armed = 0;
+        watch->added = false;
+    }
+    return close(fd);
+}
+
+upromise_io_backend upromise_io_backend_of(upromise_dispatcher_t *dispatcher)
+{
+#ifdef UPROMISE_USE_IO_URING
+    upromise_reactor_t *reactor = upromise_reactor_get(dispatcher);
+    if (reactor != NULL && reactor->uring)
+        return UPROMISE_IO_URING;
+#endif
+    return UPROMISE_IO_EPOLL;
+}
+#else
+void clear_upromise_reactor(upromise_dispatcher_t *dispatcher)
+{
+}
+
+size_t upromise_reactor_poll(upromise_dispatcher_t *dispatcher, int timeout_ms)
+{
+    return 0;
+}
+
+size_t upromise_reactor_waiting(upromise_dispatcher_t *dispatcher)
+{
+    return 0;
+}
+
+void io_attempt_fn(void *ctx_raw)
+{
+    io_fail((io_context *)ctx_raw, ENOSYS);
+}
+
+int upromise_io_close(upromise_dispatcher_t *dispatcher, int fd)
+{
+    return close(fd);
+}
+
+upromise_io_backend upromise_io_backend_of(upromise_dispatcher_t *dispatcher)
+{
+    return UPROMISE_IO_EPOLL;
+}
+#endif
+
+void io_promise_fn(upromise_promise_t *promise, void *ctx_raw)
+{
+    io_context *ctx = (io_context *)ctx_raw;
+    ctx->promise = promise; // the fn hold goes to the operation
+#ifdef UPROMISE_USE_IO_URING
+    if (ctx->dispatcher->io_backend == UPROMISE_IO_URING)
+    {
+        upromise_reactor_t *reactor = upromise_reactor_get(ctx->dispatcher);
+        if (reactor != NULL && reactor->uring)
+        {
+            upromise_uring_submit(reactor, ctx);
+            return;
+        }
+    }
+#endif
+#ifdef __linux__
+    if (ctx->op == IO_READABLE || ctx->op == IO_WRITABLE)
+    {
+        io_wait(ctx);
+        return;
+    }
+#endif
+    io_attempt_fn(ctx);
+}
+
+static upromise_promise_t *upromise_io_start(upromise_dispatcher_t *dispatcher, io_op op, int fd, void *buf, size_t len)
+{
+    io_context *ctx = upromise_pool_alloc(&dispatcher->pool, sizeof(io_context));
+    if (ctx == NULL)
+        return NULL;
+    ctx->task.fn = io_attempt_fn;
+    ctx->task.co = -1;
+    ctx->task.extra = ctx;
+    ctx->dispatcher = dispatcher;
+    ctx->op = op;
+    ctx->fd = fd;
+    ctx->buf = (char *)buf;
+    ctx->len = len;
+    ctx->done = 0;
+    ctx->not_socket = false;
+    ctx->polling = false;
+    upromise_promise_t *ret = new_upromise_promise(dispatcher, io_promise_fn, ctx);
+    if (ret == NULL)
+        upromise_pool_free(&dispatcher->pool, ctx, sizeof(io_context));
+    return ret;
+}
+
+upromise_promise_t *upromise_fd_readable(upromise_dispatcher_t *dispatcher, int fd)
+{
+    return upromise_io_start(dispatcher, IO_READABLE, fd, NULL, 0);
+}
+
+upromise_promise_t *upromise_fd_writable(upromise_dispatcher_t *dispatcher, int fd)
+{
+    return upromise_io_start(dispatcher, IO_WRITABLE, fd, NULL, 0);
+}
+
+upromise_promise_t *upromise_read(upromise_dispatcher_t *dispatcher, int fd, void *buf, size_t len)
+{
+    return upromise_io_start(dispatcher, IO_READ, fd, buf, len);
+}
+
+upromise_promise_t *upromise_write(upromise_dispatcher_t *dispatcher, int fd, const void *buf, size_t len)
+{
+    return upromise_io_start(dispatcher, IO_WRITE, fd, (void *)buf, len);
+}
+
+upromise_promise_t *upromise_accept(upromise_dispatcher_t *dispatcher, int fd)
+{
+    return upromise_io_start(dispatcher, IO_ACCEPT, fd, NULL, 0);
+}
@@ -0,0 +1,264 @@
+#include "upromise/upromise.h"
+#include <stdlib.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <time.h>
+
+// A timer sits at the lowest level whose 64 slots span its distance from
+// `now`, in the slot of its deadline's digit at that level. When `now`
+// reaches a higher-level slot, that slot is cascaded: its timers are
+// placed again and fall to lower levels.
+
+#define WHEEL_MASK (UPROMISE_WHEEL_SLOTS - 1)
+#define WHEEL_SHIFT(level) ((level) * UPROMISE_WHEEL_BITS)
+
+static uint64_t upromise_clock_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+void init_upromise_timer_wheel(upromise_timer_wheel_t *wheel)
+{
+    int i;
+    wheel->clock = upromise_clock_ms;
+    wheel->now = wheel->clock();
+    wheel->count = 0;
+    for (i = 0; i < UPROMISE_WHEEL_LEVELS; i++)
+        wheel->occupied[i] = 0;
+    for (i = 0; i < UPROMISE_WHEEL_LEVELS * UPROMISE_WHEEL_SLOTS; i++)
+    {
+        wheel->slots[i] = NULL;
+        wheel->tails[i] = &wheel->slots[i];
+    }
+}
+
+static void upromise_timer_wheel_link(upromise_timer_wheel_t *wheel, upromise_timer_t *timer, uint64_t earliest)
+{
+    uint64_t expire = timer->deadline < earliest ? earliest : timer->deadline;
+    uint64_t distance = expire - wheel->now;
+    int level;
+    int slot;
+    for (level = 0; level < UPROMISE_WHEEL_LEVELS; level++)
+        if (distance < (uint64_t)1 << WHEEL_SHIFT(level + 1))
+            break;
+    if (level < UPROMISE_WHEEL_LEVELS)
+        slot = (expire >> WHEEL_SHIFT(level)) & WHEEL_MASK;
+    else
+    {
+        // beyond the horizon: wait in the furthest top-level slot
+        level = UPROMISE_WHEEL_LEVELS - 1;
+        slot = ((wheel->now >> WHEEL_SHIFT(level)) + WHEEL_MASK) & WHEEL_MASK;
+    }
+    int index = level * UPROMISE_WHEEL_SLOTS + slot;
+    timer->slot = index;
+    timer->next = NULL;
+    timer->pprev = wheel->tails[index];
+    *wheel->tails[index] = timer;
+    wheel->tails[index] = &timer->next;
+    wheel->occupied[level] |= (uint64_t)1 << slot;
+}
+
+static void upromise_timer_wheel_unlink(upromise_timer_wheel_t *wheel, upromise_timer_t *timer)
+{
+    *timer->pprev = timer->next;
+    if (timer->next != NULL)
+        timer->next->pprev = timer->pprev;
+    else if (timer->slot >= 0)
+        wheel->tails[timer->slot] = timer->pprev;
+    if (timer->slot >= 0 && wheel->slots[timer->slot] == NULL)
+        wheel->occupied[timer->slot / UPROMISE_WHEEL_SLOTS] &= ~((uint64_t)1 << (timer->slot & WHEEL_MASK));
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+// take a whole slot out of the wheel, its nodes now hang off `*list`
+static void upromise_timer_wheel_detach(upromise_timer_wheel_t *wheel, int index, upromise_timer_t **list)
+{
+    upromise_timer_t *timer;
+    *list = wheel->slots[index];
+    wheel->slots[index] = NULL;
+    wheel->tails[index] = &wheel->slots[index];
+    wheel->occupied[index / UPROMISE_WHEEL_SLOTS] &= ~((uint64_t)1 << (index & WHEEL_MASK));
+    if (*list != NULL)
+        (*list)->pprev = list;
+    for (timer = *list; timer != NULL; timer = timer->next)
+        timer->slot = -1;
+}
+
+// the first tick after `now` at which some slot fires or cascades
+static uint64_t upromise_timer_wheel_next(upromise_timer_wheel_t *wheel)
+{
+    uint64_t best = UINT64_MAX;
+    int level;
+    for (level = 0; level < UPROMISE_WHEEL_LEVELS; level++)
+    {
+        uint64_t bits = wheel->occupied[level];
+        if (bits == 0)
+            continue;
+        uint64_t digit = wheel->now >> WHEEL_SHIFT(level);
+        unsigned start = (unsigned)((digit + 1) & WHEEL_MASK);
+        // rotate so that the slot after the current one is bit 0
+        uint64_t rotated = start == 0 ? bits : (bits >> start) | (bits << (UPROMISE_WHEEL_SLOTS - start));
+        uint64_t tick = (digit + 1 + __builtin_ctzll(rotated)) << WHEEL_SHIFT(level);
+        if (tick < best)
+            best = tick;
+    }
+    return best;
+}
+
+static void upromise_timer_wheel_tick(upromise_timer_wheel_t *wheel, uint64_t tick)
+{
+    int level;
+    wheel->now = tick;
+    for (level = UPROMISE_WHEEL_LEVELS - 1; level > 0; level--)
+    {
+        if ((tick & (((uint64_t)1 << WHEEL_SHIFT(level)) - 1)) != 0)
+            continue;
+        upromise_timer_t *list;
+        upromise_timer_wheel_detach(wheel, level * UPROMISE_WHEEL_SLOTS + ((tick >> WHEEL_SHIFT(level)) & WHEEL_MASK), &list);
+        while (list != NULL)
+        {
+            upromise_timer_t *timer = list;
+            upromise_timer_wheel_unlink(wheel, timer);
+            upromise_timer_wheel_link(wheel, timer, tick);
+        }
+    }
+}
+
+// fire everything due by the clock, returns how many fired
+size_t upromise_dispatcher_expire_timers(upromise_dispatcher_t *dispatcher)
+{
+    upromise_timer_wheel_t *wheel = &dispatcher->timers;
+    if (wheel->count == 0)
+        return 0;
+    uint64_t now = wheel->clock();
+    size_t fired = 0;
+    while (wheel->count != 0)
+    {
+        uint64_t tick = upromise_timer_wheel_next(wheel);
+        if (tick > now)
+            break;
+        upromise_timer_wheel_tick(wheel, tick);
+        upromise_timer_t *list;
+        upromise_timer_wheel_detach(wheel, (int)(tick & WHEEL_MASK), &list);
+        // callbacks may start or cancel timers, including ones in `list`
+        while (list != NULL)
+        {
+            upromise_timer_t *timer = list;
+            upromise_timer_wheel_unlink(wheel, timer);
+            wheel->count -= 1;
+            fired += 1;
+            timer->fn(timer->extra);
+        }
+    }
+    return fired;
+}
+
+// how long run_forever may sleep, -1 for no timers
+int upromise_dispatcher_timeout(upromise_dispatcher_t *dispatcher)
+{
+    upromise_timer_wheel_t *wheel = &dispatcher->timers;
+    if (wheel->count == 0)
+        return -1;
+    uint64_t tick = upromise_timer_wheel_next(wheel);
+    uint64_t now = wheel->clock();
+    if (tick <= now)
+        return 0;
+    return tick - now > INT_MAX ? INT_MAX : (int)(tick - now);
+}
+
+uint64_t upromise_dispatcher_now(upromise_dispatcher_t *dispatcher)
+{
+    return dispatcher->timers.clock();
+}
+
+void upromise_timer_start(upromise_dispatcher_t *dispatcher, upromise_timer_t *timer, uint64_t ms, upromise_task_fn fn, void *extra)
+{
+    upromise_timer_wheel_t *wheel = &dispatcher->timers;
+    uint64_t now = wheel->clock();
+    // an empty wheel can jump straight to the present
+    if (wheel->count == 0 && now > wheel->now)
+        wheel->now = now;
+    // UINT64_MAX and the like mean "never", not a wrapped deadline
+    timer->deadline = ms > UINT64_MAX - now ? UINT64_MAX : now + ms;
+    timer->fn = fn;
+    timer->extra = extra;
+    // the current tick has been processed already
+    upromise_timer_wheel_link(wheel, timer, wheel->now + 1);
+    wheel->count += 1;
+}
+
+int upromise_timer_cancel(upromise_dispatcher_t *dispatcher, upromise_timer_t *timer)
+{
+    if (timer->pprev == NULL)
+        return 0;
+    upromise_timer_wheel_unlink(&dispatcher->timers, timer);
+    dispatcher->timers.count -= 1;
+    return 1;
+}
+
+// sleep
+// Whichever of the timer and the cancel comes first settles the promise
+// and takes the other one back.
+typedef struct sleep_context
+{
+    upromise_timer_t timer;
+    upromise_cancel_link_t cancel;
+    upromise_cancel_token_t *token;
+    upromise_promise_t *promise;
+    uint64_t ms;
+} sleep_context;
+
+void sleep_timer_fn(void *ctx_raw)
+{
+    sleep_context *ctx = (sleep_context *)ctx_raw;
+    upromise_promise_t *promise = ctx->promise;
+    upromise_cancel_unlink(&ctx->cancel);
+    upromise_pool_free(&promise->dispatcher->pool, ctx, sizeof(sleep_context));
+    resolve_upromise_promise(promise, NULL);
+    del_upromise_promise(promise);
+}
+
+static void sleep_cancel_fn(void *extra, void *reason)
+{
+    sleep_context *ctx = (sleep_context *)extra;
+    upromise_promise_t *promise = ctx->promise;
+    upromise_timer_cancel(promise->dispatcher, &ctx->timer);
+    upromise_pool_free(&promise->dispatcher->pool, ctx, sizeof(sleep_context));
+    reject_upromise_promise(promise, reason);
+    del_upromise_promise(promise);
+}
+
+void sleep_promise_fn(upromise_promise_t *promise, void *ctx_raw)
+{
+    sleep_context *ctx = (sleep_context *)ctx_raw;
+    ctx->promise = promise; // the fn hold goes to the timer
+    ctx->timer.pprev = NULL;
+    ctx->cancel.pprev = NULL;
+    if (ctx->token != NULL && !upromise_cancel_link(ctx->token, &ctx->cancel, sleep_cancel_fn, ctx))
+    {
+        sleep_cancel_fn(ctx, ctx->token->reason);
+        return;
+    }
+    upromise_timer_start(promise->dispatcher, &ctx->timer, ctx->ms, sleep_timer_fn, ctx);
+}
+
+upromise_promise_t *upromise_sleep(upromise_dispatcher_t *dispatcher, uint64_t ms)
+{
+    return upromise_sleep_cancellable(dispatcher, ms, NULL);
+}
+
+upromise_promise_t *upromise_sleep_cancellable(upromise_dispatcher_t *dispatcher, uint64_t ms, upromise_cancel_token_t *token)
+{
+    sleep_context *ctx = upromise_pool_alloc(&dispatcher->pool, sizeof(sleep_context));
+    if (ctx == NULL)
+        return NULL;
+    ctx->token = token;
+    ctx->ms = ms;
+    upromise_promise_t *ret = new_upromise_promise(dispatcher, sleep_promise_fn, ctx);
+    if (ret == NULL)
+        upromise_pool_free(&dispatcher->pool, ctx, sizeof(sleep_context));
+    return ret;
+}
@@ -1,102 +1,768 @@
 #include "upromise/upromise.h"
 #include <stdlib.h>
+#include <string.h>
 #include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+void init_upromise_timer_wheel(upromise_timer_wheel_t *wheel);
+size_t upromise_dispatcher_expire_timers(upromise_dispatcher_t *dispatcher);
+int upromise_dispatcher_timeout(upromise_dispatcher_t *dispatcher);
+size_t upromise_reactor_poll(upromise_dispatcher_t *dispatcher, int timeout_ms);
+void clear_upromise_reactor(upromise_dispatcher_t *dispatcher);
 
 // ref count
+// The decrement releases this holder's writes and the final one acquires
+// all of them before the object is freed.
 void upromise_ref_count_inc(upromise_ref_count_t *rc)
 {
+#ifdef UPROMISE_ATOMIC_REFCOUNT
+    __atomic_fetch_add(rc, 1, __ATOMIC_RELAXED);
+#else
     *rc += 1;
+#endif
 }
 
-bool upromise_ref_count_dec(upromise_ref_count_t *rc)
+// the count left behind, exact even when other holders drop concurrently
+static upromise_ref_count_t upromise_ref_count_sub(upromise_ref_count_t *rc)
 {
+#ifdef UPROMISE_ATOMIC_REFCOUNT
+    return __atomic_sub_fetch(rc, 1, __ATOMIC_ACQ_REL);
+#else
     *rc -= 1;
-    return (rc == 0);
+    return *rc;
+#endif
+}
+
+bool upromise_ref_count_dec(upromise_ref_count_t *rc)
+{
+    return upromise_ref_count_sub(rc) == 0;
+}
+
+// pool
+#define UPROMISE_POOL_SLAB_SIZE (64 * 1024)
+// under AddressSanitizer every object goes to the heap, so a use after
+// free is reported instead of landing in a recycled pool slot
+#if defined(__SANITIZE_ADDRESS__)
+#define UPROMISE_POOL_MAX 0
+#else
+#define UPROMISE_POOL_MAX UPROMISE_POOL_CLASSES
+#endif
+
+typedef struct upromise_pool_slab_t
+{
+    struct upromise_pool_slab_t *next;
+    // keep the objects that follow the header max-aligned
+    union
+    {
+        long double ld;
+        void *ptr;
+        long long ll;
+    } align;
+} upromise_pool_slab_t;
+
+void init_upromise_pool(upromise_pool_t *pool)
+{
+    int i;
+    for (i = 0; i < UPROMISE_POOL_CLASSES; i++)
+        pool->free[i] = NULL;
+    pool->slabs = NULL;
+    pool->cursor = NULL;
+    pool->end = NULL;
+#ifdef UPROMISE_ATOMIC_REFCOUNT
+    pool->lock = false;
+#endif
+}
+
+#ifdef UPROMISE_ATOMIC_REFCOUNT
+static void upromise_pool_lock(upromise_pool_t *pool)
+{
+    while (__atomic_test_and_set(&pool->lock, __ATOMIC_ACQUIRE))
+        sched_yield();
+}
+
+static void upromise_pool_unlock(upromise_pool_t *pool)
+{
+    __atomic_clear(&pool->lock, __ATOMIC_RELEASE);
+}
+#else
+#define upromise_pool_lock(pool) ((void)(pool))
+#define upromise_pool_unlock(pool) ((void)(pool))
+#endif
+
+void clear_upromise_pool(upromise_pool_t *pool)
+{
+    upromise_pool_slab_t *slab = (upromise_pool_slab_t *)pool->slabs;
+    while (slab != NULL)
+    {
+        upromise_pool_slab_t *next = slab->next;
+        free(slab);
+        slab = next;
+    }
+    init_upromise_pool(pool);
+}
+
+void *upromise_pool_alloc(upromise_pool_t *pool, size_t size)
+{
+    size_t index = (size + UPROMISE_POOL_GRANULE - 1) / UPROMISE_POOL_GRANULE;
+    if (index == 0)
+        index = 1;
+    if (index > UPROMISE_POOL_MAX)
+        return malloc(size);
+    upromise_pool_lock(pool);
+    void *ret = pool->free[index - 1];
+    if (ret != NULL)
+    {
+        pool->free[index - 1] = *(void **)ret;
+        upromise_pool_unlock(pool);
+        return ret;
+    }
+    size_t bytes = index * UPROMISE_POOL_GRANULE;
+    if (pool->cursor == NULL || (size_t)(pool->end - pool->cursor) < bytes)
+    {
+        upromise_pool_slab_t *slab = malloc(UPROMISE_POOL_SLAB_SIZE);
+        if (slab == NULL)
+        {
+            upromise_pool_unlock(pool);
+            return NULL;
+        }
+        slab->next = (upromise_pool_slab_t *)pool->slabs;
+        pool->slabs = slab;
+        pool->cursor = (char *)&slab->align;
+        pool->end = (char *)slab + UPROMISE_POOL_SLAB_SIZE;
+    }
+    ret = pool->cursor;
+    pool->cursor += bytes;
+    upromise_pool_unlock(pool);
+    return ret;
+}
+
+void upromise_pool_free(upromise_pool_t *pool, void *ptr, size_t size)
+{
+    if (ptr == NULL)
+        return;
+    size_t index = (size + UPROMISE_POOL_GRANULE - 1) / UPROMISE_POOL_GRANULE;
+    if (index == 0)
+        index = 1;
+    if (index > UPROMISE_POOL_MAX)
+    {
+        free(ptr);
+        return;
+    }
+    upromise_pool_lock(pool);
+    *(void **)ptr = pool->free[index - 1];
+    pool->free[index - 1] = ptr;
+    upromise_pool_unlock(pool);
 }
 
 // task queue
+upromise_task_t *new_upromise_task(upromise_dispatcher_t *dispatcher, upromise_task_fn fn, intptr_t co, void *extra)
+{
+    upromise_task_t *task = upromise_pool_alloc(&dispatcher->pool, sizeof(upromise_task_t));
+    if (task == NULL)
+        return NULL;
+    task->fn = fn;
+    task->co = co;
+    task->extra = extra;
+    return task;
+}
+
+void del_upromise_task(upromise_dispatcher_t *dispatcher, upromise_task_t *task)
+{
+    upromise_pool_free(&dispatcher->pool, task, sizeof(upromise_task_t));
+}
+
+// An empty queue is head == tail == NULL, there is no sentinel node.
+// Nodes with `fn` set are embedded in the context they run (see
+// then_context) and are released by that context; bare coroutine nodes
+// belong to the queue.
 void init_upromise_task_queue(upromise_task_queue_t *queue)
 {
-    queue->head = malloc(sizeof(upromise_task_t));
-    queue->tail = queue->head;
-    queue->head->next = NULL;
+    queue->head = NULL;
+    queue->tail = NULL;
 }
 
-void clear_upromise_task_queue(upromise_task_queue_t *queue)
+void clear_upromise_task_queue(upromise_dispatcher_t *dispatcher, upromise_task_queue_t *queue)
 {
     while (queue->head != NULL)
     {
         upromise_task_t *next = queue->head->next;
-        free(queue->head);
+        if (queue->head->fn == NULL)
+            del_upromise_task(dispatcher, queue->head);
         queue->head = next;
     }
+    queue->tail = NULL;
 }
 
 void upromise_task_queue_push(upromise_task_queue_t *queue, upromise_task_t *task)
 {
     task->next = NULL;
-    queue->tail->next = task;
+    if (queue->tail != NULL)
+        queue->tail->next = task;
+    else
+        queue->head = task;
     queue->tail = task;
 }
 
 void upromise_task_queue_push_immediately(upromise_task_queue_t *queue, upromise_task_t *task)
 {
-    task->next = queue->head->next;
-    if (task->next == NULL)
+    task->next = queue->head;
+    if (queue->head == NULL)
         queue->tail = task;
-    queue->head->next = task;
+    queue->head = task;
+}
+
+// move every node of `src` to the end of `dst` in O(1)
+void upromise_task_queue_splice(upromise_task_queue_t *dst, upromise_task_queue_t *src)
+{
+    if (src->head == NULL)
+        return;
+    if (dst->tail != NULL)
+        dst->tail->next = src->head;
+    else
+        dst->head = src->head;
+    dst->tail = src->tail;
+    src->head = NULL;
+    src->tail = NULL;
 }
 
 upromise_task_t *upromise_task_queue_pop(upromise_task_queue_t *queue)
 {
-    if (queue->head == queue->tail)
+    upromise_task_t *ret = queue->head;
+    if (ret == NULL)
+        return NULL;
+    queue->head = ret->next;
+    if (queue->head == NULL)
+        queue->tail = NULL;
+    return ret;
+}
+
+// run queue
+#define UPROMISE_RUN_QUEUE_INIT 256
+
+bool init_upromise_run_queue(upromise_run_queue_t *queue)
+{
+    queue->tasks = malloc(UPROMISE_RUN_QUEUE_INIT * sizeof(upromise_task_t));
+    if (queue->tasks == NULL)
+        return false;
+    queue->mask = UPROMISE_RUN_QUEUE_INIT - 1;
+    queue->head = 0;
+    queue->size = 0;
+    return true;
+}
+
+void clear_upromise_run_queue(upromise_run_queue_t *queue)
+{
+    free(queue->tasks);
+    queue->tasks = NULL;
+    queue->mask = 0;
+    queue->head = 0;
+    queue->size = 0;
+}
+
+// false when the buffer cannot grow, it is left as it was
+static bool upromise_run_queue_grow(upromise_run_queue_t *queue)
+{
+    size_t cap = queue->mask + 1;
+    upromise_task_t *tasks = realloc(queue->tasks, 2 * cap * sizeof(upromise_task_t));
+    if (tasks == NULL)
+        return false;
+    queue->tasks = tasks;
+    // unwrap the part that sat in front of head
+    if (queue->head + queue->size > cap)
+        memcpy(queue->tasks + cap, queue->tasks, (queue->head + queue->size - cap) * sizeof(upromise_task_t));
+    queue->mask = 2 * cap - 1;
+    return true;
+}
+
+// NULL when the queue is full and cannot grow
+static upromise_task_t *upromise_run_queue_back(upromise_run_queue_t *queue)
+{
+    if (queue->size > queue->mask && !upromise_run_queue_grow(queue))
         return NULL;
-    upromise_task_t *ret = queue->head->next;
-    queue->head->next = ret->next;
-    if (ret->next == NULL)
+    upromise_task_t *slot = &queue->tasks[(queue->head + queue->size) & queue->mask];
+    queue->size += 1;
+    return slot;
+}
+
+// a task that has to run: nothing waiting on it would learn that it was
+// dropped, so there is no way on but to stop
+static upromise_task_t *upromise_run_queue_need(upromise_task_t *slot)
+{
+    if (slot == NULL)
+        abort();
+    return slot;
+}
+
+static upromise_task_t *upromise_run_queue_front(upromise_run_queue_t *queue)
+{
+    if (queue->size > queue->mask && !upromise_run_queue_grow(queue))
+        return NULL;
+    queue->head = (queue->head - 1) & queue->mask;
+    queue->size += 1;
+    return &queue->tasks[queue->head];
+}
+
+int upromise_run_queue_try_push(upromise_run_queue_t *queue, upromise_task_fn fn, intptr_t co, void *extra)
+{
+    upromise_task_t *slot = upromise_run_queue_back(queue);
+    if (slot == NULL)
+        return 0;
+    slot->next = NULL;
+    slot->fn = fn;
+    slot->co = co;
+    slot->extra = extra;
+    return 1;
+}
+
+void upromise_run_queue_push(upromise_run_queue_t *queue, upromise_task_fn fn, intptr_t co, void *extra)
+{
+    upromise_task_t *slot = upromise_run_queue_need(upromise_run_queue_back(queue));
+    slot->next = NULL;
+    slot->fn = fn;
+    slot->co = co;
+    slot->extra = extra;
+}
+
+void upromise_run_queue_push_immediately(upromise_run_queue_t *queue, upromise_task_fn fn, intptr_t co, void *extra)
+{
+    upromise_task_t *slot = upromise_run_queue_need(upromise_run_queue_front(queue));
+    slot->next = NULL;
+    slot->fn = fn;
+    slot->co = co;
+    slot->extra = extra;
+}
+
+// queue every node of `src` behind one record in O(1)
+void upromise_run_queue_splice(upromise_run_queue_t *queue, upromise_task_queue_t *src)
+{
+    if (src->head == NULL)
+        return;
+    upromise_task_t *slot = upromise_run_queue_need(upromise_run_queue_back(queue));
+    slot->next = src->head;
+    slot->fn = NULL;
+    slot->co = -1;
+    slot->extra = NULL;
+    src->head = NULL;
+    src->tail = NULL;
+}
+
+int upromise_run_queue_pop(upromise_run_queue_t *queue, upromise_task_t *task)
+{
+    if (queue->size == 0)
+        return 0;
+    *task = queue->tasks[queue->head];
+    queue->head = (queue->head + 1) & queue->mask;
+    queue->size -= 1;
+    return 1;
+}
+
+// inbox
+void init_upromise_inbox(upromise_inbox_t *inbox)
+{
+    inbox->stub.next = NULL;
+    inbox->head = &inbox->stub;
+    inbox->tail = &inbox->stub;
+}
+
+void upromise_inbox_push(upromise_inbox_t *inbox, upromise_task_t *task)
+{
+    __atomic_store_n(&task->next, NULL, __ATOMIC_RELAXED);
+    upromise_task_t *prev = __atomic_exchange_n(&inbox->head, task, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, task, __ATOMIC_RELEASE);
+}
+
+// NULL when empty, or when a producer is half way through a push
+upromise_task_t *upromise_inbox_pop(upromise_inbox_t *inbox)
+{
+    upromise_task_t *tail = inbox->tail;
+    upromise_task_t *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (tail == &inbox->stub)
     {
-        queue->tail = queue->head;
+        if (next == NULL)
+            return NULL;
+        inbox->tail = next;
+        tail = next;
+        next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
     }
-    return ret;
+    if (next != NULL)
+    {
+        inbox->tail = next;
+        return tail;
+    }
+    if (tail != __atomic_load_n(&inbox->head, __ATOMIC_ACQUIRE))
+        return NULL;
+    upromise_inbox_push(inbox, &inbox->stub);
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (next == NULL)
+        return NULL;
+    inbox->tail = next;
+    return tail;
+}
+
+// move posted tasks onto the run queue, returns how many
+size_t upromise_dispatcher_drain_inbox(upromise_dispatcher_t *dispatcher)
+{
+    size_t count = 0;
+    upromise_task_t *task;
+    while ((task = upromise_inbox_pop(&dispatcher->inbox)) != NULL)
+    {
+        upromise_run_queue_push(&dispatcher->lanes[UPROMISE_PRIORITY_NORMAL], task->fn, -1, task->extra);
+        free(task);
+        count += 1;
+    }
+    return count;
+}
+
+bool upromise_inbox_empty(upromise_inbox_t *inbox)
+{
+    return inbox->tail == &inbox->stub && __atomic_load_n(&inbox->head, __ATOMIC_SEQ_CST) == &inbox->stub;
+}
+
+// waker
+// Without a wake fd a park could only end by its timeout, so a dispatcher
+// that cannot get one is not created at all.
+bool init_upromise_waker(upromise_dispatcher_t *dispatcher)
+{
+    dispatcher->sleeping = 0;
+    dispatcher->stop = 0;
+#ifdef __linux__
+    dispatcher->wake_fd[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    dispatcher->wake_fd[1] = dispatcher->wake_fd[0];
+    return dispatcher->wake_fd[0] >= 0;
+#else
+    if (pipe(dispatcher->wake_fd) != 0)
+        return false;
+    int i;
+    for (i = 0; i < 2; i++)
+    {
+        fcntl(dispatcher->wake_fd[i], F_SETFL, fcntl(dispatcher->wake_fd[i], F_GETFL) | O_NONBLOCK);
+        fcntl(dispatcher->wake_fd[i], F_SETFD, FD_CLOEXEC);
+    }
+    return true;
+#endif
+}
+
+void clear_upromise_waker(upromise_dispatcher_t *dispatcher)
+{
+    close(dispatcher->wake_fd[0]);
+    if (dispatcher->wake_fd[1] != dispatcher->wake_fd[0])
+        close(dispatcher->wake_fd[1]);
+}
+
+void upromise_dispatcher_wake(upromise_dispatcher_t *dispatcher)
+{
+    if (!__atomic_load_n(&dispatcher->sleeping, __ATOMIC_SEQ_CST))
+        return;
+#ifdef __linux__
+    uint64_t one = 1;
+    ssize_t n = write(dispatcher->wake_fd[1], &one, sizeof(one));
+#else
+    char one = 1;
+    ssize_t n = write(dispatcher->wake_fd[1], &one, sizeof(one));
+#endif
+    (void)n; // a full pipe or counter already means "wake up"
+}
+
+// Sleep until posted work, a wake-up or `timeout_ms` (-1 for none). The
+// sleeping flag is published before the last look at the inbox, so a
+// post racing with this either is seen here or writes to the fd.
+void upromise_dispatcher_park(upromise_dispatcher_t *dispatcher, int timeout_ms)
+{
+    __atomic_store_n(&dispatcher->sleeping, 1, __ATOMIC_SEQ_CST);
+    if (upromise_inbox_empty(&dispatcher->inbox) && !__atomic_load_n(&dispatcher->stop, __ATOMIC_SEQ_CST))
+    {
+        if (dispatcher->reactor != NULL)
+            upromise_reactor_poll(dispatcher, timeout_ms);
+        else
+        {
+            struct pollfd pfd = {dispatcher->wake_fd[0], POLLIN, 0};
+            while (poll(&pfd, 1, timeout_ms) < 0 && errno == EINTR)
+                ;
+        }
+    }
+    __atomic_store_n(&dispatcher->sleeping, 0, __ATOMIC_SEQ_CST);
+    char buffer[64];
+    while (read(dispatcher->wake_fd[0], buffer, sizeof(buffer)) > 0)
+        ;
+}
+
+void upromise_dispatcher_post(upromise_dispatcher_t *dispatcher, upromise_task_fn fn, void *extra)
+{
+    // posted from any thread, so not from the dispatcher's pool
+    upromise_task_t *task = malloc(sizeof(upromise_task_t));
+    // there is no way to tell the poster, and a lost post would hang
+    // whatever waits on it
+    if (task == NULL)
+        abort();
+    task->fn = fn;
+    task->co = -1;
+    task->extra = extra;
+    upromise_inbox_push(&dispatcher->inbox, task);
+    upromise_dispatcher_wake(dispatcher);
 }
 
 // dispatcher
 upromise_dispatcher_t *new_upromise_dispatcher()
+{
+    upromise_dispatcher_options_t options = {UPROMISE_STACK_SHARED, 0, UPROMISE_IO_EPOLL};
+    return new_upromise_dispatcher_ex(&options);
+}
+
+upromise_dispatcher_t *new_upromise_dispatcher_ex(const upromise_dispatcher_options_t *options)
 {
     upromise_dispatcher_t *ret = malloc(sizeof(upromise_dispatcher_t));
-    ret->sch = coroutine_open();
-    init_upromise_task_queue(&ret->queue);
+    if (ret == NULL)
+        return NULL;
+    if (!init_upromise_waker(ret))
+    {
+        free(ret);
+        return NULL;
+    }
+    ret->sch = coroutine_open_ex(options->stack_mode, options->stack_size);
+    if (ret->sch == NULL)
+    {
+        clear_upromise_waker(ret);
+        free(ret);
+        return NULL;
+    }
+    ret->running = 0;
+    init_upromise_pool(&ret->pool);
+    int lane;
+    for (lane = 0; lane < UPROMISE_PRIORITY_COUNT; lane++)
+    {
+        if (!init_upromise_run_queue(&ret->lanes[lane]))
+        {
+            while (lane-- > 0)
+                clear_upromise_run_queue(&ret->lanes[lane]);
+            coroutine_close(ret->sch);
+            clear_upromise_waker(ret);
+            free(ret);
+            return NULL;
+        }
+        ret->starved[lane] = 0;
+    }
+    ret->priority = UPROMISE_PRIORITY_NORMAL;
+    init_upromise_inbox(&ret->inbox);
+    init_upromise_timer_wheel(&ret->timers);
+    ret->reactor = NULL;
+    ret->io_backend = options->io_backend;
     return ret;
 }
 
 void del_upromise_dispatcher(upromise_dispatcher_t *dispatcher)
 {
     coroutine_close(dispatcher->sch);
-    clear_upromise_task_queue(&dispatcher->queue);
+    // everything allocated on behalf of this dispatcher lives in its pool,
+    // including promises and tasks still pending, so release it in bulk
+    clear_upromise_pool(&dispatcher->pool);
+    int lane;
+    for (lane = 0; lane < UPROMISE_PRIORITY_COUNT; lane++)
+        clear_upromise_run_queue(&dispatcher->lanes[lane]);
+    upromise_task_t *task;
+    while ((task = upromise_inbox_pop(&dispatcher->inbox)) != NULL)
+        free(task);
+    clear_upromise_reactor(dispatcher);
+    clear_upromise_waker(dispatcher);
     free(dispatcher);
 }
 
+void upromise_dispatcher_run_task(upromise_dispatcher_t *dispatcher, upromise_task_t *task)
+{
+    upromise_task_t *node = task->next;
+    if (node != NULL)
+    {
+        // a spliced waiter list, the nodes are owned by their contexts
+        if (node->next != NULL)
+        {
+            upromise_task_t *rest = upromise_run_queue_need(upromise_run_queue_front(&dispatcher->lanes[dispatcher->priority]));
+            rest->next = node->next;
+            rest->fn = NULL;
+            rest->co = -1;
+            rest->extra = NULL;
+        }
+        task = node;
+    }
+    if (task->fn != NULL)
+        task->fn(task->extra);
+    else
+        coroutine_resume(dispatcher->sch, task->co);
+}
+
+// Take the next task from the most urgent lane, unless a less urgent one
+// has been passed over UPROMISE_PRIORITY_BOUND times. The task's lane
+// becomes the current class.
+static int upromise_dispatcher_pop(upromise_dispatcher_t *dispatcher, upromise_task_t *task)
+{
+    int chosen = -1;
+    int lane;
+    for (lane = 0; lane < UPROMISE_PRIORITY_COUNT; lane++)
+    {
+        if (dispatcher->lanes[lane].size == 0)
+            continue;
+        if (chosen < 0)
+            chosen = lane;
+        else if (dispatcher->starved[lane] >= UPROMISE_PRIORITY_BOUND)
+        {
+            chosen = lane;
+            break;
+        }
+    }
+    if (chosen < 0)
+        return 0;
+    for (lane = chosen + 1; lane < UPROMISE_PRIORITY_COUNT; lane++)
+        if (dispatcher->lanes[lane].size != 0)
+            dispatcher->starved[lane] += 1;
+    dispatcher->starved[chosen] = 0;
+    dispatcher->priority = (upromise_priority)chosen;
+    return upromise_run_queue_pop(&dispatcher->lanes[chosen], task);
+}
+
+static size_t upromise_dispatcher_queued(upromise_dispatcher_t *dispatcher)
+{
+    size_t size = 0;
+    int lane;
+    for (lane = 0; lane < UPROMISE_PRIORITY_COUNT; lane++)
+        size += dispatcher->lanes[lane].size;
+    return size;
+}
+
+upromise_priority upromise_dispatcher_set_priority(upromise_dispatcher_t *dispatcher, upromise_priority priority)
+{
+    upromise_priority old = dispatcher->priority;
+    dispatcher->priority = priority;
+    return old;
+}
+
+// pull in posted work, due timers and ready I/O once the run queue is empty
+bool upromise_dispatcher_refill(upromise_dispatcher_t *dispatcher)
+{
+    // work arriving from outside starts in the normal class
+    dispatcher->priority = UPROMISE_PRIORITY_NORMAL;
+    size_t count = upromise_dispatcher_drain_inbox(dispatcher);
+    count += upromise_dispatcher_expire_timers(dispatcher);
+    count += upromise_reactor_poll(dispatcher, 0);
+    return count != 0;
+}
+
+// Drain the queue up to the marker record the caller pushed in front with
+// upromise_run_queue_push_immediately(queue, NULL, -1, marker).
+void upromise_dispatcher_run_until(upromise_dispatcher_t *dispatcher, void *marker)
+{
+    upromise_task_t task;
+    upromise_priority priority = dispatcher->priority;
+    while (upromise_dispatcher_pop(dispatcher, &task))
+    {
+        if (task.next == NULL && task.fn == NULL && task.extra == marker)
+            break;
+        upromise_dispatcher_run_task(dispatcher, &task);
+    }
+    dispatcher->priority = priority;
+}
+
 void upromise_dispatcher_run(upromise_dispatcher_t *dispatcher)
+{
+    upromise_task_t task;
+    upromise_priority priority = dispatcher->priority;
+    dispatcher->running += 1;
+    while (upromise_dispatcher_pop(dispatcher, &task) ||
+           (upromise_dispatcher_refill(dispatcher) && upromise_dispatcher_pop(dispatcher, &task)))
+        upromise_dispatcher_run_task(dispatcher, &task);
+    dispatcher->running -= 1;
+    dispatcher->priority = priority;
+}
+
+#define UPROMISE_RUN_CLOCK_STRIDE 16
+
+static uint64_t upromise_clock_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static upromise_run_result_t upromise_dispatcher_run_budget(upromise_dispatcher_t *dispatcher, size_t max_tasks, uint64_t deadline)
+{
+    upromise_run_result_t ret = {0, 0, 0, -1};
+    upromise_task_t task;
+    upromise_priority priority = dispatcher->priority;
+    dispatcher->running += 1;
+    while (ret.ran < max_tasks &&
+           (upromise_dispatcher_pop(dispatcher, &task) ||
+            (upromise_dispatcher_refill(dispatcher) && upromise_dispatcher_pop(dispatcher, &task))))
+    {
+        upromise_dispatcher_run_task(dispatcher, &task);
+        ret.ran += 1;
+        if (deadline != 0 && ret.ran % UPROMISE_RUN_CLOCK_STRIDE == 0 && upromise_clock_ns() >= deadline)
+            break;
+    }
+    dispatcher->running -= 1;
+    dispatcher->priority = priority;
+    ret.queued = upromise_dispatcher_queued(dispatcher);
+    ret.remaining = ret.queued != 0 || !upromise_inbox_empty(&dispatcher->inbox);
+    ret.timeout_ms = upromise_dispatcher_timeout(dispatcher);
+    return ret;
+}
+
+upromise_run_result_t upromise_dispatcher_run_n(upromise_dispatcher_t *dispatcher, size_t max_tasks)
+{
+    return upromise_dispatcher_run_budget(dispatcher, max_tasks < 1 ? 1 : max_tasks, 0);
+}
+
+upromise_run_result_t upromise_dispatcher_run_for(upromise_dispatcher_t *dispatcher, uint64_t max_ns)
+{
+    uint64_t now = upromise_clock_ns();
+    return upromise_dispatcher_run_budget(dispatcher, SIZE_MAX, max_ns > UINT64_MAX - now ? UINT64_MAX : now + max_ns);
+}
+
+void upromise_dispatcher_run_forever(upromise_dispatcher_t *dispatcher)
 {
     while (true)
     {
-        upromise_task_t *task = upromise_task_queue_pop(&dispatcher->queue);
-        if (task == NULL)
+        upromise_dispatcher_run(dispatcher);
+        if (__atomic_exchange_n(&dispatcher->stop, 0, __ATOMIC_SEQ_CST))
             break;
-        coroutine_resume(dispatcher->sch, task->co);
-        free(task);
+        upromise_dispatcher_park(dispatcher, upromise_dispatcher_timeout(dispatcher));
     }
 }
 
+void upromise_dispatcher_stop(upromise_dispatcher_t *dispatcher)
+{
+    __atomic_store_n(&dispatcher->stop, 1, __ATOMIC_SEQ_CST);
+    upromise_dispatcher_wake(dispatcher);
+}
+
 // promise
+// Adoption merges the adopted promise into the adopting one, like a tail
+// call: the adopted promise (or the end of its chain) forwards to the
+// adopting one, which keeps the waiters and is settled through it. A loop
+// that resolves each step with the next one's promise keeps one pending
+// promise alive instead of a chain.
+//  - REDIRECT: resolved with a thenable, forwards and ignores settles
+//  - FORWARD: forwards, settles on it go to the end of the chain
+//  - ADOPTED: end of a chain, pending but only settled through FORWARD
+#define UPROMISE_PROMISE_STATE_REDIRECT 1
+#define UPROMISE_PROMISE_STATE_FORWARD 4
+#define UPROMISE_PROMISE_STATE_ADOPTED 5
+
 void *upromise_recurse_error = "[promise error] forbid recursively resolving itself";
 
 upromise_promise_t *new_upromise_promise(upromise_dispatcher_t *dispatcher, upromise_promise_fn fn, void *ctx)
 {
-    upromise_promise_t *ret = malloc(sizeof(upromise_promise_t));
+    upromise_promise_t *ret = upromise_pool_alloc(&dispatcher->pool, sizeof(upromise_promise_t));
+    if (ret == NULL)
+        return NULL; // fn never runs, ctx stays with the caller
     ret->rc = 0;
     ret->dispatcher = dispatcher;
     ret->state = UPROMISE_PROMISE_STATE_PENDING;
+    ret->priority = dispatcher->priority;
     ret->data = NULL;
     init_upromise_task_queue(&ret->queue);
     upromise_ref_count_inc(&ret->rc); // for return hold
@@ -105,113 +771,257 @@ upromise_promise_t *new_upromise_promise(upromise_dispatcher_t *dispatcher, upro
     return ret;
 }
 
+static void upromise_promise_collect(upromise_promise_t *promise, upromise_ref_count_t left);
+
 void del_upromise_promise(upromise_promise_t *promise)
 {
-    if (!upromise_ref_count_dec(&promise->rc))
+    upromise_ref_count_t left = upromise_ref_count_sub(&promise->rc);
+    if (left != 0)
+    {
+        if (promise->queue.head != NULL)
+            upromise_promise_collect(promise, left);
         return;
-    clear_upromise_task_queue(&promise->queue);
-    free(promise);
+    }
+    // waiters hold a reference, so the queue is empty here
+    if (promise->state == UPROMISE_PROMISE_STATE_REDIRECT || promise->state == UPROMISE_PROMISE_STATE_FORWARD)
+        del_upromise_promise((upromise_promise_t *)promise->data);
+    upromise_pool_free(&promise->dispatcher->pool, promise, sizeof(upromise_promise_t));
 }
 
-void resolve_upromise_promise(upromise_promise_t *promise, void *value)
+static bool upromise_promise_forwards(const upromise_promise_t *promise)
 {
-    if (promise->state != UPROMISE_PROMISE_STATE_PENDING)
-        return;
-    promise->data = value;
-    promise->state = UPROMISE_PROMISE_STATE_FULFILLED;
-    upromise_task_t *cur = upromise_task_queue_pop(&promise->queue);
-    while (cur != NULL)
+    return promise->state == UPROMISE_PROMISE_STATE_REDIRECT || promise->state == UPROMISE_PROMISE_STATE_FORWARD;
+}
+
+static bool upromise_promise_settled(const upromise_promise_t *promise)
+{
+    return promise->state == UPROMISE_PROMISE_STATE_FULFILLED || promise->state == UPROMISE_PROMISE_STATE_REJECTED;
+}
+
+// Lookups compress the path: every hop is pointed straight at the end of
+// the chain, so intermediate promises nobody else holds are freed here.
+upromise_promise_t *upromise_promise_target(upromise_promise_t *promise)
+{
+    upromise_promise_t *root = promise;
+    while (upromise_promise_forwards(root))
+        root = (upromise_promise_t *)root->data;
+    upromise_promise_t *held = NULL;
+    while (promise != root && promise->data != root)
     {
-        upromise_task_queue_push(&promise->dispatcher->queue, cur);
-        cur = upromise_task_queue_pop(&promise->queue);
+        upromise_promise_t *next = (upromise_promise_t *)promise->data;
+        upromise_ref_count_inc(&root->rc); // for redirect hold
+        promise->data = root;
+        // the hold on `next` is ours now, keep it until we stepped past
+        if (held != NULL)
+            del_upromise_promise(held);
+        held = next;
+        promise = next;
     }
+    if (held != NULL)
+        del_upromise_promise(held);
+    return root;
+}
+
+// the promise a resolve/reject on `promise` settles, NULL when it is
+// already resolved
+upromise_promise_t *upromise_promise_settle_target(upromise_promise_t *promise)
+{
+    if (promise->state == UPROMISE_PROMISE_STATE_PENDING)
+        return promise;
+    if (promise->state != UPROMISE_PROMISE_STATE_FORWARD)
+        return NULL;
+    promise = upromise_promise_target(promise);
+    return upromise_promise_settled(promise) ? NULL : promise;
+}
+
+static void upromise_promise_settle(upromise_promise_t *promise, void *data, upromise_promise_state state)
+{
+    promise->data = data;
+    promise->state = state;
+    upromise_run_queue_splice(&promise->dispatcher->lanes[promise->priority], &promise->queue);
+}
+
+void resolve_upromise_promise(upromise_promise_t *promise, void *value)
+{
+    promise = upromise_promise_settle_target(promise);
+    if (promise != NULL)
+        upromise_promise_settle(promise, value, UPROMISE_PROMISE_STATE_FULFILLED);
 }
 
 void reject_upromise_promise(upromise_promise_t *promise, void *reason)
 {
-    if (promise->state != UPROMISE_PROMISE_STATE_PENDING)
-        return;
-    promise->data = reason;
-    promise->state = UPROMISE_PROMISE_STATE_REJECTED;
-    upromise_task_t *cur = upromise_task_queue_pop(&promise->queue);
-    while (cur != NULL)
-    {
-        upromise_task_queue_push(&promise->dispatcher->queue, cur);
-        cur = upromise_task_queue_pop(&promise->queue);
-    }
+    promise = upromise_promise_settle_target(promise);
+    if (promise != NULL)
+        upromise_promise_settle(promise, reason, UPROMISE_PROMISE_STATE_REJECTED);
+}
+
+typedef struct settle_context
+{
+    upromise_promise_t *promise;
+    void *data;
+    upromise_promise_state state;
+} settle_context;
+
+void settle_task_fn(void *ctx_raw)
+{
+    settle_context *ctx = (settle_context *)ctx_raw;
+    if (ctx->state == UPROMISE_PROMISE_STATE_FULFILLED)
+        resolve_upromise_promise(ctx->promise, ctx->data);
+    else
+        reject_upromise_promise(ctx->promise, ctx->data);
+    del_upromise_promise(ctx->promise);
+    free(ctx);
+}
+
+void settle_upromise_promise_threadsafe(upromise_promise_t *promise, void *data, upromise_promise_state state)
+{
+    settle_context *ctx = malloc(sizeof(settle_context));
+    // as for a post, a settle that never arrives would hang the waiters
+    if (ctx == NULL)
+        abort();
+    ctx->promise = promise;
+    ctx->data = data;
+    ctx->state = state;
+    upromise_dispatcher_post(promise->dispatcher, settle_task_fn, ctx);
+}
+
+void resolve_upromise_promise_threadsafe(upromise_promise_t *promise, void *value)
+{
+    settle_upromise_promise_threadsafe(promise, value, UPROMISE_PROMISE_STATE_FULFILLED);
+}
+
+void reject_upromise_promise_threadsafe(upromise_promise_t *promise, void *reason)
+{
+    settle_upromise_promise_threadsafe(promise, reason, UPROMISE_PROMISE_STATE_REJECTED);
 }
 
 typedef struct then_context
 {
+    upromise_task_t task; // the waiter node, no separate allocation
     upromise_promise_t *wait_promise;
     upromise_promise_t *next_promise;
     void *onFulfilled;
     void *onRejected;
     void *ctx;
+    upromise_then_release_fn release; // for ctx when the waiter is taken back
     bool fulfilled_thenable;
     bool rejected_thenable;
 } then_context;
 
-#define UPROMISE_PROMISE_STATE_REDIRECT 1
+// While `next_promise` is pending its data points back at the context, so
+// a cancel on it can find the waiter; cleared before the context goes.
+static void then_context_unlink(then_context *ctx)
+{
+    upromise_promise_t *next = ctx->next_promise;
+    if ((next->state == UPROMISE_PROMISE_STATE_PENDING || next->state == UPROMISE_PROMISE_STATE_ADOPTED) && next->data == ctx)
+        next->data = NULL;
+}
 
 void resolve_upromise_promise_thenable(upromise_promise_t *promise, upromise_promise_t *value)
 {
-    if (promise->state != UPROMISE_PROMISE_STATE_PENDING)
-        return;
-    if (promise == value)
+    upromise_promise_t *root = upromise_promise_settle_target(promise);
+    if (root == NULL)
     {
-        reject_upromise_promise(promise, upromise_recurse_error);
+        del_upromise_promise(value);
         return;
     }
-    upromise_promise_t *aim = value;
-    if (aim->state == UPROMISE_PROMISE_STATE_REDIRECT)
+    upromise_promise_t *aim = upromise_promise_target(value);
+    if (aim == root)
     {
-        aim = (upromise_promise_t *)aim->data;
+        upromise_promise_settle(root, upromise_recurse_error, UPROMISE_PROMISE_STATE_REJECTED);
+        del_upromise_promise(value);
+        return;
     }
-    upromise_task_queue_t *queue;
-    if (aim->state == UPROMISE_PROMISE_STATE_PENDING)
-    {
+    // from here on only `value` settles it
+    if (promise == root)
+        promise->state = UPROMISE_PROMISE_STATE_ADOPTED;
+    else
         promise->state = UPROMISE_PROMISE_STATE_REDIRECT;
-        promise->data = aim;
-        queue = &aim->queue;
-    }
+    if (upromise_promise_settled(aim))
+        upromise_promise_settle(root, aim->data, aim->state);
     else
     {
-        promise->state = aim->state;
-        promise->data = aim->data;
-        aim = promise;
-        queue = &promise->dispatcher->queue;
+        // Waiters are moved as a whole. They look up the settled promise
+        // through the forward when they run, so none of them is touched here.
+        upromise_task_queue_splice(&root->queue, &aim->queue);
+        aim->state = aim->state == UPROMISE_PROMISE_STATE_ADOPTED ? UPROMISE_PROMISE_STATE_REDIRECT : UPROMISE_PROMISE_STATE_FORWARD;
+        aim->data = root;
+        upromise_ref_count_inc(&root->rc); // for forward hold
     }
-    upromise_task_t *cur = upromise_task_queue_pop(&promise->queue);
-    while (cur != NULL)
+    del_upromise_promise(value);
+}
+
+// A pending promise whose only holders are its own then() waiters can no
+// longer be settled or waited on by anyone else, yet the waiters keep it
+// alive and it keeps them: a leak once its resolve functions are dropped.
+// The waiters are taken back as if by a cancel, which frees the promise
+// with the last of them and may in turn collect the promises they feed.
+// The count is the exact one our decrement left, so no other thread can
+// reach the promise when it matches.
+void then_task_fn(void *ctx_raw);
+
+static void upromise_promise_collect(upromise_promise_t *promise, upromise_ref_count_t left)
+{
+    if (promise->state != UPROMISE_PROMISE_STATE_PENDING && promise->state != UPROMISE_PROMISE_STATE_ADOPTED)
+        return;
+    // any other kind of waiter may still settle or need the promise
+    upromise_ref_count_t waiters = 0;
+    upromise_task_t *task;
+    for (task = promise->queue.head; task != NULL; task = task->next)
     {
-        ((then_context *)cur->extra)->wait_promise = aim;
-        upromise_task_queue_push(queue, cur);
-        cur = upromise_task_queue_pop(&promise->queue);
+        if (task->fn != then_task_fn || ((then_context *)task->extra)->wait_promise != promise)
+            return;
+        waiters += 1;
+    }
+    if (waiters != left)
+        return;
+    // with the queue emptied first the dels below do not come back here
+    upromise_pool_t *pool = &promise->dispatcher->pool;
+    task = promise->queue.head;
+    init_upromise_task_queue(&promise->queue);
+    while (task != NULL)
+    {
+        then_context *ctx = (then_context *)task->extra;
+        task = task->next;
+        then_context_unlink(ctx);
+        if (ctx->release != NULL)
+            ctx->release(ctx->ctx);
+        upromise_promise_t *next = ctx->next_promise;
+        upromise_pool_free(pool, ctx, sizeof(then_context));
+        del_upromise_promise(next);
+        del_upromise_promise(promise);
     }
-    del_upromise_promise(value);
 }
 
-void then_task_fn(struct schedule *sch, void *ctx_raw)
+// then-callbacks never suspend by themselves, so they run inline on the
+// dispatcher loop instead of inside a coroutine
+void then_task_fn(void *ctx_raw)
 {
     then_context *ctx = (then_context *)ctx_raw;
     void *ret = NULL;
     void *error = NULL;
 
-    void *origin_data = ctx->wait_promise->data;
-    upromise_promise_state origin_state = ctx->wait_promise->state;
+    upromise_promise_t *settled = upromise_promise_target(ctx->wait_promise);
+    void *origin_data = settled->data;
+    upromise_promise_state origin_state = settled->state;
     void *callback_ctx = ctx->ctx;
+    void *onFulfilled = ctx->onFulfilled;
+    void *onRejected = ctx->onRejected;
+    bool fulfilled_thenable = ctx->fulfilled_thenable;
+    bool rejected_thenable = ctx->rejected_thenable;
+    upromise_then_release_fn release = ctx->release;
     del_upromise_promise(ctx->wait_promise);
     upromise_promise_t *next_promise = ctx->next_promise;
-    free(ctx);
+    then_context_unlink(ctx);
+    upromise_pool_free(&next_promise->dispatcher->pool, ctx, sizeof(then_context));
 
     if (origin_state == UPROMISE_PROMISE_STATE_FULFILLED)
     {
-        if (ctx->onFulfilled != NULL)
+        if (onFulfilled != NULL)
         {
-            if (ctx->fulfilled_thenable)
+            if (fulfilled_thenable)
             {
-                upromise_promise_t *next = ((upromise_promise_then_fn_thenable)ctx->onFulfilled)(origin_data, &error, callback_ctx);
+                upromise_promise_t *next = ((upromise_promise_then_fn_thenable)onFulfilled)(origin_data, &error, callback_ctx);
                 if (error == NULL)
                 {
                     resolve_upromise_promise_thenable(next_promise, next);
@@ -220,18 +1030,18 @@ void then_task_fn(struct schedule *sch, void *ctx_raw)
                 }
             }
             else
-                ret = ((upromise_promise_then_fn)ctx->onFulfilled)(origin_data, &error, callback_ctx);
+                ret = ((upromise_promise_then_fn)onFulfilled)(origin_data, &error, callback_ctx);
         }
         else
             ret = origin_data;
     }
     else if (origin_state == UPROMISE_PROMISE_STATE_REJECTED)
     {
-        if (ctx->onRejected != NULL)
+        if (onRejected != NULL)
         {
-            if (ctx->rejected_thenable)
+            if (rejected_thenable)
             {
-                upromise_promise_t *next = ((upromise_promise_then_fn_thenable)ctx->onRejected)(origin_data, &error, callback_ctx);
+                upromise_promise_t *next = ((upromise_promise_then_fn_thenable)onRejected)(origin_data, &error, callback_ctx);
                 if (error == NULL)
                 {
                     resolve_upromise_promise_thenable(next_promise, next);
@@ -240,15 +1050,14 @@ void then_task_fn(struct schedule *sch, void *ctx_raw)
                 }
             }
             else
-                ret = ((upromise_promise_then_fn)ctx->onRejected)(origin_data, &error, callback_ctx);
+                ret = ((upromise_promise_then_fn)onRejected)(origin_data, &error, callback_ctx);
         }
         else
             error = origin_data;
     }
-    else
-    {
-        int debug = 1;
-    }
+    // a passed-through state runs no callback to consume the ctx
+    if (release != NULL && (origin_state == UPROMISE_PROMISE_STATE_FULFILLED ? onFulfilled : onRejected) == NULL)
+        release(callback_ctx);
     if (error != NULL)
         reject_upromise_promise(next_promise, error);
     else
@@ -258,45 +1067,135 @@ void then_task_fn(struct schedule *sch, void *ctx_raw)
 
 upromise_promise_t *upromise_promise_then_impl(upromise_promise_t *promise, void *ctx, void *onFulfilled, void *onRejected, bool fulfilled_thenable, bool rejected_thenable)
 {
-    if (promise->state == UPROMISE_PROMISE_STATE_REDIRECT)
-        promise = (upromise_promise_t *)promise->data;
-    upromise_promise_t *ret = malloc(sizeof(upromise_promise_t));
+    promise = upromise_promise_target(promise);
+    upromise_dispatcher_t *dispatcher = promise->dispatcher;
+    upromise_promise_t *ret = upromise_pool_alloc(&dispatcher->pool, sizeof(upromise_promise_t));
+    then_context *then_ctx = upromise_pool_alloc(&dispatcher->pool, sizeof(then_context));
+    if (ret == NULL || then_ctx == NULL)
+    {
+        if (ret != NULL)
+            upromise_pool_free(&dispatcher->pool, ret, sizeof(upromise_promise_t));
+        if (then_ctx != NULL)
+            upromise_pool_free(&dispatcher->pool, then_ctx, sizeof(then_context));
+        return NULL;
+    }
     ret->rc = 0;
-    ret->dispatcher = promise->dispatcher;
+    ret->dispatcher = dispatcher;
     ret->state = UPROMISE_PROMISE_STATE_PENDING;
+    ret->priority = dispatcher->priority;
     ret->data = NULL;
     init_upromise_task_queue(&ret->queue);
     upromise_ref_count_inc(&ret->rc);
 
-    then_context *then_ctx = malloc(sizeof(then_context));
     then_ctx->wait_promise = promise;
     then_ctx->next_promise = ret;
     then_ctx->onFulfilled = onFulfilled;
     then_ctx->onRejected = onRejected;
     then_ctx->ctx = ctx;
+    then_ctx->release = NULL;
     then_ctx->fulfilled_thenable = fulfilled_thenable;
     then_ctx->rejected_thenable = rejected_thenable;
     upromise_ref_count_inc(&promise->rc);
     upromise_ref_count_inc(&ret->rc);
+    ret->data = then_ctx;
 
-    upromise_task_t *task = malloc(sizeof(upromise_task_t));
-    task->co = coroutine_new(promise->dispatcher->sch, then_task_fn, then_ctx);
+    upromise_task_t *task = &then_ctx->task;
+    task->fn = then_task_fn;
+    task->co = -1;
     task->extra = then_ctx;
 
-    switch (promise->state)
-    {
-    case UPROMISE_PROMISE_STATE_PENDING:
+    if (!upromise_promise_settled(promise))
         upromise_task_queue_push(&promise->queue, task);
-        break;
-    case UPROMISE_PROMISE_STATE_FULFILLED:
-    case UPROMISE_PROMISE_STATE_REJECTED:
-        upromise_task_queue_push(&promise->dispatcher->queue, task);
-        break;
+    else if (!upromise_run_queue_try_push(&promise->dispatcher->lanes[promise->priority], then_task_fn, -1, then_ctx))
+    {
+        // nothing is queued yet, so the caller can still take it back
+        upromise_pool_free(&dispatcher->pool, then_ctx, sizeof(then_context));
+        upromise_pool_free(&dispatcher->pool, ret, sizeof(upromise_promise_t));
+        del_upromise_promise(promise);
+        return NULL;
     }
 
     return ret;
 }
 
+static void upromise_task_queue_unlink(upromise_task_queue_t *queue, upromise_task_t *prev, upromise_task_t *task)
+{
+    if (prev != NULL)
+        prev->next = task->next;
+    else
+        queue->head = task->next;
+    if (queue->tail == task)
+        queue->tail = prev;
+}
+
+// Take back the waiter then() left on `promise` while it is still pending:
+// no callback runs and `next` never settles, the callback ctx goes to the
+// release function if one was set and stays with the caller otherwise.
+// Returns 0 when the waiter is already queued to run. Scans the
+// waiters, which are few for the awaits this is used for.
+int upromise_promise_unthen(upromise_promise_t *promise, upromise_promise_t *next)
+{
+    upromise_promise_t *target = upromise_promise_target(promise);
+    if (upromise_promise_settled(target))
+        return 0;
+    upromise_task_t *prev = NULL;
+    upromise_task_t *task;
+    for (task = target->queue.head; task != NULL; prev = task, task = task->next)
+        if (task->fn == then_task_fn && ((then_context *)task->extra)->next_promise == next)
+            break;
+    if (task == NULL)
+        return 0;
+    upromise_task_queue_unlink(&target->queue, prev, task);
+    then_context *ctx = (then_context *)task->extra;
+    then_context_unlink(ctx);
+    if (ctx->release != NULL)
+        ctx->release(ctx->ctx);
+    del_upromise_promise(ctx->wait_promise);
+    del_upromise_promise(ctx->next_promise);
+    upromise_pool_free(&target->dispatcher->pool, ctx, sizeof(then_context));
+    return 1;
+}
+
+// Take back the waiter a then()-derived `promise` still has on the promise
+// it came from. Returns 0 when there is none or it is queued to run.
+int upromise_promise_untie(upromise_promise_t *promise)
+{
+    if (promise->state != UPROMISE_PROMISE_STATE_PENDING || promise->data == NULL)
+        return 0;
+    then_context *ctx = (then_context *)promise->data;
+    return upromise_promise_unthen(ctx->wait_promise, promise);
+}
+
+void upromise_promise_then_release(upromise_promise_t *next, upromise_then_release_fn release)
+{
+    if (next->state == UPROMISE_PROMISE_STATE_PENDING && next->data != NULL)
+        ((then_context *)next->data)->release = release;
+}
+
+// A bare waiter: `task` is the caller's node and runs in the lane of the
+// pending `promise` once it settles, with no then() in between.
+void upromise_promise_wait(upromise_promise_t *promise, upromise_task_t *task)
+{
+    upromise_task_queue_push(&upromise_promise_target(promise)->queue, task);
+}
+
+// Take back a waiter queued by upromise_promise_wait. Returns 0 when it is
+// already queued to run.
+int upromise_promise_unwait(upromise_promise_t *promise, upromise_task_t *task)
+{
+    upromise_promise_t *target = upromise_promise_target(promise);
+    if (upromise_promise_settled(target))
+        return 0;
+    upromise_task_t *prev = NULL;
+    upromise_task_t *node;
+    for (node = target->queue.head; node != NULL && node != task; prev = node, node = node->next)
+        ;
+    if (node == NULL)
+        return 0;
+    upromise_task_queue_unlink(&target->queue, prev, task);
+    return 1;
+}
+
 upromise_promise_t *upromise_promise_then(upromise_promise_t *promise, void *ctx, upromise_promise_then_fn onFulfilled, upromise_promise_then_fn onRejected)
 {
     return upromise_promise_then_impl(promise, ctx, onFulfilled, onRejected, false, false);
@@ -309,10 +1208,203 @@ upromise_promise_t *upromise_promise_then_thenable_common(upromise_promise_t *pr
 
 upromise_promise_t *upromise_promise_then_common_thenable(upromise_promise_t *promise, void *ctx, upromise_promise_then_fn onFulfilled, upromise_promise_then_fn_thenable onRejected)
 {
-    upromise_promise_then_impl(promise, ctx, onFulfilled, onRejected, false, true);
+    return upromise_promise_then_impl(promise, ctx, onFulfilled, onRejected, false, true);
 }
 
 upromise_promise_t *upromise_promise_then_thenable(upromise_promise_t *promise, void *ctx, upromise_promise_then_fn_thenable onFulfilled, upromise_promise_then_fn_thenable onRejected)
 {
-    upromise_promise_then_impl(promise, ctx, onFulfilled, onRejected, true, true);
+    return upromise_promise_then_impl(promise, ctx, onFulfilled, onRejected, true, true);
+}
+
+// combinators
+// One block per call: the waiter nodes sit in the inputs' queues like
+// then_context does, and inputs are only read once the last one settled.
+typedef enum combinator_kind
+{
+    COMBINATOR_ALL,
+    COMBINATOR_ALL_SETTLED,
+    COMBINATOR_RACE,
+    COMBINATOR_ANY,
+} combinator_kind;
+
+struct combinator_context;
+
+typedef struct combinator_waiter
+{
+    upromise_task_t task;
+    struct combinator_context *ctx;
+    upromise_promise_t *promise;
+} combinator_waiter;
+
+typedef struct combinator_context
+{
+    upromise_promise_t *result;
+    combinator_kind kind;
+    size_t count;
+    size_t settled;
+    combinator_waiter waiters[];
+} combinator_context;
+
+void *upromise_nomem_error = "[promise error] out of memory";
+
+// NULL when the array cannot be allocated; no larger than the waiters, so
+// the size does not overflow
+static void *combinator_collect(combinator_context *ctx)
+{
+    size_t i;
+    size_t count = ctx->count != 0 ? ctx->count : 1;
+    if (ctx->kind == COMBINATOR_ALL_SETTLED)
+    {
+        upromise_settled_t *ret = malloc(count * sizeof(upromise_settled_t));
+        if (ret == NULL)
+            return NULL;
+        for (i = 0; i < ctx->count; i++)
+        {
+            upromise_promise_t *settled = upromise_promise_target(ctx->waiters[i].promise);
+            ret[i].state = settled->state;
+            ret[i].data = settled->data;
+        }
+        return ret;
+    }
+    void **ret = malloc(count * sizeof(void *));
+    if (ret == NULL)
+        return NULL;
+    for (i = 0; i < ctx->count; i++)
+        ret[i] = upromise_promise_target(ctx->waiters[i].promise)->data;
+    return ret;
+}
+
+// settle the result with the collected array
+static void combinator_finish(combinator_context *ctx, bool fulfil)
+{
+    void *collected = combinator_collect(ctx);
+    if (collected == NULL)
+        reject_upromise_promise(ctx->result, upromise_nomem_error);
+    else if (fulfil)
+        resolve_upromise_promise(ctx->result, collected);
+    else
+        reject_upromise_promise(ctx->result, collected);
+}
+
+static void combinator_free(combinator_context *ctx)
+{
+    size_t i;
+    for (i = 0; i < ctx->count; i++)
+        del_upromise_promise(ctx->waiters[i].promise);
+    del_upromise_promise(ctx->result);
+    free(ctx);
+}
+
+static void combinator_task_fn(void *extra)
+{
+    combinator_waiter *waiter = (combinator_waiter *)extra;
+    combinator_context *ctx = waiter->ctx;
+    upromise_promise_t *settled = upromise_promise_target(waiter->promise);
+    bool last = ++ctx->settled == ctx->count;
+    bool fulfilled = settled->state == UPROMISE_PROMISE_STATE_FULFILLED;
+    if (ctx->result->state == UPROMISE_PROMISE_STATE_PENDING)
+    {
+        switch (ctx->kind)
+        {
+        case COMBINATOR_ALL:
+            if (!fulfilled)
+                reject_upromise_promise(ctx->result, settled->data);
+            else if (last)
+                combinator_finish(ctx, true);
+            break;
+        case COMBINATOR_ALL_SETTLED:
+            if (last)
+                combinator_finish(ctx, true);
+            break;
+        case COMBINATOR_RACE:
+            if (fulfilled)
+                resolve_upromise_promise(ctx->result, settled->data);
+            else
+                reject_upromise_promise(ctx->result, settled->data);
+            break;
+        case COMBINATOR_ANY:
+            if (fulfilled)
+                resolve_upromise_promise(ctx->result, settled->data);
+            else if (last)
+                combinator_finish(ctx, false);
+            break;
+        }
+    }
+    if (last)
+        combinator_free(ctx);
+}
+
+static void combinator_promise_fn(upromise_promise_t *promise, void *ctx_raw)
+{
+    combinator_context *ctx = (combinator_context *)ctx_raw;
+    ctx->result = promise; // the fn hold goes to the block
+}
+
+static void combinator_nomem_fn(upromise_promise_t *promise, void *ctx_raw)
+{
+    reject_upromise_promise(promise, upromise_nomem_error);
+    del_upromise_promise(promise);
+}
+
+static upromise_promise_t *upromise_promise_combine(upromise_dispatcher_t *dispatcher, upromise_promise_t **promises, size_t count, combinator_kind kind)
+{
+    combinator_context *ctx = NULL;
+    if (count <= (SIZE_MAX - sizeof(combinator_context)) / sizeof(combinator_waiter))
+        ctx = malloc(sizeof(combinator_context) + count * sizeof(combinator_waiter));
+    if (ctx == NULL)
+        return new_upromise_promise(dispatcher, combinator_nomem_fn, NULL);
+    ctx->kind = kind;
+    ctx->count = count;
+    ctx->settled = 0;
+    upromise_promise_t *ret = new_upromise_promise(dispatcher, combinator_promise_fn, ctx);
+    if (ret == NULL)
+    {
+        free(ctx);
+        return NULL;
+    }
+    if (count == 0)
+    {
+        // nothing to wait for: race never settles, the others settle now
+        if (kind != COMBINATOR_RACE)
+            combinator_finish(ctx, kind != COMBINATOR_ANY);
+        combinator_free(ctx);
+        return ret;
+    }
+    size_t i;
+    for (i = 0; i < count; i++)
+    {
+        combinator_waiter *waiter = &ctx->waiters[i];
+        upromise_promise_t *promise = upromise_promise_target(promises[i]);
+        waiter->ctx = ctx;
+        waiter->promise = promise;
+        upromise_ref_count_inc(&promise->rc);
+        waiter->task.fn = combinator_task_fn;
+        waiter->task.co = -1;
+        waiter->task.extra = waiter;
+        if (upromise_promise_settled(promise))
+            upromise_run_queue_push(&promise->dispatcher->lanes[promise->priority], combinator_task_fn, -1, waiter);
+        else
+            upromise_task_queue_push(&promise->queue, &waiter->task);
+    }
+    return ret;
+}
+
+upromise_promise_t *upromise_promise_all(upromise_dispatcher_t *dispatcher, upromise_promise_t **promises, size_t count)
+{
+    return upromise_promise_combine(dispatcher, promises, count, COMBINATOR_ALL);
+}
+
+upromise_promise_t *upromise_promise_all_settled(upromise_dispatcher_t *dispatcher, upromise_promise_t **promises, size_t count)
+{
+    return upromise_promise_combine(dispatcher, promises, count, COMBINATOR_ALL_SETTLED);
+}
+
+upromise_promise_t *upromise_promise_race(upromise_dispatcher_t *dispatcher, upromise_promise_t **promises, size_t count)
+{
+    return upromise_promise_combine(dispatcher, promises, count, COMBINATOR_RACE);
+}
+
+upromise_promise_t *upromise_promise_any(upromise_dispatcher_t *dispatcher, upromise_promise_t **promises, size_t count)
+{
+    return upromise_promise_combine(dispatcher, promises, count, COMBINATOR_ANY);
 }
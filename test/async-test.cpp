@@ -41,7 +41,7 @@ TEST_CASE("async/await demo", "[async]")
 
                 CHECK(*x == 0);
                 fn();
-                CHECK(*x == 2);
+                CHECK(*x == 3);
 
                 adapter.resolved(dummy).then(
                     [=](void *) -> void *
@@ -628,3 +628,509 @@ TEST_CASE("async-generator demo", "[async]")
 
     EPILOGUE;
 }
+
+static void *deep_await(upromise::AsyncContext ctx, upromise::Promise promise, int depth)
+{
+    char frame[512];
+    frame[0] = (char)depth;
+    if (depth > 0)
+        return deep_await(ctx, promise, depth - 1);
+    void *ret = ctx.await(promise);
+    CHECK(frame[0] == 0);
+    return ret;
+}
+
+TEST_CASE("dedicated stack dispatcher", "[async]")
+{
+    upromise_dispatcher_options_t options = {UPROMISE_STACK_DEDICATED, 0, UPROMISE_IO_EPOLL};
+    auto dispatcher = std::make_shared<upromise::Dispatcher>(options);
+    auto adapter = Adapter(dispatcher);
+
+    auto d = adapter.deferred();
+    auto x = Int(0);
+    auto seen = Int(0);
+    auto fn = upromise::async(
+        dispatcher,
+        [=](upromise::AsyncContext ctx, int n) -> void *
+        {
+            void *ret = deep_await(ctx, d.promise, 64);
+            *x += n;
+            return ret;
+        });
+
+    adapter.resolved(dummy).then(
+        [=](void *) -> void *
+        {
+            for (int i = 1; i <= 8; i++)
+                fn(i).then(
+                    [=](void *data) -> void *
+                    {
+                        CHECK(data == dummy);
+                        *seen += 1;
+                        return nullptr;
+                    });
+            return nullptr;
+        });
+    dispatcher->run();
+    CHECK(*x == 0);
+
+    d.resolve(dummy);
+    dispatcher->run();
+    CHECK(*x == 36);
+    CHECK(*seen == 8);
+}
+
+static void *never_runs(upromise_async_context_t *, void **, void *ctx)
+{
+    *(int *)ctx += 1;
+    return nullptr;
+}
+
+TEST_CASE("dedicated stacks run out", "[async]")
+{
+    // no address space has room for a stack this large, so every
+    // coroutine_new fails while the rest of the dispatcher works
+    upromise_dispatcher_options_t options = {UPROMISE_STACK_DEDICATED, (size_t)1 << 50, UPROMISE_IO_EPOLL};
+    auto dispatcher = std::make_shared<upromise::Dispatcher>(options);
+    int ran = 0;
+
+    SECTION("async bodies")
+    {
+        CHECK(upromise_async(dispatcher->dispatcher, never_runs, &ran) == nullptr);
+        auto token = upromise::CancelToken(dispatcher);
+        CHECK(upromise_async_cancellable(dispatcher->dispatcher, token.impl(), never_runs, &ran) == nullptr);
+        CHECK(token.impl()->links == nullptr);
+        auto fn = upromise::async(dispatcher, [](upromise::AsyncContext) -> void * { return nullptr; });
+        CHECK_THROWS_AS(fn(), std::bad_alloc);
+    }
+
+    SECTION("generators")
+    {
+        CHECK_THROWS_AS(upromise::Generator(dispatcher, [](upromise::Generator *) -> void * { return nullptr; }), std::bad_alloc);
+        CHECK_THROWS_AS(upromise::AsyncGenerator(dispatcher, [](upromise::AsyncGenerator *) -> void * { return nullptr; }), std::bad_alloc);
+    }
+
+    dispatcher->run();
+    CHECK(ran == 0);
+}
+
+static void count_and_yield(struct schedule *sch, void *ud)
+{
+    *(int *)ud += 1;
+    coroutine_yield(sch);
+    *(int *)ud += 1;
+}
+
+TEST_CASE("coroutine ids", "[async]")
+{
+    struct schedule *sch = coroutine_open();
+    int counter = 0;
+
+    SECTION("stale id after the slot is reused")
+    {
+        intptr_t first = coroutine_new(sch, count_and_yield, &counter);
+        coroutine_resume(sch, first);
+        coroutine_resume(sch, first);
+        CHECK(coroutine_status(sch, first) == COROUTINE_DEAD);
+
+        intptr_t second = coroutine_new(sch, count_and_yield, &counter);
+        CHECK(second != first);
+        CHECK(coroutine_status(sch, first) == COROUTINE_DEAD);
+        CHECK(coroutine_status(sch, second) == COROUTINE_READY);
+        coroutine_resume(sch, first);
+        CHECK(counter == 2);
+        CHECK(coroutine_status(sch, second) == COROUTINE_READY);
+    }
+
+    SECTION("stale id outlives many reuses of its slot")
+    {
+        intptr_t stale = coroutine_new(sch, count_and_yield, &counter);
+        coroutine_resume(sch, stale);
+        coroutine_resume(sch, stale);
+        for (int i = 0; i < 1000; i++)
+        {
+            intptr_t id = coroutine_new(sch, count_and_yield, &counter);
+            CHECK(id != stale);
+            CHECK(coroutine_status(sch, stale) == COROUTINE_DEAD);
+            coroutine_resume(sch, stale);
+            CHECK(coroutine_status(sch, id) == COROUTINE_READY);
+            coroutine_resume(sch, id);
+            coroutine_resume(sch, id);
+        }
+        CHECK(counter == 2002);
+    }
+
+    SECTION("many live coroutines")
+    {
+        std::vector<intptr_t> ids;
+        for (int i = 0; i < 100000; i++)
+            ids.push_back(coroutine_new(sch, count_and_yield, &counter));
+        for (intptr_t id : ids)
+            coroutine_resume(sch, id);
+        CHECK(counter == 100000);
+        for (intptr_t id : ids)
+            CHECK(coroutine_status(sch, id) == COROUTINE_SUSPEND);
+        for (intptr_t id : ids)
+            coroutine_resume(sch, id);
+        CHECK(counter == 200000);
+        for (intptr_t id : ids)
+            CHECK(coroutine_status(sch, id) == COROUTINE_DEAD);
+    }
+
+    coroutine_close(sch);
+}
+
+struct TransferTrace
+{
+    int to;
+    std::string trace;
+};
+
+static void transfer_from(struct schedule *sch, void *ud)
+{
+    auto state = (TransferTrace *)ud;
+    state->trace += "a";
+    coroutine_transfer(sch, state->to);
+    state->trace += "c";
+}
+
+static void transfer_to(struct schedule *sch, void *ud)
+{
+    auto state = (TransferTrace *)ud;
+    state->trace += "b";
+    coroutine_yield(sch);
+    state->trace += "d";
+}
+
+TEST_CASE("coroutine transfer", "[async]")
+{
+    for (int mode : {COROUTINE_STACK_SHARED, COROUTINE_STACK_DEDICATED})
+    {
+        INFO(mode);
+        struct schedule *sch = coroutine_open_ex(mode, 0);
+        TransferTrace state;
+        state.to = coroutine_new(sch, transfer_to, &state);
+        intptr_t from = coroutine_new(sch, transfer_from, &state);
+
+        // the target yields back to whoever resumed the transferring one
+        coroutine_resume(sch, from);
+        CHECK(state.trace == "ab");
+        CHECK(coroutine_running(sch) == -1);
+        CHECK(coroutine_status(sch, from) == COROUTINE_SUSPEND);
+        CHECK(coroutine_status(sch, state.to) == COROUTINE_SUSPEND);
+        coroutine_resume(sch, from);
+        CHECK(state.trace == "abc");
+        coroutine_resume(sch, state.to);
+        CHECK(state.trace == "abcd");
+        CHECK(coroutine_status(sch, from) == COROUTINE_DEAD);
+        CHECK(coroutine_status(sch, state.to) == COROUTINE_DEAD);
+        coroutine_close(sch);
+
+        // generator steps driven from an async body switch between the two
+        upromise_dispatcher_options_t options = {(upromise_stack_mode)mode, 0, UPROMISE_IO_EPOLL};
+        auto dispatcher = std::make_shared<upromise::Dispatcher>(options);
+        auto Fn = upromise::generator(
+            dispatcher,
+            [=](upromise::Generator *gen) -> void *
+            {
+                void *receive;
+                Yield(receive, gen, sentinel);
+                Yield(receive, gen, sentinel3);
+                CHECK(receive == sentinel2);
+                return dummy;
+            });
+        auto steps = Int(0);
+        auto fn = upromise::async(
+            dispatcher,
+            [=](upromise::AsyncContext ctx) -> void *
+            {
+                auto gen = Fn();
+                auto iter = gen.next();
+                CHECK(iter.data == sentinel);
+                iter = gen.next(sentinel2);
+                CHECK(iter.data == sentinel3);
+                iter = gen.next();
+                CHECK(iter.done == true);
+                CHECK(iter.data == dummy);
+                *steps += 1;
+                return nullptr;
+            });
+        fn();
+        dispatcher->run();
+        CHECK(*steps == 1);
+
+        // chained handoffs must not pile up frames on the dispatcher stack
+        const int many = 200000;
+        auto Counter = upromise::generator(
+            dispatcher,
+            [=](upromise::Generator *gen) -> void *
+            {
+                void *receive;
+                for (int i = 0; i < many; i++)
+                    Yield(receive, gen, dummy);
+                CHECK(receive == nullptr);
+                return sentinel;
+            });
+        auto loop = upromise::async(
+            dispatcher,
+            [=](upromise::AsyncContext ctx) -> void *
+            {
+                auto gen = Counter();
+                int yielded = 0;
+                while (!gen.next().done)
+                    yielded++;
+                CHECK(yielded == many);
+                *steps += 1;
+                return nullptr;
+            });
+        loop();
+        dispatcher->run();
+        CHECK(*steps == 2);
+    }
+}
+
+struct Unwound
+{
+    std::shared_ptr<int> count;
+    ~Unwound() { *count += 1; }
+};
+
+TEST_CASE("cancel tokens", "[async]")
+{
+    auto dispatcher = std::make_shared<upromise::Dispatcher>();
+    auto adapter = Adapter(dispatcher);
+    upromise::CancelToken token(dispatcher);
+
+    SECTION("a default-constructed token throws instead of dereferencing null")
+    {
+        upromise::CancelToken empty;
+        CHECK_THROWS_AS(empty.cancel(), std::runtime_error);
+        CHECK_THROWS_AS(empty.cancelled(), std::runtime_error);
+        CHECK_THROWS_AS(empty.reason(), std::runtime_error);
+        CHECK_THROWS_AS(adapter.deferred().promise.cancel_on(empty), std::runtime_error);
+    }
+
+    SECTION("a cancelled promise rejects and releases its waiters")
+    {
+        auto d = adapter.deferred();
+        auto reason = std::make_shared<void *>(nullptr);
+        d.promise.cancel_on(token).then(
+            upromise::Promise::CallbackFn(),
+            upromise::Promise::CallbackFn(
+                [=](void *err) -> void *
+                {
+                    *reason = err;
+                    return nullptr;
+                }));
+        dispatcher->run();
+        CHECK(*reason == nullptr);
+        token.cancel(sentinel);
+        CHECK(d.promise.impl()->state == UPROMISE_PROMISE_STATE_REJECTED);
+        dispatcher->run();
+        CHECK(*reason == sentinel);
+        d.resolve(dummy);
+        CHECK(d.promise.impl()->data == sentinel);
+
+        // too late for a promise that has settled, at once for a cancelled token
+        auto settled = adapter.resolved(dummy);
+        settled.cancel_on(token);
+        CHECK(settled.impl()->state == UPROMISE_PROMISE_STATE_FULFILLED);
+        auto late = adapter.deferred();
+        late.promise.cancel_on(token);
+        CHECK(late.promise.impl()->state == UPROMISE_PROMISE_STATE_REJECTED);
+        CHECK(late.promise.impl()->data == sentinel);
+    }
+
+    SECTION("a cancelled then() lets go of a source that never settles")
+    {
+        struct Counted
+        {
+            std::shared_ptr<int> released;
+            Counted(std::shared_ptr<int> released) : released(released) {}
+            ~Counted() { ++*released; }
+        };
+        auto never = adapter.deferred();
+        auto released = std::make_shared<int>(0);
+        auto counted = std::make_shared<Counted>(released);
+        auto derived = never.promise.then(
+            [counted](void *data) -> void *
+            { return data; });
+        counted.reset();
+        derived.cancel_on(token);
+        dispatcher->run();
+        CHECK(never.promise.impl()->queue.head != nullptr);
+        CHECK(*released == 0);
+        token.cancel(sentinel);
+        CHECK(derived.impl()->state == UPROMISE_PROMISE_STATE_REJECTED);
+        CHECK(never.promise.impl()->queue.head == nullptr);
+        CHECK(*released == 1);
+        dispatcher->run();
+    }
+
+    SECTION("suspended async bodies unwind as soon as the token fires")
+    {
+        auto never = adapter.deferred();
+        auto unwound = Int(0);
+        auto finished = Int(0);
+        auto rejected = Int(0);
+        auto fn = upromise::async(
+            dispatcher,
+            token,
+            [=](upromise::AsyncContext ctx) -> void *
+            {
+                Unwound guard{unwound};
+                ctx.await(never.promise);
+                *finished += 1;
+                return nullptr;
+            });
+        for (int i = 0; i < 1000; i++)
+            fn().then(
+                upromise::Promise::CallbackFn(),
+                upromise::Promise::CallbackFn(
+                    [=](void *err) -> void *
+                    {
+                        CHECK(err == sentinel);
+                        *rejected += 1;
+                        return nullptr;
+                    }));
+        dispatcher->run();
+        CHECK(*unwound == 0);
+        CHECK(never.promise.impl()->queue.head != nullptr);
+
+        token.cancel(sentinel);
+        dispatcher->run();
+        CHECK(*unwound == 1000);
+        CHECK(*finished == 0);
+        CHECK(*rejected == 1000);
+        // every await waiter was taken off the promise that never settles
+        CHECK(never.promise.impl()->queue.head == nullptr);
+
+        // bodies started after the cancel fail at their first await
+        fn();
+        dispatcher->run();
+        CHECK(*unwound == 1001);
+        CHECK(*finished == 0);
+        never.resolve(dummy);
+    }
+
+    SECTION("a cancelled sleeper drops its timer")
+    {
+        auto unwound = Int(0);
+        auto fn = upromise::async(
+            dispatcher,
+            token,
+            [=](upromise::AsyncContext ctx) -> void *
+            {
+                Unwound guard{unwound};
+                ctx.sleep(60000);
+                return nullptr;
+            });
+        fn();
+        auto timeout = upromise::sleep(dispatcher, 60000, token);
+        dispatcher->run();
+        CHECK(dispatcher->dispatcher->timers.count == 2);
+
+        token.cancel(sentinel);
+        dispatcher->run();
+        CHECK(*unwound == 1);
+        CHECK(dispatcher->dispatcher->timers.count == 0);
+        CHECK(timeout.impl()->state == UPROMISE_PROMISE_STATE_REJECTED);
+        CHECK(timeout.impl()->data == sentinel);
+    }
+
+    SECTION("bodies that are not suspended see the cancel at their next await")
+    {
+        auto steps = Int(0);
+        auto fn = upromise::async(
+            dispatcher,
+            token,
+            [=, &token](upromise::AsyncContext ctx) -> void *
+            {
+                *steps += 1;
+                token.cancel(sentinel);
+                *steps += 1;
+                try
+                {
+                    ctx.await(adapter.resolved(dummy));
+                }
+                catch (upromise::Error err)
+                {
+                    CHECK(err.err == sentinel);
+                    *steps += 1;
+                }
+                return dummy;
+            });
+        auto result = fn();
+        dispatcher->run();
+        CHECK(*steps == 3);
+        CHECK(result.impl()->state == UPROMISE_PROMISE_STATE_REJECTED);
+        CHECK(result.impl()->data == sentinel);
+    }
+
+    SECTION("async generators take the cancel at their AYield")
+    {
+        auto never = adapter.deferred();
+        auto unwound = Int(0);
+        auto Fn = upromise::agen(
+            dispatcher,
+            [=](upromise::AsyncGenerator *gen, upromise::Promise first) -> void *
+            {
+                Unwound guard{unwound};
+                void *receive;
+                AYield(receive, gen, first);
+                // both generators are cancelled before they get here
+                FAIL("resumed past a cancelled AYield");
+                return receive;
+            });
+        auto reason = std::make_shared<void *>(nullptr);
+        auto on_reject = upromise::Promise::CallbackFn(
+            [=](void *err) -> void *
+            {
+                *reason = err;
+                return nullptr;
+            });
+
+        // waiting on the promise it yielded
+        auto waiting = Fn(never.promise);
+        waiting.cancel_on(token);
+        waiting.next().then(upromise::Promise::CallbackFn(), on_reject);
+        dispatcher->run();
+        CHECK(*unwound == 0);
+        token.cancel(sentinel);
+        dispatcher->run();
+        CHECK(*unwound == 1);
+        CHECK(*reason == sentinel);
+        CHECK(never.promise.impl()->queue.head == nullptr);
+
+        // parked until the next next()
+        upromise::CancelToken second(dispatcher);
+        auto parked = Fn(adapter.resolved(sentinel));
+        parked.cancel_on(second);
+        parked.next().then(
+            [=](void *data_raw) -> void *
+            {
+                auto data = (upromise::Generator::Result *)data_raw;
+                CHECK(data->data == sentinel);
+                free(data);
+                return nullptr;
+            });
+        dispatcher->run();
+        CHECK(*unwound == 1);
+        second.cancel(sentinel2);
+        dispatcher->run();
+        CHECK(*unwound == 2);
+        *reason = nullptr;
+        parked.next().then(
+            [=](void *data_raw) -> void *
+            {
+                auto data = (upromise::Generator::Result *)data_raw;
+                CHECK(data->done == 1);
+                free(data);
+                return nullptr;
+            },
+            on_reject);
+        dispatcher->run();
+        CHECK(*reason == nullptr);
+        never.resolve(dummy);
+    }
+}
@@ -0,0 +1,162 @@
+#include <catch2/catch.hpp>
+#include <upromise/upromise.h>
+#include "test.hpp"
+#include <stdlib.h>
+
+extern void *dummy;
+extern void *sentinel;
+extern void *sentinel2;
+extern void *sentinel3;
+
+TEST_CASE("combinators", "[combinators]")
+{
+    auto dispatcher = std::make_shared<upromise::Dispatcher>();
+    auto adapter = Adapter(dispatcher);
+    auto a = adapter.deferred();
+    auto b = adapter.deferred();
+    auto value = std::make_shared<void *>(nullptr);
+    auto reason = std::make_shared<void *>(nullptr);
+    auto on_value = upromise::Promise::CallbackFn(
+        [=](void *data) -> void *
+        {
+            *value = data;
+            return nullptr;
+        });
+    auto on_reason = upromise::Promise::CallbackFn(
+        [=](void *data) -> void *
+        {
+            *reason = data;
+            return nullptr;
+        });
+
+    SECTION("all keeps input order and waits for every value")
+    {
+        upromise::all(dispatcher, {a.promise, adapter.resolved(sentinel2), b.promise}).then(on_value, on_reason);
+        b.resolve(sentinel3);
+        dispatcher->run();
+        CHECK(*value == nullptr);
+        a.resolve(sentinel);
+        dispatcher->run();
+        auto values = (void **)*value;
+        REQUIRE(values != nullptr);
+        CHECK(values[0] == sentinel);
+        CHECK(values[1] == sentinel2);
+        CHECK(values[2] == sentinel3);
+        CHECK(*reason == nullptr);
+        free(values);
+    }
+
+    SECTION("all rejects with the first reason")
+    {
+        upromise::all(dispatcher, {a.promise, b.promise}).then(on_value, on_reason);
+        b.reject(sentinel2);
+        dispatcher->run();
+        CHECK(*reason == sentinel2);
+        a.reject(sentinel);
+        dispatcher->run();
+        CHECK(*reason == sentinel2);
+        CHECK(*value == nullptr);
+    }
+
+    SECTION("all_settled reports every outcome")
+    {
+        upromise::all_settled(dispatcher, {a.promise, b.promise}).then(on_value);
+        a.reject(sentinel);
+        dispatcher->run();
+        CHECK(*value == nullptr);
+        b.resolve(sentinel2);
+        dispatcher->run();
+        auto results = (upromise_settled_t *)*value;
+        REQUIRE(results != nullptr);
+        CHECK(results[0].state == UPROMISE_PROMISE_STATE_REJECTED);
+        CHECK(results[0].data == sentinel);
+        CHECK(results[1].state == UPROMISE_PROMISE_STATE_FULFILLED);
+        CHECK(results[1].data == sentinel2);
+        free(results);
+    }
+
+    SECTION("race follows the first to settle")
+    {
+        upromise::race(dispatcher, {a.promise, b.promise}).then(on_value, on_reason);
+        b.reject(sentinel2);
+        a.resolve(sentinel);
+        dispatcher->run();
+        CHECK(*reason == sentinel2);
+        CHECK(*value == nullptr);
+    }
+
+    SECTION("any takes the first value, or every reason")
+    {
+        upromise::any(dispatcher, {a.promise, b.promise}).then(on_value, on_reason);
+        a.reject(sentinel);
+        dispatcher->run();
+        CHECK(*reason == nullptr);
+        b.resolve(sentinel2);
+        dispatcher->run();
+        CHECK(*value == sentinel2);
+
+        auto c = adapter.deferred();
+        upromise::any(dispatcher, {c.promise, adapter.rejected(sentinel3)}).then(on_value, on_reason);
+        c.reject(sentinel);
+        dispatcher->run();
+        auto reasons = (void **)*reason;
+        REQUIRE(reasons != nullptr);
+        CHECK(reasons[0] == sentinel);
+        CHECK(reasons[1] == sentinel3);
+        free(reasons);
+    }
+
+    SECTION("adopted and empty inputs")
+    {
+        auto adopted = adapter.resolved(b.promise);
+        upromise::all(dispatcher, {adopted, a.promise}).then(on_value);
+        a.resolve(sentinel);
+        b.resolve(sentinel2);
+        dispatcher->run();
+        auto values = (void **)*value;
+        REQUIRE(values != nullptr);
+        CHECK(values[0] == sentinel2);
+        CHECK(values[1] == sentinel);
+        free(values);
+
+        auto empty = upromise::all(dispatcher, {});
+        CHECK(empty.impl()->state == UPROMISE_PROMISE_STATE_FULFILLED);
+        free(empty.impl()->data);
+        auto none = upromise::any(dispatcher, {});
+        CHECK(none.impl()->state == UPROMISE_PROMISE_STATE_REJECTED);
+        free(none.impl()->data);
+        auto never = upromise::race(dispatcher, {});
+        dispatcher->run();
+        CHECK(never.impl()->state == UPROMISE_PROMISE_STATE_PENDING);
+    }
+
+    SECTION("a count too large to allocate rejects")
+    {
+        // the promises are never read, the size check comes first
+        auto huge = upromise::Promise(dispatcher, upromise_promise_all(dispatcher->dispatcher, nullptr, SIZE_MAX));
+        CHECK(huge.impl()->state == UPROMISE_PROMISE_STATE_REJECTED);
+        CHECK(huge.impl()->data == upromise_nomem_error);
+    }
+
+    SECTION("fan-in over many inputs")
+    {
+        std::vector<Adapter::Defer> inputs;
+        std::vector<upromise::Promise> promises;
+        for (int i = 0; i < 1000; i++)
+        {
+            inputs.push_back(adapter.deferred());
+            promises.push_back(inputs.back().promise);
+        }
+        upromise::all(dispatcher, promises).then(on_value);
+        for (int i = 999; i >= 0; i--)
+            inputs[i].resolve((void *)(intptr_t)(i + 1));
+        dispatcher->run();
+        auto values = (void **)*value;
+        REQUIRE(values != nullptr);
+        bool ordered = true;
+        for (int i = 0; i < 1000; i++)
+            ordered = ordered && values[i] == (void *)(intptr_t)(i + 1);
+        CHECK(ordered);
+        free(values);
+    }
+}
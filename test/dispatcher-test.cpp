@@ -0,0 +1,304 @@
+#include <catch2/catch.hpp>
+#include <upromise/async.h>
+#include "test.hpp"
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std::chrono_literals;
+
+TEST_CASE("run forever", "[dispatcher]")
+{
+    auto dispatcher = std::make_shared<upromise::Dispatcher>();
+
+    SECTION("sleeps until posted work and returns on stop")
+    {
+        int count = 0;
+        std::thread producer(
+            [&]()
+            {
+                for (int i = 0; i < 100; i++)
+                {
+                    dispatcher->post([&]()
+                                     { count += 1; });
+                    if (i % 10 == 0)
+                        std::this_thread::sleep_for(1ms);
+                }
+                dispatcher->post([&]()
+                                 { dispatcher->stop(); });
+            });
+        dispatcher->run_forever();
+        producer.join();
+        CHECK(count == 100);
+    }
+
+    SECTION("a stop requested up front ends the next run")
+    {
+        dispatcher->stop();
+        dispatcher->run_forever();
+        SUCCEED();
+    }
+}
+
+TEST_CASE("timers", "[timers]")
+{
+    auto dispatcher = std::make_shared<upromise::Dispatcher>();
+
+    SECTION("fire in deadline order and can be cancelled")
+    {
+        struct Entry
+        {
+            upromise_timer_t timer;
+            int delay;
+            std::vector<int> *order;
+        };
+        std::vector<int> order;
+        int delays[] = {90, 5, 40, 70, 1, 20, 130, 66};
+        std::vector<Entry> entries(8);
+        for (int i = 0; i < 8; i++)
+        {
+            entries[i] = Entry{{}, delays[i], &order};
+            upromise_timer_start(
+                dispatcher->dispatcher, &entries[i].timer, delays[i],
+                [](void *ctx)
+                {
+                    auto entry = (Entry *)ctx;
+                    entry->order->push_back(entry->delay);
+                },
+                &entries[i]);
+        }
+        CHECK(upromise_timer_cancel(dispatcher->dispatcher, &entries[2].timer) == 1);
+        CHECK(upromise_timer_cancel(dispatcher->dispatcher, &entries[2].timer) == 0);
+
+        auto start = upromise_dispatcher_now(dispatcher->dispatcher);
+        upromise_timer_t stop = {};
+        upromise_timer_start(
+            dispatcher->dispatcher, &stop, 150,
+            [](void *ctx)
+            { ((upromise::Dispatcher *)ctx)->stop(); },
+            dispatcher.get());
+        dispatcher->run_forever();
+        CHECK(upromise_dispatcher_now(dispatcher->dispatcher) - start >= 150);
+        CHECK(order == std::vector<int>{1, 5, 20, 66, 70, 90, 130});
+    }
+
+    SECTION("sleep promise and awaitable sleep")
+    {
+        auto start = upromise_dispatcher_now(dispatcher->dispatcher);
+        auto slept = Int(0);
+        upromise::sleep(dispatcher, 30).then(
+            [=](void *) -> void *
+            {
+                *slept += 1;
+                return nullptr;
+            });
+        auto fn = upromise::async(
+            dispatcher,
+            [=](upromise::AsyncContext ctx) -> void *
+            {
+                ctx.sleep(10);
+                *slept += 1;
+                ctx.sleep(40);
+                *slept += 1;
+                dispatcher->stop();
+                return nullptr;
+            });
+        fn();
+        dispatcher->run_forever();
+        CHECK(*slept == 3);
+        CHECK(upromise_dispatcher_now(dispatcher->dispatcher) - start >= 50);
+    }
+
+    SECTION("deadlines across a top-level boundary")
+    {
+        // 2^24 - 10, the deadline lies in the next level-3 slot
+        static uint64_t clock;
+        clock = 16777206;
+        auto timers = &dispatcher->dispatcher->timers;
+        timers->clock = []() -> uint64_t
+        { return clock; };
+        timers->now = clock;
+        int fired = 0;
+        upromise_timer_t timer = {};
+        upromise_timer_start(
+            dispatcher->dispatcher, &timer, 20,
+            [](void *ctx)
+            { *(int *)ctx += 1; },
+            &fired);
+        CHECK(upromise_dispatcher_run_n(dispatcher->dispatcher, 1).timeout_ms <= 20);
+        clock += 19;
+        dispatcher->run();
+        CHECK(fired == 0);
+        clock += 1;
+        dispatcher->run();
+        CHECK(fired == 1);
+    }
+
+    SECTION("a delay past the end of the clock waits forever")
+    {
+        int fired = 0;
+        upromise_timer_t timer = {};
+        upromise_timer_start(
+            dispatcher->dispatcher, &timer, UINT64_MAX,
+            [](void *ctx)
+            { *(int *)ctx += 1; },
+            &fired);
+        auto result = upromise_dispatcher_run_n(dispatcher->dispatcher, 1);
+        CHECK(fired == 0);
+        CHECK(result.timeout_ms > 1000);
+        CHECK(upromise_timer_cancel(dispatcher->dispatcher, &timer) == 1);
+    }
+    SECTION("equal deadlines fire in start order, timers started from a timer")
+    {
+        struct Entry
+        {
+            upromise_timer_t timer;
+            int id;
+            std::vector<int> *order;
+            upromise_dispatcher_t *dispatcher;
+        };
+        std::vector<int> order;
+        std::vector<Entry> entries(4);
+        for (int i = 0; i < 4; i++)
+        {
+            entries[i] = Entry{{}, i, &order, dispatcher->dispatcher};
+            upromise_timer_start(
+                dispatcher->dispatcher, &entries[i].timer, 10,
+                [](void *ctx)
+                {
+                    auto entry = (Entry *)ctx;
+                    entry->order->push_back(entry->id);
+                    // a timer restarted from its own callback fires on a later pass
+                    if (entry->id < 4)
+                    {
+                        entry->id += 4;
+                        upromise_timer_start(entry->dispatcher, &entry->timer, 5, entry->timer.fn, entry);
+                    }
+                },
+                &entries[i]);
+        }
+        upromise_timer_t stop = {};
+        upromise_timer_start(
+            dispatcher->dispatcher, &stop, 40,
+            [](void *ctx)
+            { ((upromise::Dispatcher *)ctx)->stop(); },
+            dispatcher.get());
+        dispatcher->run_forever();
+        CHECK(order == std::vector<int>{0, 1, 2, 3, 4, 5, 6, 7});
+    }
+}
+
+TEST_CASE("budgeted runs", "[budget]")
+{
+    auto dispatcher = std::make_shared<upromise::Dispatcher>();
+    int count = 0;
+    for (int i = 0; i < 1000; i++)
+        dispatcher->post([&]()
+                         { count += 1; });
+
+    SECTION("run_n stops after the task budget")
+    {
+        auto result = dispatcher->run_n(100);
+        CHECK(result.ran == 100);
+        CHECK(count == 100);
+        CHECK(result.remaining);
+        CHECK(result.queued == 900);
+        CHECK(result.timeout_ms == -1);
+        result = dispatcher->run_n(10000);
+        CHECK(result.ran == 900);
+        CHECK(!result.remaining);
+        CHECK(result.queued == 0);
+    }
+
+    SECTION("run_for stops once the time budget is spent")
+    {
+        for (int i = 0; i < 64; i++)
+            dispatcher->post([]()
+                             { std::this_thread::sleep_for(1ms); });
+        upromise_timer_t timer = {};
+        upromise_timer_start(
+            dispatcher->dispatcher, &timer, 1000, [](void *) {}, nullptr);
+        auto result = dispatcher->run_for(0ms);
+        CHECK(result.ran == 16);
+        CHECK(result.remaining);
+        CHECK(result.timeout_ms > 0);
+        while (result.remaining)
+            result = dispatcher->run_for(5ms);
+        CHECK(count == 1000);
+        upromise_timer_cancel(dispatcher->dispatcher, &timer);
+    }
+}
+
+TEST_CASE("priority lanes", "[priority]")
+{
+    auto dispatcher = std::make_shared<upromise::Dispatcher>();
+    auto resolved = [&]()
+    {
+        return upromise::Promise(
+            dispatcher,
+            [](upromise::Promise::ResolveNotifyFn resolve, upromise::Promise::NotifyFn)
+            {
+                resolve(nullptr);
+            });
+    };
+
+    SECTION("urgent continuations overtake queued background work")
+    {
+        std::string order;
+        dispatcher->set_priority(UPROMISE_PRIORITY_BACKGROUND);
+        for (int i = 0; i < 10; i++)
+            resolved().then(
+                [&](void *) -> void *
+                {
+                    order += 'b';
+                    return nullptr;
+                });
+        dispatcher->set_priority(UPROMISE_PRIORITY_HIGH);
+        resolved().then(
+            [&](void *) -> void *
+            {
+                order += 'h';
+                return nullptr;
+            });
+        dispatcher->set_priority(UPROMISE_PRIORITY_NORMAL);
+        resolved().then(
+            [&](void *) -> void *
+            {
+                order += 'n';
+                return nullptr;
+            });
+        dispatcher->run();
+        CHECK(order == "hnbbbbbbbbbb");
+    }
+
+    SECTION("background work advances under sustained urgent load")
+    {
+        int iteration = 0;
+        int background_at = -1;
+        dispatcher->set_priority(UPROMISE_PRIORITY_BACKGROUND);
+        resolved().then(
+            [&](void *) -> void *
+            {
+                background_at = iteration;
+                return nullptr;
+            });
+        dispatcher->set_priority(UPROMISE_PRIORITY_HIGH);
+        auto fn = upromise::async(
+            dispatcher,
+            [&](upromise::AsyncContext ctx) -> void *
+            {
+                // every await waits on a fresh then() and requeues the
+                // body in the high lane
+                for (; iteration < 1000; iteration++)
+                    ctx.await(resolved().then([](void *data) -> void * { return data; }));
+                return nullptr;
+            });
+        fn();
+        dispatcher->set_priority(UPROMISE_PRIORITY_NORMAL);
+        dispatcher->run();
+        CHECK(iteration == 1000);
+        CHECK(background_at >= 0);
+        CHECK(background_at <= UPROMISE_PRIORITY_BOUND);
+    }
+}
@@ -0,0 +1,347 @@
+#include <catch2/catch.hpp>
+#include <upromise/async.h>
+#include <upromise/executor.h>
+#include "test.hpp"
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <sys/resource.h>
+#include <unistd.h>
+
+extern void *dummy;
+
+using namespace std::chrono_literals;
+
+TEST_CASE("executor", "[executor]")
+{
+    SECTION("jobs run their promises and coroutines on a worker")
+    {
+        std::atomic<int> count(0);
+        {
+            upromise::Executor executor(4);
+            for (int i = 0; i < 1000; i++)
+                executor.post(
+                    [&](const std::shared_ptr<upromise::Dispatcher> &dispatcher)
+                    {
+                        auto fn = upromise::async(
+                            dispatcher,
+                            [&, dispatcher](upromise::AsyncContext ctx) -> void *
+                            {
+                                auto value = ctx.await(upromise::Promise(
+                                    dispatcher,
+                                    [](upromise::Promise::ResolveNotifyFn resolve, upromise::Promise::NotifyFn)
+                                    {
+                                        resolve(dummy);
+                                    }));
+                                if (value == dummy)
+                                    count.fetch_add(1);
+                                return nullptr;
+                            });
+                        fn();
+                    });
+            executor.wait();
+            CHECK(count.load() == 1000);
+        }
+    }
+
+    SECTION("idle workers steal nested jobs")
+    {
+        std::atomic<int> count(0);
+        std::atomic<bool> stolen(false);
+        upromise::Executor executor(4);
+        executor.post(
+            [&](const std::shared_ptr<upromise::Dispatcher> &)
+            {
+                auto owner = std::this_thread::get_id();
+                for (int i = 0; i < 64; i++)
+                    executor.post(
+                        [&, owner, i](const std::shared_ptr<upromise::Dispatcher> &)
+                        {
+                            if (std::this_thread::get_id() != owner)
+                                stolen = true;
+                            // the owner blocks on its first job until a thief shows up
+                            if (i == 63)
+                            {
+                                auto deadline = std::chrono::steady_clock::now() + 5s;
+                                while (!stolen && std::chrono::steady_clock::now() < deadline)
+                                    std::this_thread::sleep_for(1ms);
+                            }
+                            count.fetch_add(1);
+                        });
+            });
+        executor.wait();
+        CHECK(count.load() == 64);
+        CHECK(stolen.load());
+    }
+}
+
+static void hold(upromise_promise_t *promise, void *ctx)
+{
+    *(upromise_promise_t **)ctx = promise;
+}
+
+static void *count_value(void *data, void **error, void *ctx)
+{
+    if (data == dummy)
+        *(int *)ctx += 1;
+    return nullptr;
+}
+
+TEST_CASE("cross-thread resolve", "[executor]")
+{
+    const int threads = 4;
+    const int per_thread = 1000;
+    upromise_dispatcher_t *dispatcher = new_upromise_dispatcher();
+    int count = 0;
+    std::vector<upromise_promise_t *> promises;
+    for (int i = 0; i < threads * per_thread; i++)
+    {
+        upromise_promise_t *promise = nullptr;
+        del_upromise_promise(new_upromise_promise(dispatcher, hold, &promise));
+        del_upromise_promise(upromise_promise_then(promise, &count, count_value, nullptr));
+        promises.push_back(promise);
+    }
+
+    std::atomic<int> posted(0);
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; t++)
+        workers.emplace_back(
+            [&, t]()
+            {
+                for (int i = 0; i < per_thread; i++)
+                    resolve_upromise_promise_threadsafe(promises[t * per_thread + i], dummy);
+                upromise_dispatcher_post(
+                    dispatcher, [](void *ctx)
+                    { ((std::atomic<int> *)ctx)->fetch_add(1); },
+                    &posted);
+            });
+
+    auto deadline = std::chrono::steady_clock::now() + 10s;
+    while ((count < threads * per_thread || posted.load() < threads) && std::chrono::steady_clock::now() < deadline)
+    {
+        upromise_dispatcher_run(dispatcher);
+        std::this_thread::yield();
+    }
+    for (auto &it : workers)
+        it.join();
+    CHECK(count == threads * per_thread);
+    CHECK(posted.load() == threads);
+    del_upromise_dispatcher(dispatcher);
+}
+
+static void *count_atomic(void *data, void **error, void *ctx)
+{
+    if (data == dummy)
+        ((std::atomic<int> *)ctx)->fetch_add(1);
+    return nullptr;
+}
+
+TEST_CASE("idle workers serve their dispatchers", "[executor]")
+{
+    std::atomic<int> count(0);
+    upromise_promise_t *promise = nullptr;
+    std::shared_ptr<upromise::Dispatcher> owner;
+    upromise::Executor executor(2);
+    auto leave_pending = [&](const std::shared_ptr<upromise::Dispatcher> &dispatcher)
+    {
+        owner = dispatcher;
+        del_upromise_promise(new_upromise_promise(dispatcher->dispatcher, hold, &promise));
+        del_upromise_promise(upromise_promise_then(promise, &count, count_atomic, nullptr));
+    };
+
+    SECTION("wait() covers timers and posted continuations")
+    {
+        executor.post(
+            [&](const std::shared_ptr<upromise::Dispatcher> &dispatcher)
+            {
+                upromise::sleep(dispatcher, 20).then(
+                    [&](void *) -> void *
+                    {
+                        count.fetch_add(1);
+                        return nullptr;
+                    });
+                auto fn = upromise::async(
+                    dispatcher,
+                    [&](upromise::AsyncContext ctx) -> void *
+                    {
+                        ctx.sleep(10);
+                        count.fetch_add(1);
+                        return nullptr;
+                    });
+                fn();
+                leave_pending(dispatcher);
+            });
+        executor.wait();
+        CHECK(count.load() == 2);
+        executor.post(owner, [&]()
+                      {
+                          resolve_upromise_promise(promise, dummy);
+                          del_upromise_promise(promise);
+                      });
+        executor.wait();
+        CHECK(count.load() == 3);
+    }
+
+    SECTION("a threadsafe resolve wakes the parked worker")
+    {
+        executor.post(leave_pending);
+        executor.wait();
+        CHECK(count.load() == 0);
+        resolve_upromise_promise_threadsafe(promise, dummy);
+        auto deadline = std::chrono::steady_clock::now() + 5s;
+        while (count.load() == 0 && std::chrono::steady_clock::now() < deadline)
+            std::this_thread::sleep_for(1ms);
+        CHECK(count.load() == 1);
+    }
+}
+
+TEST_CASE("async bodies need an executor that can move them", "[executor]")
+{
+    auto elsewhere = std::make_shared<upromise::Dispatcher>();
+    auto body = [](upromise::AsyncContext) -> void * { return nullptr; };
+    upromise::Executor shared(2, {UPROMISE_STACK_SHARED, 0, UPROMISE_IO_EPOLL});
+    CHECK_FALSE(shared.movable());
+    CHECK_THROWS_AS(shared.async(elsewhere, body), std::runtime_error);
+
+    upromise::Executor dedicated(2);
+#ifdef UPROMISE_ATOMIC_REFCOUNT
+    CHECK(dedicated.movable());
+#else
+    CHECK_FALSE(dedicated.movable());
+    CHECK_THROWS_AS(dedicated.async(elsewhere, body), std::runtime_error);
+#endif
+}
+
+#ifdef UPROMISE_ATOMIC_REFCOUNT
+TEST_CASE("async bodies move between workers", "[executor]")
+{
+    const int bodies = 8;
+    std::atomic<int> moved(0);
+    std::atomic<int> settled(0);
+    upromise::Executor executor(4);
+    // thread ids read through pthread_self() may be cached across an
+    // await, the worker's dispatcher is looked up anew
+    auto worker = [&]()
+    { return executor.current().get(); };
+    executor.post(
+        [&](const std::shared_ptr<upromise::Dispatcher> &dispatcher)
+        {
+            for (int i = 0; i < bodies; i++)
+                executor.async(
+                    dispatcher,
+                    [&](upromise::AsyncContext ctx) -> void *
+                    {
+                        auto started = worker();
+                        auto deadline = std::chrono::steady_clock::now() + 5s;
+                        while (worker() == started && std::chrono::steady_clock::now() < deadline)
+                        {
+                            auto pending = upromise::Promise(
+                                executor.current(),
+                                [](upromise::Promise::ResolveNotifyFn resolve, upromise::Promise::NotifyFn)
+                                {
+                                    resolve(dummy);
+                                });
+                            ctx.await(pending.then([](void *data) -> void * { return data; }));
+                            // keep this worker busy until another one takes the body
+                            if (worker() == started)
+                                std::this_thread::sleep_for(1ms);
+                        }
+                        if (worker() != started)
+                            moved.fetch_add(1);
+                        return dummy;
+                    })
+                    .then(
+                        [&, home = dispatcher.get()](void *data) -> void *
+                        {
+                            if (data == dummy && worker() == home)
+                                settled.fetch_add(1);
+                            return nullptr;
+                        });
+        });
+    executor.wait();
+    CHECK(moved.load() == bodies);
+    CHECK(settled.load() == bodies);
+}
+
+TEST_CASE("handles dropped on several threads", "[executor]")
+{
+    const int threads = 4;
+    const int per_thread = 2000;
+    auto dispatcher = std::make_shared<upromise::Dispatcher>();
+    auto adapter = Adapter(dispatcher);
+    std::vector<std::vector<upromise::Promise>> slices(threads);
+    for (int t = 0; t < threads; t++)
+        for (int i = 0; i < per_thread; i++)
+        {
+            // redirected promises release their target along with them
+            auto outer = adapter.deferred();
+            auto inner = adapter.deferred();
+            outer.resolve(inner.promise);
+            slices[t].push_back(i % 2 == 0 ? outer.promise : adapter.resolved(dummy));
+        }
+
+    std::atomic<int> finished(0);
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; t++)
+        workers.emplace_back(
+            [&, t]()
+            {
+                for (auto &it : slices[t])
+                {
+                    auto copy = it;
+                    std::vector<upromise::Promise> copies(4, copy);
+                }
+                // the last handles go away here, off the dispatcher thread
+                slices[t].clear();
+                finished.fetch_add(1);
+            });
+
+    // meanwhile the dispatcher thread keeps taking objects from its pool
+    size_t created = 0;
+    while (finished.load() < threads)
+    {
+        adapter.resolved(dummy);
+        created += 1;
+    }
+    for (auto &it : workers)
+        it.join();
+
+    void *value = nullptr;
+    adapter.resolved(dummy).then(
+        [&](void *data) -> void *
+        {
+            value = data;
+            return nullptr;
+        });
+    dispatcher->run();
+    CHECK(value == dummy);
+    CHECK(created > 0);
+}
+#endif
+
+TEST_CASE("a dispatcher needs its wake fd", "[executor]")
+{
+    // with the descriptor limit at the lowest free fd no new one can open
+    struct rlimit saved;
+    REQUIRE(getrlimit(RLIMIT_NOFILE, &saved) == 0);
+    int lowest = dup(0);
+    REQUIRE(lowest >= 0);
+    close(lowest);
+    struct rlimit tight = saved;
+    tight.rlim_cur = lowest;
+    REQUIRE(setrlimit(RLIMIT_NOFILE, &tight) == 0);
+    upromise_dispatcher_t *dispatcher = new_upromise_dispatcher();
+    bool threw = false;
+    try
+    {
+        upromise::Dispatcher wrapped;
+    }
+    catch (const std::runtime_error &)
+    {
+        threw = true;
+    }
+    setrlimit(RLIMIT_NOFILE, &saved);
+    CHECK(dispatcher == nullptr);
+    CHECK(threw);
+}
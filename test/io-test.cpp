@@ -0,0 +1,188 @@
+#include <catch2/catch.hpp>
+#include <upromise/async.h>
+#include <upromise/io.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+static void set_nonblock(int fd)
+{
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+TEST_CASE("reactor", "[io]")
+{
+    // io_uring falls back to epoll when it is not built or not allowed
+    auto backend = GENERATE(UPROMISE_IO_EPOLL, UPROMISE_IO_URING);
+    upromise_dispatcher_options_t options = {UPROMISE_STACK_SHARED, 0, backend};
+    auto dispatcher = std::make_shared<upromise::Dispatcher>(options);
+
+    SECTION("await suspends on a unix socket until the peer writes")
+    {
+        int fds[2];
+        REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+        set_nonblock(fds[0]);
+        set_nonblock(fds[1]);
+        std::string received;
+        bool readable = false;
+        upromise::readable(dispatcher, fds[0]).then(
+            [&](void *) -> void *
+            {
+                readable = true;
+                return nullptr;
+            });
+        auto fn = upromise::async(
+            dispatcher,
+            [&](upromise::AsyncContext ctx) -> void *
+            {
+                // not on the coroutine stack, a shared stack is copied out while suspended
+                std::vector<char> buffer(64);
+                intptr_t n;
+                while ((n = (intptr_t)ctx.await(upromise::read(dispatcher, fds[0], buffer.data(), buffer.size()))) > 0)
+                    received.append(buffer.data(), n);
+                dispatcher->stop();
+                return nullptr;
+            });
+        fn();
+        auto writer = upromise::async(
+            dispatcher,
+            [&](upromise::AsyncContext ctx) -> void *
+            {
+                const char *parts[] = {"hello", ", ", "reactor"};
+                for (auto part : parts)
+                {
+                    ctx.sleep(5);
+                    ctx.await(upromise::write(dispatcher, fds[1], part, strlen(part)));
+                }
+                upromise_io_close(dispatcher->dispatcher, fds[1]);
+                return nullptr;
+            });
+        writer();
+        dispatcher->run_forever();
+        CHECK(readable);
+        CHECK(received == "hello, reactor");
+        upromise_io_close(dispatcher->dispatcher, fds[0]);
+    }
+
+    SECTION("echo over loopback tcp")
+    {
+        int listener = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        REQUIRE(listener >= 0);
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t addr_len = sizeof(addr);
+        REQUIRE(bind(listener, (sockaddr *)&addr, sizeof(addr)) == 0);
+        REQUIRE(listen(listener, 16) == 0);
+        REQUIRE(getsockname(listener, (sockaddr *)&addr, &addr_len) == 0);
+
+        // larger than the socket buffers, so writes have to wait as well
+        std::string payload(4 << 20, 'x');
+        for (size_t i = 0; i < payload.size(); i++)
+            payload[i] = (char)('a' + i % 26);
+        std::string echoed;
+
+        auto server = upromise::async(
+            dispatcher,
+            [&](upromise::AsyncContext ctx) -> void *
+            {
+                int conn = (int)(intptr_t)ctx.await(upromise::accept(dispatcher, listener));
+                std::vector<char> buffer(16384);
+                intptr_t n;
+                while ((n = (intptr_t)ctx.await(upromise::read(dispatcher, conn, buffer.data(), buffer.size()))) > 0)
+                    ctx.await(upromise::write(dispatcher, conn, buffer.data(), n));
+                upromise_io_close(dispatcher->dispatcher, conn);
+                return nullptr;
+            });
+        server();
+
+        int client = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        REQUIRE(client >= 0);
+        int ret = connect(client, (sockaddr *)&addr, sizeof(addr));
+        REQUIRE((ret == 0 || errno == EINPROGRESS));
+        auto sender = upromise::async(
+            dispatcher,
+            [&](upromise::AsyncContext ctx) -> void *
+            {
+                ctx.await(upromise::writable(dispatcher, client));
+                ctx.await(upromise::write(dispatcher, client, payload.data(), payload.size()));
+                shutdown(client, SHUT_WR);
+                return nullptr;
+            });
+        sender();
+        auto receiver = upromise::async(
+            dispatcher,
+            [&](upromise::AsyncContext ctx) -> void *
+            {
+                std::vector<char> buffer(16384);
+                intptr_t n;
+                while ((n = (intptr_t)ctx.await(upromise::read(dispatcher, client, buffer.data(), buffer.size()))) > 0)
+                    echoed.append(buffer.data(), n);
+                dispatcher->stop();
+                return nullptr;
+            });
+        receiver();
+        dispatcher->run_forever();
+        CHECK(echoed.size() == payload.size());
+        CHECK(echoed == payload);
+        upromise_io_close(dispatcher->dispatcher, client);
+        upromise_io_close(dispatcher->dispatcher, listener);
+    }
+
+    SECTION("regular files are read to the end")
+    {
+        char path[] = "/tmp/upromise-io-XXXXXX";
+        int fd = mkstemp(path);
+        REQUIRE(fd >= 0);
+        unlink(path);
+        std::string content(1 << 20, 'x');
+        for (size_t i = 0; i < content.size(); i++)
+            content[i] = (char)(i * 7);
+        std::string received;
+        auto fn = upromise::async(
+            dispatcher,
+            [&](upromise::AsyncContext ctx) -> void *
+            {
+                ctx.await(upromise::write(dispatcher, fd, content.data(), content.size()));
+                lseek(fd, 0, SEEK_SET);
+                std::vector<char> buffer(65536);
+                intptr_t n;
+                while ((n = (intptr_t)ctx.await(upromise::read(dispatcher, fd, buffer.data(), buffer.size()))) > 0)
+                    received.append(buffer.data(), n);
+                dispatcher->stop();
+                return nullptr;
+            });
+        fn();
+        dispatcher->run_forever();
+        CHECK(received == content);
+        upromise_io_close(dispatcher->dispatcher, fd);
+    }
+
+    SECTION("closing an fd rejects its pending operations")
+    {
+        int fds[2];
+        REQUIRE(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds) == 0);
+        char buffer[8];
+        int error = 0;
+        upromise::read(dispatcher, fds[0], buffer, sizeof(buffer))
+            .then(upromise::Promise::CallbackFn(),
+                  upromise::Promise::CallbackFn(
+                      [&](void *reason) -> void *
+                      {
+                          error = (int)(intptr_t)reason;
+                          return nullptr;
+                      }));
+        dispatcher->run();
+        CHECK(error == 0);
+        upromise_io_close(dispatcher->dispatcher, fds[0]);
+        dispatcher->run();
+        CHECK(error == ECANCELED);
+        close(fds[1]);
+    }
+}
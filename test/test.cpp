@@ -1709,23 +1709,22 @@ TEST_CASE("2.3.3: Otherwise, if `x` is an object or function,", "[Promises/A+][2
         {
             auto xFactory = [=]() -> upromise::Thenable::Ptr
             {
-                auto x = std::make_shared<upromise::Thenable::Ptr>();
                 class T : public upromise::Thenable
                 {
-                    std::shared_ptr<upromise::Thenable::Ptr> x;
-
                 public:
-                    T(std::shared_ptr<upromise::Thenable::Ptr> x) : x(x) {}
+                    // weak, it points back at this thenable
+                    std::weak_ptr<upromise::Thenable> x;
                     virtual void then(ResolveNotifyFn onFulfilled, NotifyFn onRejected) override
                     {
-                        CHECK(this == (*x).get());
+                        CHECK(this == x.lock().get());
                         CHECK(onFulfilled != nullptr);
                         CHECK(onRejected != nullptr);
                         onFulfilled(nullptr);
                     }
                 };
-                *x = (upromise::Thenable::Ptr)std::make_shared<T>(x);
-                return *x;
+                auto x = std::make_shared<T>();
+                x->x = x;
+                return x;
             };
 
             testPromiseResolution(xFactory, promise, {
@@ -74,6 +74,10 @@ struct EventLoop
     std::mutex queue_lock;
     std::condition_variable cond;
     std::atomic<size_t> waiting;
+    // due timeouts go to the queue by deadline, then in the order they were
+    // set, whichever of their threads wakes first
+    std::map<std::pair<std::chrono::steady_clock::time_point, size_t>, std::function<void()>> timeouts;
+    size_t timeout_seq = 0;
     EventLoop() : dispatcher(std::make_shared<upromise::Dispatcher>()), waiting(0) {}
     ~EventLoop()
     {
@@ -124,15 +128,23 @@ inline std::function<void(std::function<void()> fn, std::chrono::duration<double
     return [=](std::function<void()> fn, auto duration)
     {
         loop->waiting.fetch_add(1);
-        std::chrono::duration<double> real_duration = std::chrono::duration_cast<std::chrono::duration<double>>(duration);
-        auto _fn = fn;
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(duration);
+        {
+            std::lock_guard<std::mutex> lock(loop->queue_lock);
+            loop->timeouts.emplace(std::make_pair(deadline, loop->timeout_seq++), fn);
+        }
         std::thread(
             [=]()
             {
-                std::this_thread::sleep_for(real_duration);
+                std::this_thread::sleep_until(deadline);
                 {
                     std::lock_guard<std::mutex> lock(loop->queue_lock);
-                    loop->event_queue.push(_fn);
+                    auto now = std::chrono::steady_clock::now();
+                    while (!loop->timeouts.empty() && loop->timeouts.begin()->first.first <= now)
+                    {
+                        loop->event_queue.push(loop->timeouts.begin()->second);
+                        loop->timeouts.erase(loop->timeouts.begin());
+                    }
                 }
                 loop->cond.notify_one();
             })